@@ -16,6 +16,10 @@ ffm2_library_solvers_dir = os.getenv('FFM_LIBRARY_SOLVERS_DIR',
                                      'fastfm-core2/_lib/fastfm/solvers')
 
 
+# Has to match the FASTFM_INDEX64 option of the core library build.
+index64 = os.getenv('FASTFM_INDEX64', 'OFF').upper() in ('ON', '1')
+
+
 def build():
     extensions = [
         Extension('ffm2', ['fastfm2/core/ffm2.pyx'],
@@ -26,6 +30,7 @@ def build():
                                 ffm2_solvers_include_dir,
                                 numpy.get_include()
                                 ],
+                  define_macros=[('FASTFM_INDEX64', '1')] if index64 else [],
                   extra_compile_args=['-std=c++11', '-Wall'],
                   extra_link_args=['-std=c++11', '-mstackrealign'],
                   language="c++")
@@ -15,10 +15,19 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <memory>
+#include <utility>
 
 #include "fastfm.h"
 #include "fastfm_impl.h"
+#include "feature_hashing.h"
+#include "model_io.h"
+#include "sample_order.h"
+#include "solvers/quantize.h"
+#include "solvers/row_predict.h"
 #include "solvers/solvers.h"
 
 #define LOGURU_IMPLEMENTATION 1
@@ -101,6 +110,32 @@ void Model::add_scalar_map(const std::string& keys,
   mImpl->coef_->setMapValues(keys, values, size);
 }
 
+void Model::save(const std::string& path) const {
+  io::SaveModel(*mImpl->coef_, path);
+}
+
+void Model::open_mmap(const std::string& path) {
+  std::string error;
+  CHECK(try_open_mmap(path, &error)) << error;
+}
+
+bool Model::try_open_mmap(const std::string& path, std::string* error) {
+  std::unique_ptr<io::MappedFile> file =
+      io::OpenModel(path, mImpl->coef_, error);
+  if (file == nullptr) return false;
+  mImpl->files_.emplace_back(std::move(file));
+  return true;
+}
+
+void Model::quantize(const std::string& type) {
+  if (type == "none") {
+    mImpl->coef_->set_quantized(nullptr);
+    return;
+  }
+  mImpl->coef_->set_quantized(std::make_shared<const QuantizedParam>(
+      quant::Quantize(*mImpl->coef_, type)));
+}
+
 Data::Data() : mImpl(new Data::Impl()) {}
 
 Data::~Data() {
@@ -137,15 +172,16 @@ void Data::add_sparse_matrix(const std::string& name,
                              double* data,
                              size_t rows,
                              size_t cols,
-                             int nnz,
-                             int* outer,
-                             int* inner,
+                             sparse_index_t nnz,
+                             sparse_index_t* outer,
+                             sparse_index_t* inner,
                              bool col_major) {
   if (name == "x" || name == "x_c" || name == "x_i") {
     if (col_major) { mImpl
           ->wrap_design_matrix_col_major(name, data, rows, cols, nnz, outer,
                                          inner);
     } else {
+      CHECK(data != nullptr) << "Binary `" << name << "` must be column major";
       mImpl->wrap_design_matrix_row_major(name, data, rows, cols, nnz, outer,
                                           inner);
     }
@@ -154,6 +190,59 @@ void Data::add_sparse_matrix(const std::string& name,
   }
 }
 
+void Data::reorder_samples(const std::string& method) {
+  CHECK(mImpl->has_col_major()) << "Reordering requires column major `x`";
+  auto x = mImpl->get_design_matrix_col_major();
+  const std::vector<int> perm = order::SampleOrder(method, x);
+  mImpl->permute_samples(order::PermuteRows(x, perm), perm, method);
+}
+
+std::shared_ptr<const Model> Model::snapshot() const {
+  std::shared_ptr<Model> copy(new Model());
+  delete copy->mImpl->coef_;
+  copy->mImpl->coef_ = mImpl->coef_->deep_copy().release();
+  // Feature major factors for the row wise prediction kernels.
+  copy->mImpl->coef_->to_w2_feature_major();
+  return copy;
+}
+
+std::shared_ptr<const Model> Model::open_snapshot(const std::string& path,
+                                                  std::string* error) {
+  std::shared_ptr<Model> model(new Model());
+  if (!model->try_open_mmap(path, error)) return nullptr;
+  model->mImpl->coef_->to_w2_feature_major();
+  return model;
+}
+
+SharedModel::SharedModel(std::shared_ptr<const Model> model)
+    : model_(std::move(model)) {}
+
+std::shared_ptr<const Model> SharedModel::load() const {
+  return std::atomic_load(&model_);
+}
+
+void SharedModel::store(std::shared_ptr<const Model> model) {
+  std::atomic_store(&model_, std::move(model));
+}
+
+void Data::add_hashed_features(const std::string& name,
+                               const std::vector<int>& rows,
+                               const std::vector<std::string>& fields,
+                               const std::vector<std::string>& tokens,
+                               const std::vector<double>& values,
+                               size_t n_samples,
+                               size_t n_features,
+                               bool signed_hash,
+                               uint32_t seed) {
+  CHECK(rows.size() == fields.size() && rows.size() == tokens.size()
+            && rows.size() == values.size())
+  << "Hashed feature records have inconsistent lengths";
+  hashing::FeatureHasher hasher(n_features, signed_hash, seed);
+  for (size_t k = 0; k < rows.size(); ++k)
+    hasher.add(rows[k], fields[k], tokens[k], values[k]);
+  mImpl->add_owned_design_matrix(name, hasher.transform(n_samples));
+}
+
 void predict(Model* m, Data* d) {
   #ifdef RANKING
   if (Internal::get_impl(d)->is_ranking()) {
@@ -180,6 +269,37 @@ void predict(Model* m, Data* d) {
   CHECK(false) << "Solver is not supported!";
 }
 
+void predict(const Model* m, Data* d) {
+  #ifdef CD
+  if (Internal::get_impl(d)->has_col_major()) {
+    cd::Predict(m, d);
+    return;
+  }
+  #endif
+
+  CHECK(false) << "Const predict requires the column major design matrix";
+}
+
+namespace {
+
+// Stochastic cd epochs fit windows of consecutive samples, which are only
+// unbiased if the samples are in random order. The Data is shuffled once,
+// later fits reuse the order.
+void ShuffleForRowWindows(const SolverSettings& settings, Data::Impl* data) {
+  if (settings.solver != "cd" || settings.row_fraction >= 1) return;
+  if (data->is_reordered()) {
+    CHECK_EQ(data->sample_order(), "random")
+    << "row_fraction requires samples in random order";
+    return;
+  }
+  auto x = data->get_design_matrix_col_major();
+  const std::vector<int> perm = order::RandomOrder(x.rows(),
+                                                   settings.rng_seed);
+  data->permute_samples(order::PermuteRows(x, perm), perm, "random");
+}
+
+}  // namespace
+
 void fit(Settings* s,
          Model* m,
          Data* d,
@@ -191,6 +311,8 @@ void fit(Settings* s,
 
   settings->settings_.rank_w2 = model->coef_->getw2().rows();
   settings->settings_.rank_w3 = model->coef_->getw3().rows();
+  // The quantized copy would be stale after fitting.
+  model->coef_->set_quantized(nullptr);
 
   #ifdef CD
   if ((settings->settings_.solver == "cd"
@@ -198,6 +320,7 @@ void fit(Settings* s,
       (settings->settings_.loss == "squared"
           || settings->settings_.loss == "logistic")) {
     data->check_col_major_train();
+    ShuffleForRowWindows(settings->settings_, data);
     cd::FitSquareLoss(d, m, s, cb, python_func);
     return;
   }
@@ -231,4 +354,124 @@ void fit(Settings* s, Model* m, Data* d) {
   fit(s, m, d, nullptr, nullptr);
 }
 
+namespace {
+
+// RMSE, or the mean log loss with labels > 0 as positive class.
+double ValidationError(Model* m, Data* d, const std::string& loss) {
+  predict(m, d);
+  const Data::Impl* data = Internal::get_impl(d);
+  const double error = cd::MeanLoss(loss, data->get_train_target(),
+                                    data->get_prediction(), Vector());
+  return loss == "logistic" ? error : std::sqrt(error);
+}
+
+}  // namespace
+
+RegularizationPath fit_path(Settings* s, Model* m, Data* d,
+                            const std::vector<double>& l2_reg_path,
+                            Data* validation, bool keep_all) {
+  SolverSettings& settings = Internal::get_impl(s)->settings_;
+  CHECK_EQ(settings.solver, "cd") << "fit_path requires the cd solver";
+  CHECK(!l2_reg_path.empty()) << "l2_reg_path is empty";
+  for (size_t k = 1; k < l2_reg_path.size(); ++k)
+    CHECK_LE(l2_reg_path[k], l2_reg_path[k - 1])
+    << "l2_reg_path has to be decreasing";
+
+  const SolverSettings original = settings;
+  const int warm_iter = settings.path_iter > 0
+                        ? settings.path_iter : std::max(1, settings.iter / 10);
+
+  RegularizationPath path;
+  for (size_t k = 0; k < l2_reg_path.size(); ++k) {
+    settings.l2_reg_w1 = l2_reg_path[k];
+    settings.l2_reg_w2 = l2_reg_path[k];
+    settings.l2_reg_w3 = l2_reg_path[k];
+    settings.iter = k == 0 ? original.iter : warm_iter;
+    fit(s, m, d);
+
+    PathPoint point;
+    point.l2_reg = l2_reg_path[k];
+    point.validation_error = std::numeric_limits<double>::quiet_NaN();
+    bool best = true;
+    if (validation != nullptr) {
+      point.validation_error = ValidationError(m, validation, original.loss);
+      best = path.best < 0 || point.validation_error
+          < path.points[path.best].validation_error;
+    }
+    if (best) {
+      if (!keep_all && path.best >= 0) path.points[path.best].model.reset();
+      path.best = k;
+    }
+    if (best || keep_all) point.model = m->snapshot();
+    path.points.push_back(point);
+  }
+  settings = original;
+  return path;
+}
+
+std::vector<double> cross_validate(Settings* s, const Model* m, Data* d,
+                                   int n_folds, int n_threads) {
+  Data::Impl* data = Internal::get_impl(d);
+  data->check_col_major_train();
+  ShuffleForRowWindows(Internal::get_impl(s)->settings_, data);
+  std::vector<double> errors = cd::CrossValidate(d, m, s, n_folds,
+                                                 n_threads);
+  if (Internal::get_impl(s)->settings_.loss != "logistic") {
+    for (double& error : errors) error = std::sqrt(error);
+  }
+  return errors;
+}
+
+double predict_row(const Model& m, const int* idx, const double* val,
+                   int nnz) {
+  return row::PredictRow(*Internal::get_impl(&m)->coef_, idx, val, nnz);
+}
+
+double predict_row(const Model& m, const int* idx, const float* val,
+                   int nnz) {
+  return row::PredictRow(*Internal::get_impl(&m)->coef_, idx, val, nnz);
+}
+
+void predict_rows(const Model& m, const int* indptr, const int* idx,
+                  const double* val, int n_rows, double* out) {
+  row::PredictRows(*Internal::get_impl(&m)->coef_, indptr, idx, val, n_rows,
+                   out);
+}
+
+void predict_rows(const Model& m, const int* indptr, const int* idx,
+                  const float* val, int n_rows, double* out) {
+  row::PredictRows(*Internal::get_impl(&m)->coef_, indptr, idx, val, n_rows,
+                   out);
+}
+
+void predict_candidates(const Model& m, const int* ctx_idx,
+                        const double* ctx_val, int ctx_nnz,
+                        const int* indptr, const int* idx, const double* val,
+                        int n_candidates, double* out) {
+  const ModelParam& coef = *Internal::get_impl(&m)->coef_;
+  row::CandidateContext context;
+  row::PrecomputeContext(coef, ctx_idx, ctx_val, ctx_nnz, &context);
+  row::PredictCandidates(coef, context, indptr, idx, val, n_candidates, out);
+}
+
+void predict_candidates(const Model& m, const int* ctx_idx,
+                        const float* ctx_val, int ctx_nnz,
+                        const int* indptr, const int* idx, const float* val,
+                        int n_candidates, double* out) {
+  const ModelParam& coef = *Internal::get_impl(&m)->coef_;
+  row::CandidateContext context;
+  row::PrecomputeContext(coef, ctx_idx, ctx_val, ctx_nnz, &context);
+  row::PredictCandidates(coef, context, indptr, idx, val, n_candidates, out);
+}
+
+std::map<std::string, double> quantization_report(Model* m, Data* d) {
+  Data::Impl* data = Internal::get_impl(d);
+  Model::Impl* model = Internal::get_impl(m);
+  const QuantizedParam* quantized = model->coef_->get_quantized();
+  CHECK(quantized != NULL) << "Model is not quantized, call `quantize` first";
+  CHECK(data->has_col_major()) << "Quantization report requires `x`";
+  return quant::Report(data->get_design_matrix_col_major(), *model->coef_,
+                       *quantized);
+}
+
 }  // namespace fastfm
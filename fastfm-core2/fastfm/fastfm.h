@@ -18,12 +18,23 @@
 #ifndef FASTFM_CORE2_FASTFM_FASTFM_H_
 #define FASTFM_CORE2_FASTFM_FASTFM_H_
 
+#include <cstdint>
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace fastfm {
 
+/** Index type of the sparse design matrices. Builds with FASTFM_INDEX64
+ * use 64-bit indices for matrices with more than 2^31 - 1 non-zeros.
+ */
+#if FASTFM_INDEX64
+using sparse_index_t = std::int64_t;
+#else
+using sparse_index_t = int;
+#endif
+
 /** @brief Class encapsulating training settings.
  *
  * Please note that the class only specifies the interface, not implementation.
@@ -103,6 +114,75 @@ class Model {
    */
   void add_scalar_map(const std::string& keys, double* values, size_t size);
 
+  /** @brief Writes all model parameters to a binary file.
+   *
+   * The file starts with a versioned header followed by a table of named
+   * sections (`w0`, `w1`, `w2`, `w3`, named vectors and the scalar map).
+   * Each section is 64 byte aligned so that it can be mapped into memory
+   * without copying. An existing file is replaced atomically (written
+   * to `<path>.tmp` and renamed), models mapped from it stay valid.
+   *
+   * @param path file name
+   */
+  void save(const std::string& path) const;
+
+  /** @brief Maps the parameters of a file written by `save`.
+   *
+   * The file is memory mapped and the parameters are wired in like
+   * `add_vector` / `add_matrix` without copying. The mapping is private,
+   * changes to the parameters (e.g. by `fit`) are not written to the file.
+   * The memory stays valid for the lifetime of the model. Parameters
+   * already present in the model (e.g. named vectors) are replaced.
+   *
+   * @param path file name
+   */
+  void open_mmap(const std::string& path);
+
+  /** @brief Like `open_mmap` but doesn't abort on a missing or corrupt file.
+   *
+   * @param path file name
+   * @param error set to the reason if the file can't be opened
+   * @return false if the file can't be opened, the model is unchanged
+   */
+  bool try_open_mmap(const std::string& path, std::string* error);
+
+  /** @brief Stores a low precision copy of the parameters for `predict`.
+   *
+   * Supported types are `int8` (symmetric, one scale per feature),
+   * `fp16` and `none` to drop the copy. `w0` and `w1` are kept as fp32,
+   * the factors are stored feature major and dequantized on the fly.
+   * The full precision parameters are left unchanged, `fit` drops the
+   * quantized copy.
+   *
+   * @param type quantization type
+   */
+  void quantize(const std::string& type);
+
+  /** @brief Returns an immutable deep copy of the model.
+   *
+   * The snapshot owns all parameter memory. It can be shared between threads
+   * that call `predict` concurrently without locking, since prediction
+   * never modifies a `const Model`. The snapshot additionally stores `w2`
+   * feature major, which makes `predict_row` / `predict_rows` read one
+   * contiguous factor vector per non-zero.
+   */
+  std::shared_ptr<const Model> snapshot() const;
+
+  /** @brief Maps a file written by `save` as an immutable model.
+   *
+   * Like a `snapshot` the model can be shared between threads, but the
+   * parameters stay in the mapping it owns. Only the feature major copy
+   * of `w2` for the row wise kernels is allocated. Replace the file by
+   * renaming (as `save` does), truncating it in place while the model is
+   * alive invalidates the mapping.
+   *
+   * @param path file name
+   * @param error set to the reason if the file can't be opened
+   * @return the model, nullptr if the file is missing or corrupt
+   */
+  static std::shared_ptr<const Model> open_snapshot(const std::string& path,
+                                                    std::string* error);
+
   class Impl;
  private:
   // non copyable
@@ -159,7 +239,9 @@ class Data {
    * For sparse FM data parameters currently supported names are: `x`, `x_c`, `x_i`
    *
    * @param name name of data parameter
-   * @param data pointer to the array location to map the memory
+   * @param data pointer to the array location to map the memory, may be
+   * nullptr for a column major `x` with all values 1 (binary / one-hot
+   * features), which is also detected if all values are 1.
    * @param rows number of samples
    * @param cols number of features
    * @param nnz number of non-zeros of each column (resp. row).
@@ -171,10 +253,58 @@ class Data {
                          double* data,
                          size_t rows,
                          size_t cols,
-                         int nnz,
-                         int* outer,
-                         int* inner,
+                         sparse_index_t nnz,
+                         sparse_index_t* outer,
+                         sparse_index_t* inner,
                          bool col_major);
+
+  /** @brief Reorders the samples to improve the memory locality of the solvers.
+   *
+   * Solvers access the per-sample arrays at the row indices of each feature.
+   * Arranging samples that share features next to each other reduces cache
+   * misses if the per-sample arrays don't fit into the cache.
+   *
+   * Supported methods are `rcm` (reverse Cuthill-McKee on the sample / feature
+   * graph), `dominant` (group samples by their most frequent feature),
+   * `random` and `none`. Fits with `row_fraction` < 1 shuffle the samples
+   * with `random` unless they have been reordered that way already.
+   * Requires the column major design matrix `x`. The design matrix, `y_true`
+   * and `cost` are copied in permuted order, predictions are written back to
+   * `y_pred` in the original sample order.
+   *
+   * @param method name of the ordering heuristic
+   */
+  void reorder_samples(const std::string& method);
+
+  /** @brief Builds a column major design matrix by feature hashing.
+   *
+   * Record `k` contributes `values[k]` to sample `rows[k]` at the column
+   * given by a MurmurHash3 of `fields[k]` and `tokens[k]` modulo
+   * `n_features`. The hash is seeded with `seed` and deterministic across
+   * runs and platforms. With `signed_hash` the value is multiplied by a
+   * hash derived sign to reduce the bias of collisions. Records that map
+   * to the same cell are summed. The matrix is owned by Data.
+   *
+   * @param name name of the design matrix, e.g. `x`
+   * @param rows sample index of each record
+   * @param fields field name of each record
+   * @param tokens token of each record, may be empty for numeric fields
+   * @param values value of each record
+   * @param n_samples number of samples
+   * @param n_features size of the hash space
+   * @param signed_hash use signed hashing
+   * @param seed hash seed
+   */
+  void add_hashed_features(const std::string& name,
+                           const std::vector<int>& rows,
+                           const std::vector<std::string>& fields,
+                           const std::vector<std::string>& tokens,
+                           const std::vector<double>& values,
+                           size_t n_samples,
+                           size_t n_features,
+                           bool signed_hash = true,
+                           uint32_t seed = 0);
+
   class Impl;
  private:
   // non copyable
@@ -186,6 +316,24 @@ class Data {
   Impl* mImpl;
 };
 
+/** @brief Holder of the current model snapshot for concurrent readers.
+ *
+ * Readers `load` the current snapshot and keep it alive for as long as they
+ * use it. A writer publishes a retrained snapshot with `store`, readers that
+ * still hold the old snapshot finish with it and release it afterwards.
+ * `load` and `store` are atomic.
+ */
+class SharedModel {
+ public:
+  explicit SharedModel(std::shared_ptr<const Model> model);
+
+  std::shared_ptr<const Model> load() const;
+  void store(std::shared_ptr<const Model> model);
+
+ private:
+  std::shared_ptr<const Model> model_;
+};
+
 // !Python function type
 typedef void* python_function_t;
 
@@ -213,14 +361,143 @@ void fit(Settings* s,
 //! Fits a model without a callback progress function.
 void fit(Settings* s, Model* m, Data* d);
 
+//! A point of a regularization path.
+struct PathPoint {
+  double l2_reg;
+  //! RMSE (squared loss) or mean log loss (logistic loss) on the
+  //! validation data, NaN without validation data.
+  double validation_error;
+  //! Snapshot of the fitted model, empty if not kept.
+  std::shared_ptr<const Model> model;
+};
+
+struct RegularizationPath {
+  std::vector<PathPoint> points;
+  //! Index of the point with the lowest validation error, the last point
+  //! without validation data.
+  int best = -1;
+};
+
+//! Fits the model for a decreasing sequence of l2 penalties.
+/*!
+  Each penalty is used for `l2_reg_w1`, `l2_reg_w2` and `l2_reg_w3`. The
+  first point runs `iter` epochs, every following point starts from the
+  solution of the previous one and runs `path_iter` epochs. After the call
+  `m` holds the solution of the last (smallest) penalty. Requires the `cd`
+  solver.
+  \param s the settings, restored after the call.
+  \param m the initial model parameter.
+  \param d the training data.
+  \param l2_reg_path decreasing penalties.
+  \param validation data with `x`, `y_true` and `y_pred` scored at each
+         point, may be nullptr.
+  \param keep_all keep a model snapshot for every point instead of only
+         for the best point.
+*/
+RegularizationPath fit_path(Settings* s, Model* m, Data* d,
+                            const std::vector<double>& l2_reg_path,
+                            Data* validation, bool keep_all);
+
+//! k-fold cross-validation without copies of the design matrix.
+/*!
+  The samples are assigned to `n_folds` shuffled folds (seeded by
+  `rng_seed`). Each fold fits a copy of `m` on the shared `x`, the held
+  out samples enter the fit with zero `cost`. The folds run in up to
+  `n_threads` threads. Features that only occur in held out samples
+  require a l2 penalty > 0. Requires the `cd` solver.
+  \param s the settings.
+  \param m the initial model parameter, not modified.
+  \param d the training data, `x`, `y_true` and optional `cost`.
+  \param n_folds number of folds.
+  \param n_threads number of folds fitted concurrently.
+  \return held out RMSE (squared loss) or mean log loss (logistic loss)
+          of each fold.
+*/
+std::vector<double> cross_validate(Settings* s, const Model* m, Data* d,
+                                   int n_folds, int n_threads);
+
 //! Make predictions with a trained model for the given data.
 /*!
   \param m the model parameter.
   \param d the data required to make the predictions.
   TODO add link to the regression tests.
-  TODO can we make the Model argument const?
 */
 void predict(Model* m, Data* d);
+
+//! Make predictions with a model that is not modified.
+/*!
+  Safe to call concurrently on the same model with distinct Data.
+  Supports the column major design matrix `x`.
+  \param m the model parameter.
+  \param d the data required to make the predictions.
+*/
+void predict(const Model* m, Data* d);
+
+//! Predicts a single sample without building a Data object.
+/*!
+  The sample is given by the feature indices and values of its non-zeros.
+  Uses the quantized parameters if the model has been quantized.
+  Use a `Model::snapshot` for the lowest latency.
+  Allocates no memory and is safe to call concurrently on the same model.
+  \param m the model parameter.
+  \param idx feature indices of the non-zeros.
+  \param val values of the non-zeros.
+  \param nnz number of non-zeros.
+  \return the prediction.
+*/
+double predict_row(const Model& m, const int* idx, const double* val, int nnz);
+double predict_row(const Model& m, const int* idx, const float* val, int nnz);
+
+//! Predicts a micro-batch of samples stored as CSR arrays.
+/*!
+  Row i spans [indptr[i], indptr[i + 1]) of idx and val. Like `predict_row`
+  no memory is allocated.
+  \param m the model parameter.
+  \param indptr row offsets, n_rows + 1 entries.
+  \param idx feature indices of the non-zeros.
+  \param val values of the non-zeros.
+  \param n_rows number of samples.
+  \param out predictions, n_rows entries.
+*/
+void predict_rows(const Model& m, const int* indptr, const int* idx,
+                  const double* val, int n_rows, double* out);
+void predict_rows(const Model& m, const int* indptr, const int* idx,
+                  const float* val, int n_rows, double* out);
+
+//! Scores many candidates that share the same context features.
+/*!
+  Each prediction equals `predict_row` of the context non-zeros concatenated
+  with the candidate non-zeros. The context linear term and its per rank
+  factor sums are computed once, each candidate then costs
+  O(candidate nnz x rank). Context and candidates use the same feature
+  index space, e.g. item indices offset by the number of context features
+  as for `x_c` / `x_i`. Features must not appear in both.
+  \param m the model parameter.
+  \param ctx_idx feature indices of the context non-zeros.
+  \param ctx_val values of the context non-zeros.
+  \param ctx_nnz number of context non-zeros.
+  \param indptr candidate row offsets, n_candidates + 1 entries.
+  \param idx feature indices of the candidate non-zeros.
+  \param val values of the candidate non-zeros.
+  \param n_candidates number of candidates.
+  \param out predictions, n_candidates entries.
+*/
+void predict_candidates(const Model& m, const int* ctx_idx,
+                        const double* ctx_val, int ctx_nnz,
+                        const int* indptr, const int* idx, const double* val,
+                        int n_candidates, double* out);
+void predict_candidates(const Model& m, const int* ctx_idx,
+                        const float* ctx_val, int ctx_nnz,
+                        const int* indptr, const int* idx, const float* val,
+                        int n_candidates, double* out);
+
+//! Compares the predictions of the quantized and full precision model.
+/*!
+  \param m model quantized with `Model::quantize`.
+  \param d data with the design matrix `x`.
+  \return `max_abs_error`, `rmse`, `bytes_fp64` and `bytes_quantized`.
+*/
+std::map<std::string, double> quantization_report(Model* m, Data* d);
 }  // namespace fastfm
 
 #endif  // FASTFM_CORE2_FASTFM_FASTFM_H_
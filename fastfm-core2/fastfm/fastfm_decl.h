@@ -19,11 +19,18 @@
 #include <Eigen/Sparse>
 #include <Eigen/Core>
 
-using SpMat = Eigen::SparseMatrix<double, Eigen::ColMajor>;
+#include "fastfm.h"
+
+using SpMat = Eigen::SparseMatrix<double, Eigen::ColMajor,
+                                  fastfm::sparse_index_t>;
 using SpMatRef = Eigen::Ref<SpMat>;
 using constSpMatRef = const Eigen::Ref<const SpMat>;
-using RowSpMat = Eigen::SparseMatrix<double, Eigen::RowMajor>;
+using RowSpMat = Eigen::SparseMatrix<double, Eigen::RowMajor,
+                                     fastfm::sparse_index_t>;
 using RowSpMatRef = Eigen::Ref<RowSpMat>;
+// Row major requests of the serving API (`predict_rows`), the indices stay
+// int independent of sparse_index_t.
+using RequestSpMat = Eigen::SparseMatrix<double, Eigen::RowMajor, int>;
 using constRowSpMatRef = const Eigen::Ref<const RowSpMat>;
 using Vector = Eigen::VectorXd;
 using VectorRef = Eigen::Ref<Vector, 0, Eigen::OuterStride<>>;
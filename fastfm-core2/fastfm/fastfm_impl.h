@@ -18,13 +18,17 @@
 #ifndef FASTFM_CORE2_FASTFM_FASTFM_IMPL_H_
 #define FASTFM_CORE2_FASTFM_FASTFM_IMPL_H_
 
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <random>  // std::mt19937
+#include <sstream>
 #include <string>
 #include <unordered_set>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "fastfm.h"
@@ -56,12 +60,19 @@ struct SolverSettings {
   double impl_reg = 1;
   bool first_order_impl_reg = true;
 
+  // Per group penalties, replace l2_reg_w1 / l2_reg_w2 for the columns of
+  // a group. Column j belongs to group feature_group[j], columns with a
+  // negative group keep the global penalty.
+  std::vector<double> group_l2_reg_w1;
   std::vector<double> group_l2_reg_w2;
+  std::vector<int> feature_group;
 
   double init_var_w2 = .1;
   double init_var_w3 = .1;
 
   // sgd specific
+  // Also damps the updates of the pre-release logistic cd solver, parsed
+  // but ignored by public builds.
   double step_size = 0.01;
   double decay = 0.01;
   double lazy_decay = 0;
@@ -69,6 +80,52 @@ struct SolverSettings {
   bool clip_pred = true;
   bool clip_reg = true;
   bool lazy_reg = true;
+
+  // cd specific
+  // `rank_major` or `feature_major` working layout of w2 during fit.
+  std::string w2_layout = "rank_major";
+  // `cyclic`, `random` or `greedy` coordinate selection.
+  std::string coord_order = "cyclic";
+  // Fraction of the coordinates visited per epoch by `greedy`.
+  double coord_fraction = 1;
+  // Active-set shrinking, disabled for shrink_tol == 0.
+  double shrink_tol = 0;
+  int shrink_patience = 2;
+  int shrink_check_every = 10;
+  // Number of w2 layers updated concurrently (Jacobi style) if > 1.
+  int n_threads = 1;
+  // Epochs of the logistic loss reuse the IRLS weights while no prediction
+  // moved more than irls_tol since they were computed, 0 recomputes them
+  // every epoch.
+  double irls_tol = 0;
+  // Step size multiplier for the concurrent layer or process updates,
+  // 0 selects 1 / <number of concurrent layers or processes>.
+  double layer_damping = 0;
+  // Number of worker processes that each own a partition of the features,
+  // the residual is exchanged after every `exchange_block` coordinates.
+  int n_processes = 1;
+  int exchange_block = 4096;
+  // Pinning of the worker threads and processes to cpus,
+  // `none`, `compact` or `scatter` (round robin over the NUMA nodes).
+  std::string thread_affinity = "none";
+  // `default`, `partitioned` or `interleaved` placement of the design
+  // matrix and residual over the nodes of the pinned workers.
+  std::string memory_placement = "default";
+  // `none` or `varint` (delta encoded) row indices of the design matrix
+  // read by the serial column updates.
+  std::string index_compression = "none";
+  // Fraction of the rows read per epoch. Epochs with row_fraction < 1 fit
+  // a random window of consecutive rows, `fit` shuffles the samples of the
+  // Data once (seeded by rng_seed) so that any input row order works.
+  double row_fraction = 1;
+  // Epochs between two recomputations of the residual of all rows if
+  // row_fraction < 1, 0 selects 1 / row_fraction. The logistic loss is
+  // relinearized on all rows at these epochs, the other epochs compute
+  // the residual of their window only.
+  int residual_refresh = 0;
+  // Epochs of the warm started points of `fit_path`,
+  // 0 selects iter / 10 (at least 1).
+  int path_iter = 0;
 };
 
 class Evaluator {
@@ -76,31 +133,72 @@ class Evaluator {
   virtual void eval() = 0;
 };
 
+// Read only low precision copy of the model parameter for inference.
+// The factors are stored feature major (n_features x rank) with one scale
+// per feature for `int8`, the value of factor f of feature j is
+// `w2_scale[j] * w2_i8[j * rank_w2 + f]`.
+struct QuantizedParam {
+  std::string type;  // `int8` or `fp16`
+  int n_features = 0;
+  int rank_w2 = 0;
+  int rank_w3 = 0;
+
+  float w0 = 0;
+  std::vector<float> w1;
+
+  std::vector<int8_t> w2_i8;
+  std::vector<int8_t> w3_i8;
+  std::vector<float> w2_scale;
+  std::vector<float> w3_scale;
+
+  std::vector<Eigen::half> w2_f16;
+  std::vector<Eigen::half> w3_f16;
+
+  size_t bytes() const {
+    return sizeof(float) * (1 + w1.size() + w2_scale.size() + w3_scale.size())
+        + w2_i8.size() + w3_i8.size()
+        + sizeof(Eigen::half) * (w2_f16.size() + w3_f16.size());
+  }
+};
+
 class ModelParam {
  private:
   double w0 = 0;
   double* w0map;
   Vector w1;
-  Eigen::Map<Vector>* w1map;
+  std::unique_ptr<Eigen::Map<Vector>> w1map;
   Matrix w2;
-  Eigen::Map<Matrix>* w2map;
+  std::unique_ptr<Eigen::Map<Matrix>> w2map;
   Matrix w3;
-  Eigen::Map<Matrix>* w3map;
+  std::unique_ptr<Eigen::Map<Matrix>> w3map;
 
-  Eigen::Map<Vector>* mapValues;
+  // Feature major (n_features x rank) working copy of w2, `w2_fm.row(j)`
+  // holds the factors of feature j contiguously. While active, w2 is only
+  // updated by `sync_w2_feature_major`.
+  Matrix w2_fm;
+  bool w2_fm_active = false;
+
+  std::shared_ptr<const QuantizedParam> quantized;
+
+  std::unique_ptr<Eigen::Map<Vector>> mapValues;
+  std::string mapKeys;
   std::unordered_map<std::string, VectorRef> mapValuesBlocks;
   std::unordered_map<std::string, Eigen::Map<Vector>> vectors;
   Vector dummy;
 
+  // Storage of the map values and named vectors of a deep copy.
+  Vector mapValuesOwned;
+  std::unordered_map<std::string, Vector> vectorsOwned;
+
+  // non copyable, use `deep_copy`
+  ModelParam(const ModelParam&) = delete;
+  ModelParam& operator=(const ModelParam&) = delete;
+
  public:
-  ModelParam()
-      : w0map(NULL), w1map(NULL), w2map(NULL), w3map(NULL), mapValues(NULL) {
-  }
+  ModelParam() : w0map(NULL) {}
 
   ModelParam(const SolverSettings& settings, const int n_features)
-      : w0map(NULL), w1map(NULL),
-        w2map(NULL), w3map(NULL),
-        mapValues(NULL) {
+      : w0map(NULL) {
     std::mt19937 mt_rand(settings.rng_seed);
 
     w0 = 0;
@@ -141,38 +239,35 @@ class ModelParam {
   }
 
   void setw1(double* data, int rows) {
-    delete w1map;
-    w1map = new Eigen::Map<Vector>(data, rows);
+    w1map.reset(new Eigen::Map<Vector>(data, rows));
   }
 
   void setw1(VectorRef vector) {
-    delete w1map;
-    w1map = new Eigen::Map<Vector>(vector.data(), vector.rows());
+    w1map.reset(new Eigen::Map<Vector>(vector.data(), vector.rows()));
   }
 
   void setw2(double* data, int rows, int cols) {
-    delete w2map;
-    w2map = new Eigen::Map<Matrix>(data, rows, cols);
+    w2map.reset(new Eigen::Map<Matrix>(data, rows, cols));
   }
 
   void setw2(MatrixRef matrix) {
-    delete w2map;
-    w2map = new Eigen::Map<Matrix>(matrix.data(), matrix.rows(), matrix.cols());
+    w2map.reset(
+        new Eigen::Map<Matrix>(matrix.data(), matrix.rows(), matrix.cols()));
   }
 
   void setw3(double* data, int rows, int cols) {
-    delete w3map;
-    w3map = new Eigen::Map<Matrix>(data, rows, cols);
+    w3map.reset(new Eigen::Map<Matrix>(data, rows, cols));
   }
 
   void setw3(MatrixRef matrix) {
-    delete w3map;
-    w3map = new Eigen::Map<Matrix>(matrix.data(), matrix.rows(), matrix.cols());
+    w3map.reset(
+        new Eigen::Map<Matrix>(matrix.data(), matrix.rows(), matrix.cols()));
   }
 
   void setMapValues(const std::string& keys, double* values, size_t size) {
-    delete mapValues;
-    mapValues = new Eigen::Map<Vector>(values, size);
+    mapValues.reset(new Eigen::Map<Vector>(values, size));
+    mapKeys = keys;
+    mapValuesBlocks.clear();
 
     auto shift = 0;
     std::string key;
@@ -185,7 +280,7 @@ class ModelParam {
     CHECK(size == shift);
   }
 
-  double getw0() {
+  double getw0() const {
     if (w0map)
       return *w0map;
     return w0;
@@ -288,6 +383,45 @@ class ModelParam {
     return w2.block(rowstart, colstart, rownum, colnum);
   }
 
+  void to_w2_feature_major() {
+    w2_fm = getw2().transpose();
+    w2_fm_active = true;
+  }
+
+  void sync_w2_feature_major() {
+    CHECK(w2_fm_active);
+    getw2() = w2_fm.transpose();
+  }
+
+  void from_w2_feature_major() {
+    sync_w2_feature_major();
+    w2_fm_active = false;
+    w2_fm.resize(0, 0);
+  }
+
+  bool is_w2_feature_major() const {
+    return w2_fm_active;
+  }
+
+  MatrixRef getw2_feature_major() {
+    CHECK(w2_fm_active);
+    return w2_fm;
+  }
+
+  constMatrixRef getw2_feature_major() const {
+    CHECK(w2_fm_active);
+    return w2_fm;
+  }
+
+  void set_quantized(std::shared_ptr<const QuantizedParam> q) {
+    quantized = q;
+  }
+
+  // Null if the model has not been quantized.
+  const QuantizedParam* get_quantized() const {
+    return quantized.get();
+  }
+
   MatrixRef getw3() {
     if (w3map != NULL)
       return *w3map;
@@ -304,6 +438,16 @@ class ModelParam {
     return mapValuesBlocks.at(k);
   }
 
+  const std::string& getMapKeys() const {
+    return mapKeys;
+  }
+
+  constVectorRef getMapValues() const {
+    if (mapValues != NULL)
+      return *mapValues;
+    return dummy;
+  }
+
   void add_vector(const std::string& name, double* data, size_t size) {
     // Store only unique keys
     auto res = vectors.emplace(name, Eigen::Map<Vector>(data, size));
@@ -311,6 +455,12 @@ class ModelParam {
     CHECK(res.second);
   }
 
+  // Like `add_vector` but replaces an existing vector with the same name.
+  void set_vector(const std::string& name, double* data, size_t size) {
+    vectors.erase(name);
+    add_vector(name, data, size);
+  }
+
   VectorRef get_vector(const std::string& name) {
     if (has_vector(name)) {
       return vectors.at(name);
@@ -322,6 +472,33 @@ class ModelParam {
   bool has_vector(const std::string& name) const {
     return vectors.count(name) > 0;
   }
+
+  const std::unordered_map<std::string, Eigen::Map<Vector>>&
+  get_vectors() const {
+    return vectors;
+  }
+
+  // Returns a copy that owns all parameter memory and shares nothing
+  // mutable with this model. The quantized copy is immutable and shared.
+  std::unique_ptr<ModelParam> deep_copy() const {
+    std::unique_ptr<ModelParam> copy(new ModelParam());
+    copy->w0 = getw0();
+    copy->w1 = getw1();
+    copy->w2 = getw2();
+    copy->w3 = getw3();
+    copy->quantized = quantized;
+
+    if (mapValues != NULL) {
+      copy->mapValuesOwned = *mapValues;
+      copy->setMapValues(mapKeys, copy->mapValuesOwned.data(),
+                         copy->mapValuesOwned.size());
+    }
+    for (const auto& item : vectors) {
+      Vector& owned = copy->vectorsOwned[item.first] = item.second;
+      copy->add_vector(item.first, owned.data(), owned.size());
+    }
+    return copy;
+  }
 };
 
 class Data::Impl {
@@ -335,6 +512,44 @@ class Data::Impl {
   std::unordered_map<std::string, Eigen::Map<Vector>> vectors;
   Vector dummy;
 
+  // Storage owned by Data, e.g. the permuted copies of reordered samples.
+  // The maps above point into these containers instead of caller memory.
+  std::unordered_map<std::string, SpMat> x_owned_;
+  std::unordered_map<std::string, Vector> vectors_owned_;
+
+  // New sample i is the original sample sample_perm_[i].
+  std::vector<int> sample_perm_;
+  // Method of `reorder_samples` that produced sample_perm_.
+  std::string sample_order_;
+  // Caller memory for the predictions if the samples have been reordered.
+  Eigen::Map<Vector> y_pred_user_;
+
+  Vector permute(const Eigen::Map<Vector>& in) const {
+    Vector res(in.size());
+    for (size_t i = 0; i < sample_perm_.size(); ++i)
+      res.coeffRef(i) = in.coeff(sample_perm_[i]);
+    return res;
+  }
+
+  // A binary matrix is mapped without its values.
+  void wrap_owned_design_matrix(const std::string& name, SpMat owned,
+                                bool binary = false) {
+    SpMat& stored = x_owned_[name] = std::move(owned);
+    auto res = x_.emplace(name, Eigen::Map<SpMat>(stored.rows(), stored.cols(),
+                                                  stored.nonZeros(),
+                                                  stored.outerIndexPtr(),
+                                                  stored.innerIndexPtr(),
+                                                  binary ? nullptr
+                                                         : stored.valuePtr()));
+    CHECK(res.second);
+  }
+
+  void wrap_owned_vector(const std::string& name, Vector owned) {
+    Vector& stored = vectors_owned_[name] = std::move(owned);
+    vectors.erase(name);
+    vectors.emplace(name, Eigen::Map<Vector>(stored.data(), stored.size()));
+  }
+
  public:
   bool has_col_major() const {
     return x_.size() > 0;
@@ -371,6 +586,11 @@ class Data::Impl {
     // Does not allocate memory, but runs the constructor of the class
     // on the memory pointer provided.
     new(&y_train) Eigen::Map<Vector>(data, n_samples);
+    if (is_reordered()) {
+      Vector& owned = vectors_owned_["y_true"] =
+          permute(Eigen::Map<Vector>(data, n_samples));
+      new(&y_train) Eigen::Map<Vector>(owned.data(), owned.size());
+    }
   }
 
   Eigen::Map<Vector> get_prediction() const {
@@ -386,6 +606,11 @@ class Data::Impl {
     // Does not allocate memory, but runs the constructor of the class
     // on the memory pointer provided.
     new(&y_pred) Eigen::Map<Vector>(data, n_samples);
+    if (is_reordered()) {
+      new(&y_pred_user_) Eigen::Map<Vector>(data, n_samples);
+      Vector& owned = vectors_owned_["y_pred"] = permute(y_pred_user_);
+      new(&y_pred) Eigen::Map<Vector>(owned.data(), owned.size());
+    }
   }
   void wrap_pred_memory(double* data, const int n_rows, const int n_cols) {
     // C++ placement operator.
@@ -398,9 +623,17 @@ class Data::Impl {
                                    double* data,
                                    int n_samples,
                                    int n_features,
-                                   int nnz,
-                                   int* outer,
-                                   int* inner) {
+                                   sparse_index_t nnz,
+                                   sparse_index_t* outer,
+                                   sparse_index_t* inner) {
+    // A binary `x` (data == nullptr or all values 1) is mapped without
+    // values, the cd solver then uses the kernels for x_ij == 1.
+    CHECK(data != nullptr || name == "x")
+    << "Binary `" << name << "` is not supported";
+    if (name == "x" && data != nullptr
+        && std::all_of(data, data + nnz, [](double v) { return v == 1; })) {
+      data = nullptr;
+    }
     auto res = x_.emplace(name,
                           Eigen::Map<SpMat>(n_samples,
                                             n_features,
@@ -412,13 +645,17 @@ class Data::Impl {
     return x_.size();
   }
 
+  bool is_binary(const std::string& name) const {
+    return x_.at(name).valuePtr() == nullptr;
+  }
+
   int wrap_design_matrix_row_major(const std::string& name,
                                    double* data,
                                    int n_samples,
                                    int n_features,
-                                   int nnz,
-                                   int* outer,
-                                   int* inner) {
+                                   sparse_index_t nnz,
+                                   sparse_index_t* outer,
+                                   sparse_index_t* inner) {
     auto res = x_row_.emplace(name,
                               Eigen::Map<RowSpMat>(n_samples,
                                                    n_features,
@@ -459,6 +696,9 @@ class Data::Impl {
     auto res = vectors.emplace(name, Eigen::Map<Vector>(data, size));
     // Check if construction was successful
     CHECK(res.second);
+    if (is_reordered() && name == "cost") {
+      wrap_owned_vector(name, permute(res.first->second));
+    }
   }
 
   VectorRef get_vector(const std::string& name) {
@@ -473,7 +713,57 @@ class Data::Impl {
     return vectors.count(name) > 0;
   }
 
-  Impl() : y_train(NULL, 0), y_pred(NULL, 0), y_recs(NULL, 0, 0) {}
+  // Takes ownership of a design matrix built by Data, e.g. by
+  // feature hashing.
+  void add_owned_design_matrix(const std::string& name, SpMat x) {
+    CHECK(!is_reordered()) << "Samples have already been reordered";
+    x.makeCompressed();
+    wrap_owned_design_matrix(name, std::move(x));
+  }
+
+  bool is_reordered() const {
+    return !sample_perm_.empty();
+  }
+
+  const std::string& sample_order() const {
+    return sample_order_;
+  }
+
+  // Rearranges the design matrix `x` and all per-sample arrays in `perm`
+  // order, computed by the sample order `method`. The permuted arrays are
+  // owned copies, the caller memory is only written through
+  // `restore_prediction_order`.
+  void permute_samples(SpMat x, const std::vector<int>& perm,
+                       const std::string& method) {
+    CHECK(!is_reordered()) << "Samples have already been reordered";
+    CHECK_EQ(x_row_.size(), 0) << "Reordering requires column major `x`";
+    CHECK_EQ(x_.size(), 1) << "Reordering is only supported for `x`";
+    CHECK_EQ(x.rows(), perm.size());
+
+    const bool binary = is_binary("x");
+    x_.erase("x");
+    wrap_owned_design_matrix("x", std::move(x), binary);
+    sample_perm_ = perm;
+    sample_order_ = method;
+
+    if (y_train.size() > 0)
+      wrap_train_target_memory(y_train.data(), y_train.size());
+    if (y_pred.size() > 0)
+      wrap_pred_memory(y_pred.data(), y_pred.size());
+    if (has_vector("cost"))
+      wrap_owned_vector("cost", permute(vectors.at("cost")));
+  }
+
+  // Writes the predictions back to the caller memory in the original
+  // sample order. No-op if the samples have not been reordered.
+  void restore_prediction_order() {
+    if (!is_reordered() || y_pred_user_.size() == 0) return;
+    for (size_t i = 0; i < sample_perm_.size(); ++i)
+      y_pred_user_.coeffRef(sample_perm_[i]) = y_pred.coeff(i);
+  }
+
+  Impl() : y_train(NULL, 0), y_pred(NULL, 0), y_recs(NULL, 0, 0),
+           y_pred_user_(NULL, 0) {}
 };
 
 class Settings::Impl {
@@ -512,6 +802,10 @@ class Settings::Impl {
         settings_.l2_reg_w2 = std::stod(item.second);
       } else if (item.first == "l2_reg_w3") {
         settings_.l2_reg_w3 = std::stod(item.second);
+      } else if (item.first == "group_l2_reg_w1") {
+        settings_.group_l2_reg_w1 = parse_list(item.second);
+      } else if (item.first == "group_l2_reg_w2") {
+        settings_.group_l2_reg_w2 = parse_list(item.second);
       }
 // NOLINTNEXTLINE
       else if (item.first == "init_var_w2") {
@@ -522,6 +816,9 @@ class Settings::Impl {
 // NOLINTNEXTLINE
       else if (item.first == "step_size") {
         settings_.step_size = std::stod(item.second);
+        #if EXTERNAL_RELEASE
+        LOG(WARNING) << "Parameter step_size is deprecated and ignored.";
+        #endif
       } else if (item.first == "decay") {
         settings_.decay = std::stod(item.second);
       } else if (item.first == "lazy_decay") {
@@ -535,17 +832,71 @@ class Settings::Impl {
         std::istringstream(item.second) >> std::boolalpha >> settings_.clip_reg;
       } else if (item.first == "lazy_reg") {
         std::istringstream(item.second) >> std::boolalpha >> settings_.lazy_reg;
+      }
+// NOLINTNEXTLINE
+      else if (item.first == "w2_layout") {
+        settings_.w2_layout = item.second;
+      } else if (item.first == "coord_order") {
+        settings_.coord_order = item.second;
+      } else if (item.first == "coord_fraction") {
+        settings_.coord_fraction = std::stod(item.second);
+      } else if (item.first == "shrink_tol") {
+        settings_.shrink_tol = std::stod(item.second);
+      } else if (item.first == "shrink_patience") {
+        settings_.shrink_patience = std::stoi(item.second);
+      } else if (item.first == "shrink_check_every") {
+        settings_.shrink_check_every = std::stoi(item.second);
+      } else if (item.first == "n_threads") {
+        settings_.n_threads = std::stoi(item.second);
+      } else if (item.first == "layer_damping") {
+        settings_.layer_damping = std::stod(item.second);
+      } else if (item.first == "irls_tol") {
+        settings_.irls_tol = std::stod(item.second);
+      } else if (item.first == "n_processes") {
+        settings_.n_processes = std::stoi(item.second);
+      } else if (item.first == "exchange_block") {
+        settings_.exchange_block = std::stoi(item.second);
+      } else if (item.first == "thread_affinity") {
+        settings_.thread_affinity = item.second;
+      } else if (item.first == "memory_placement") {
+        settings_.memory_placement = item.second;
+      } else if (item.first == "row_fraction") {
+        settings_.row_fraction = std::stod(item.second);
+      } else if (item.first == "residual_refresh") {
+        settings_.residual_refresh = std::stoi(item.second);
+      } else if (item.first == "index_compression") {
+        settings_.index_compression = item.second;
+      } else if (item.first == "path_iter") {
+        settings_.path_iter = std::stoi(item.second);
       } else {
             LOG(ERROR) << "Parameter " << item.first << " is not supported.";
         CHECK(false);
       }
     }
   }
+
+ private:
+  // Comma separated list of numbers, e.g. `0.1,10,1`.
+  static std::vector<double> parse_list(const std::string& value) {
+    std::vector<double> list;
+    std::istringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ',')) list.push_back(std::stod(item));
+    return list;
+  }
 };
 
+namespace io {
+class MappedFile;
+}  // namespace io
+
 class Model::Impl {
  public:
   ModelParam* coef_;
+  // Backing memory of the files opened with `Model::open_mmap`. Earlier
+  // files stay mapped since parameters a later file does not contain
+  // still point into them.
+  std::vector<std::shared_ptr<io::MappedFile>> files_;
 };
 
 class Internal {
@@ -553,6 +904,9 @@ class Internal {
   static Model::Impl* get_impl(Model* m) {
     return m->mImpl;
   }
+  static const Model::Impl* get_impl(const Model* m) {
+    return m->mImpl;
+  }
   static Settings::Impl* get_impl(Settings* s) {
     return s->mImpl;
   }
@@ -0,0 +1,114 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "feature_hashing.h"
+
+#define LOGURU_REPLACE_GLOG 1
+#include "../3rdparty/loguru/loguru.hpp"
+
+namespace fastfm {
+namespace hashing {
+
+namespace {
+
+inline uint32_t Rotl32(uint32_t x, int r) {
+  return (x << r) | (x >> (32 - r));
+}
+
+// Separates field and token in the hashed key, `a` + `bc` != `ab` + `c`.
+const char kFieldSeparator = '\x1f';
+
+}  // namespace
+
+uint32_t MurmurHash3(const char* key, size_t len, uint32_t seed) {
+  const uint32_t c1 = 0xcc9e2d51;
+  const uint32_t c2 = 0x1b873593;
+  const size_t n_blocks = len / 4;
+  uint32_t h = seed;
+
+  for (size_t i = 0; i < n_blocks; ++i) {
+    // Assemble the block byte by byte to be independent of endianness
+    // and alignment.
+    const unsigned char* b =
+        reinterpret_cast<const unsigned char*>(key + 4 * i);
+    uint32_t k = b[0] | (b[1] << 8) | (b[2] << 16)
+        | (static_cast<uint32_t>(b[3]) << 24);
+    k *= c1;
+    k = Rotl32(k, 15);
+    k *= c2;
+    h ^= k;
+    h = Rotl32(h, 13);
+    h = h * 5 + 0xe6546b64;
+  }
+
+  const unsigned char* tail =
+      reinterpret_cast<const unsigned char*>(key + 4 * n_blocks);
+  uint32_t k = 0;
+  switch (len & 3) {
+    case 3: k ^= tail[2] << 16;  // fall through
+    case 2: k ^= tail[1] << 8;   // fall through
+    case 1: k ^= tail[0];
+      k *= c1;
+      k = Rotl32(k, 15);
+      k *= c2;
+      h ^= k;
+  }
+
+  h ^= static_cast<uint32_t>(len);
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+FeatureHasher::FeatureHasher(int n_features, bool signed_hash, uint32_t seed)
+    : n_features_(n_features), signed_hash_(signed_hash), seed_(seed) {
+  CHECK_GT(n_features, 0) << "Hash space must not be empty";
+}
+
+int FeatureHasher::index(const std::string& field, const std::string& token,
+                         double* sign) const {
+  std::string key;
+  key.reserve(field.size() + 1 + token.size());
+  key.append(field).push_back(kFieldSeparator);
+  key.append(token);
+  const uint32_t h = MurmurHash3(key.data(), key.size(), seed_);
+
+  // The column uses the low bits, the sign the highest bit.
+  *sign = signed_hash_ && (h >> 31) ? -1 : 1;
+  return static_cast<int>(h % static_cast<uint32_t>(n_features_));
+}
+
+void FeatureHasher::add(int row, const std::string& field,
+                        const std::string& token, double value) {
+  CHECK_GE(row, 0);
+  double sign;
+  const int col = index(field, token, &sign);
+  records_.emplace_back(row, col, sign * value);
+}
+
+SpMat FeatureHasher::transform(int n_samples) const {
+  SpMat x(n_samples, n_features_);
+  for (const auto& record : records_)
+    CHECK_LT(record.row(), n_samples) << "Record row out of range";
+  // Duplicates are summed.
+  x.setFromTriplets(records_.begin(), records_.end());
+  x.makeCompressed();
+  return x;
+}
+
+}  // namespace hashing
+}  // namespace fastfm
@@ -0,0 +1,65 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_FEATURE_HASHING_H_
+#define FASTFM_CORE2_FASTFM_FEATURE_HASHING_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fastfm_decl.h"
+
+namespace fastfm {
+namespace hashing {
+
+// 32 bit MurmurHash3 (x86 variant). Platform independent, the same key and
+// seed always map to the same value.
+uint32_t MurmurHash3(const char* key, size_t len, uint32_t seed);
+
+/** @brief Maps (field, token, value) records into a fixed size feature space.
+ *
+ * The column of a record is the hash of `field` and `token` modulo
+ * `n_features`. With signed hashing the value is multiplied by a sign taken
+ * from an independent bit of the same hash, so that colliding features
+ * cancel in expectation instead of accumulating.
+ * Records of the same sample that map to the same column are summed.
+ */
+class FeatureHasher {
+ public:
+  FeatureHasher(int n_features, bool signed_hash, uint32_t seed);
+
+  // Column of the record, `sign` is set to +1 or -1 (always +1 if
+  // signed hashing is disabled).
+  int index(const std::string& field, const std::string& token,
+            double* sign) const;
+
+  void add(int row, const std::string& field, const std::string& token,
+           double value);
+
+  // Column major design matrix of all records added so far.
+  SpMat transform(int n_samples) const;
+
+ private:
+  int n_features_;
+  bool signed_hash_;
+  uint32_t seed_;
+  std::vector<Eigen::Triplet<double>> records_;
+};
+
+}  // namespace hashing
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_FEATURE_HASHING_H_
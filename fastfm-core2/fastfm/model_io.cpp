@@ -0,0 +1,330 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "model_io.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define LOGURU_REPLACE_GLOG 1
+#include "../3rdparty/loguru/loguru.hpp"
+
+namespace fastfm {
+namespace io {
+
+namespace {
+
+uint64_t Align(uint64_t offset) {
+  return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+// Largest number of rows or columns of a section.
+const uint64_t kMaxDim = std::numeric_limits<int>::max();
+
+// Number of keys `ModelParam::setMapValues` splits keys into.
+uint64_t CountKeys(const std::string& keys) {
+  uint64_t n = 0;
+  std::string key;
+  std::istringstream stream(keys);
+  while (std::getline(stream, key, ',')) ++n;
+  return n;
+}
+
+// True if [offset, offset + bytes) lies within a file of size bytes,
+// without overflowing for the untrusted header values.
+bool InFile(uint64_t offset, uint64_t bytes, uint64_t size) {
+  return bytes <= size && offset <= size - bytes;
+}
+
+struct Section {
+  SectionHeader header;
+  const char* data;
+};
+
+Section MakeSection(const std::string& name, SectionKind kind,
+                    const void* data, uint64_t rows, uint64_t cols,
+                    uint64_t bytes) {
+  CHECK_LT(name.size(), sizeof(SectionHeader::name))
+  << "Parameter name too long: " << name;
+  Section section;
+  std::memset(&section.header, 0, sizeof(SectionHeader));
+  std::memcpy(section.header.name, name.data(), name.size());
+  section.header.kind = kind;
+  section.header.rows = rows;
+  section.header.cols = cols;
+  section.header.bytes = bytes;
+  section.data = static_cast<const char*>(data);
+  return section;
+}
+
+}  // namespace
+
+std::unique_ptr<MappedFile> MappedFile::Open(const std::string& path,
+                                             std::string* error) {
+  std::unique_ptr<MappedFile> file(new MappedFile());
+#if !defined(_WIN32)
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    *error = "Can't open model file: " + path + ": " + std::strerror(errno);
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    *error = "Can't stat model file: " + path + ": " + std::strerror(errno);
+    close(fd);
+    return nullptr;
+  }
+  file->size_ = st.st_size;
+  if (file->size_ > 0) {
+    // Private copy-on-write mapping, the parameter stay writable
+    // (e.g. for refitting) without modifying the file.
+    void* addr =
+        mmap(NULL, file->size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      *error = "Can't mmap model file: " + path + ": " + std::strerror(errno);
+      close(fd);
+      return nullptr;
+    }
+    file->data_ = static_cast<char*>(addr);
+  }
+  close(fd);
+#else
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  if (!in.good()) {
+    *error = "Can't open model file: " + path;
+    return nullptr;
+  }
+  file->size_ = in.tellg();
+  // Over-allocate to align the buffer for the double sections.
+  file->buffer_.reset(new char[file->size_ + kAlignment]);
+  file->data_ = file->buffer_.get()
+      + (kAlignment
+          - reinterpret_cast<uintptr_t>(file->buffer_.get()) % kAlignment)
+          % kAlignment;
+  in.seekg(0);
+  in.read(file->data_, file->size_);
+  if (!in.good()) {
+    *error = "Can't read model file: " + path;
+    return nullptr;
+  }
+#endif
+  return file;
+}
+
+MappedFile::~MappedFile() {
+#if !defined(_WIN32)
+  if (data_ != NULL) munmap(data_, size_);
+#endif
+}
+
+void SaveModel(const ModelParam& coef, const std::string& path) {
+  std::vector<Section> sections;
+
+  const double w0 = coef.getw0();
+  sections.push_back(MakeSection("w0", kVector, &w0, 1, 1, sizeof(double)));
+
+  constVectorRef w1 = coef.getw1();
+  sections.push_back(MakeSection("w1", kVector, w1.data(), w1.size(), 1,
+                                 w1.size() * sizeof(double)));
+
+  // Matrices are written row by row to drop a possible outer stride.
+  std::vector<std::vector<double>> buffers;
+  for (const char* name : {"w2", "w3"}) {
+    constMatrixRef w = std::string(name) == "w2" ? coef.getw2()
+                                                 : coef.getw3();
+    if (w.size() == 0) continue;
+    buffers.emplace_back(w.size());
+    for (int i = 0; i < w.rows(); ++i)
+      for (int j = 0; j < w.cols(); ++j)
+        buffers.back()[i * w.cols() + j] = w.coeff(i, j);
+    sections.push_back(MakeSection(name, kMatrix, buffers.back().data(),
+                                   w.rows(), w.cols(),
+                                   w.size() * sizeof(double)));
+  }
+
+  // Named vectors in sorted order for reproducible files.
+  std::vector<std::string> names;
+  for (const auto& item : coef.get_vectors()) names.push_back(item.first);
+  std::sort(names.begin(), names.end());
+  for (const std::string& name : names) {
+    const Eigen::Map<Vector>& v = coef.get_vectors().at(name);
+    sections.push_back(MakeSection(name, kVector, v.data(), v.size(), 1,
+                                   v.size() * sizeof(double)));
+  }
+
+  const std::string& keys = coef.getMapKeys();
+  if (!keys.empty()) {
+    constVectorRef values = coef.getMapValues();
+    sections.push_back(MakeSection("scalar_map", kScalarMap, values.data(),
+                                   values.size(), 1,
+                                   values.size() * sizeof(double)));
+    sections.push_back(MakeSection("scalar_map_keys", kKeys, keys.data(),
+                                   keys.size(), 1, keys.size()));
+  }
+
+  uint64_t offset = Align(sizeof(FileHeader)
+                              + sections.size() * sizeof(SectionHeader));
+  for (auto& section : sections) {
+    section.header.offset = offset;
+    offset = Align(offset + section.header.bytes);
+  }
+
+  FileHeader header;
+  std::memset(&header, 0, sizeof(FileHeader));
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.n_sections = sections.size();
+  header.file_size = offset;
+
+  // Written next to path and renamed over it, mappings of the previous
+  // file (e.g. of a served model) keep their pages.
+  const std::string tmp_path = path + ".tmp";
+  std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+  CHECK(out.good()) << "Can't open model file for writing: " << tmp_path;
+  out.write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
+  for (const auto& section : sections)
+    out.write(reinterpret_cast<const char*>(&section.header),
+              sizeof(SectionHeader));
+
+  const std::vector<char> padding(kAlignment, 0);
+  uint64_t pos = sizeof(FileHeader) + sections.size() * sizeof(SectionHeader);
+  for (const auto& section : sections) {
+    out.write(padding.data(), section.header.offset - pos);
+    out.write(section.data, section.header.bytes);
+    pos = section.header.offset + section.header.bytes;
+  }
+  out.write(padding.data(), header.file_size - pos);
+  out.close();
+  CHECK(out.good()) << "Can't write model file: " << tmp_path;
+#if defined(_WIN32)
+  std::remove(path.c_str());
+#endif
+  CHECK(std::rename(tmp_path.c_str(), path.c_str()) == 0)
+  << "Can't replace model file: " << path;
+}
+
+std::unique_ptr<MappedFile> OpenModel(const std::string& path,
+                                      ModelParam* coef,
+                                      std::string* error) {
+  std::unique_ptr<MappedFile> file = MappedFile::Open(path, error);
+  if (file == nullptr) return nullptr;
+  const auto fail = [&](const std::string& reason) {
+    *error = reason + ": " + path;
+    return nullptr;
+  };
+
+  if (file->size() < sizeof(FileHeader)) return fail("Invalid model file");
+  const FileHeader* header = reinterpret_cast<const FileHeader*>(file->data());
+  if (std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0)
+    return fail("Not a fastfm model file");
+  if (header->version != kVersion)
+    return fail("Unsupported model file version");
+  if (header->file_size != file->size()) return fail("Truncated model file");
+  if (sizeof(FileHeader) + header->n_sections * sizeof(SectionHeader)
+      > file->size())
+    return fail("Invalid model file");
+
+  // Validate all sections before coef is touched, a corrupt file leaves
+  // the parameters unchanged and none of the setters below can abort.
+  const SectionHeader* sections =
+      reinterpret_cast<const SectionHeader*>(file->data() + sizeof(FileHeader));
+  // Number of features by w1 and the columns of w2 / w3, -1 if unset.
+  int64_t n_features = -1;
+  for (uint32_t i = 0; i < header->n_sections; ++i) {
+    const SectionHeader& section = sections[i];
+    const std::string name(section.name,
+                           strnlen(section.name, sizeof(section.name)));
+    if (section.offset % kAlignment != 0
+        || !InFile(section.offset, section.bytes, file->size()))
+      return fail("Invalid section in model file");
+    if (section.kind == kKeys) continue;
+    if (section.kind != kVector && section.kind != kMatrix
+        && section.kind != kScalarMap)
+      return fail("Unknown section kind in model file");
+    // The parameters are indexed with int, rows * cols can't overflow.
+    if (section.rows > kMaxDim || section.cols > kMaxDim
+        || section.rows * section.cols > UINT64_MAX / sizeof(double)
+        || section.bytes != section.rows * section.cols * sizeof(double))
+      return fail("Invalid section size in model file");
+
+    int64_t section_features = -1;
+    if (section.kind == kVector && name == "w0" && section.rows != 1)
+      return fail("Invalid w0 in model file");
+    if (section.kind == kVector && name == "w1")
+      section_features = section.rows;
+    if (section.kind == kMatrix && (name == "w2" || name == "w3"))
+      section_features = section.cols;
+    if (section_features >= 0) {
+      if (n_features >= 0 && n_features != section_features)
+        return fail("Inconsistent number of features in model file");
+      n_features = section_features;
+    }
+
+    if (section.kind == kScalarMap) {
+      if (!(i + 1 < header->n_sections && sections[i + 1].kind == kKeys))
+        return fail("Scalar map without keys in model file");
+      const SectionHeader& keys = sections[i + 1];
+      if (CountKeys(std::string(file->data() + keys.offset, keys.bytes))
+          != section.rows)
+        return fail("Scalar map keys don't match its values in model file");
+    }
+  }
+
+  for (uint32_t i = 0; i < header->n_sections; ++i) {
+    const SectionHeader& section = sections[i];
+    const std::string name(section.name,
+                           strnlen(section.name, sizeof(section.name)));
+    char* raw = file->data() + section.offset;
+    double* data = reinterpret_cast<double*>(raw);
+
+    if (section.kind == kMatrix) {
+      if (name == "w2") {
+        coef->setw2(data, section.rows, section.cols);
+      } else if (name == "w3") {
+        coef->setw3(data, section.rows, section.cols);
+      } else {
+        LOG(ERROR) << "Matrix " << name << " not supported.";
+      }
+    } else if (section.kind == kVector) {
+      if (name == "w0") {
+        coef->setw0_ptr(data);
+      } else if (name == "w1") {
+        coef->setw1(data, section.rows);
+      } else {
+        coef->set_vector(name, data, section.rows);
+      }
+    } else if (section.kind == kScalarMap) {
+      const SectionHeader& keys = sections[i + 1];
+      coef->setMapValues(std::string(file->data() + keys.offset, keys.bytes),
+                         data, section.rows);
+    }
+  }
+  return file;
+}
+
+}  // namespace io
+}  // namespace fastfm
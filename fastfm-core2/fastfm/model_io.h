@@ -0,0 +1,98 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_MODEL_IO_H_
+#define FASTFM_CORE2_FASTFM_MODEL_IO_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "fastfm_impl.h"
+
+namespace fastfm {
+namespace io {
+
+// File layout (native byte order):
+//   FileHeader
+//   SectionHeader[n_sections]
+//   section data, each section starts at a multiple of kAlignment.
+// Floating-point sections are stored as double arrays, matrices row major.
+const char kMagic[8] = {'F', 'A', 'S', 'T', 'F', 'M', '2', '\0'};
+const uint32_t kVersion = 1;
+const uint64_t kAlignment = 64;
+
+enum SectionKind : uint32_t {
+  kVector = 0,      // rows doubles
+  kMatrix = 1,      // rows x cols doubles
+  kScalarMap = 2,   // rows doubles, keys in the following kKeys section
+  kKeys = 3,        // bytes characters, comma separated names
+};
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_sections;
+  uint64_t file_size;
+};
+
+struct SectionHeader {
+  char name[64];
+  uint32_t kind;
+  uint32_t reserved;
+  uint64_t offset;
+  uint64_t rows;
+  uint64_t cols;
+  uint64_t bytes;
+};
+
+/** @brief Read only view of a file, memory mapped where supported.
+ *
+ * The mapping is private, writes to the memory are not carried through
+ * to the file.
+ */
+class MappedFile {
+ public:
+  // Returns nullptr and sets error if the file can't be read.
+  static std::unique_ptr<MappedFile> Open(const std::string& path,
+                                          std::string* error);
+  ~MappedFile();
+
+  char* data() { return data_; }
+  uint64_t size() const { return size_; }
+
+ private:
+  MappedFile() : data_(NULL), size_(0) {}
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  char* data_;
+  uint64_t size_;
+  std::unique_ptr<char[]> buffer_;  // used if mmap is not available
+};
+
+// Writes all parameter of coef to path.
+void SaveModel(const ModelParam& coef, const std::string& path);
+
+// Maps the model file at path and wires its sections into coef without
+// copying. The returned file has to outlive coef. Returns nullptr, sets
+// error and leaves coef unchanged if the file is missing or corrupt.
+std::unique_ptr<MappedFile> OpenModel(const std::string& path,
+                                      ModelParam* coef,
+                                      std::string* error);
+
+}  // namespace io
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_MODEL_IO_H_
@@ -0,0 +1,206 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "model_registry.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <thread>
+
+#define LOGURU_REPLACE_GLOG 1
+#include "../3rdparty/loguru/loguru.hpp"
+
+namespace fastfm {
+
+struct ModelRegistry::Table {
+  struct Split {
+    std::vector<double> cumulative;  // normalized to 1
+    std::vector<const Model*> models;
+  };
+
+  std::unordered_map<std::string, std::shared_ptr<const Model>> models;
+  std::unordered_map<std::string,
+                     std::vector<std::pair<std::string, double>>> weights;
+  std::unordered_map<std::string, Split> routes;
+
+  // Resolves the route weights against the current models.
+  void resolve_routes() {
+    routes.clear();
+    for (const auto& route : weights) {
+      Split& split = routes[route.first];
+      double total = 0;
+      for (const auto& item : route.second) total += item.second;
+      double sum = 0;
+      for (const auto& item : route.second) {
+        sum += item.second;
+        split.cumulative.push_back(sum / total);
+        split.models.push_back(models.at(item.first).get());
+      }
+      split.cumulative.back() = 1;
+    }
+  }
+};
+
+namespace {
+
+// SplitMix64 finalizer, spreads sequential keys uniformly.
+uint64_t Mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+}  // namespace
+
+ModelRegistry::ModelRegistry(int max_readers)
+    : table_(NULL),
+      table_owner_(std::make_shared<const Table>()),
+      global_epoch_(1),
+      reader_epochs_(new std::atomic<uint64_t>[max_readers]),
+      max_readers_(max_readers) {
+  CHECK_GT(max_readers, 0);
+  for (int i = 0; i < max_readers_; ++i) reader_epochs_[i].store(0);
+  table_.store(table_owner_.get());
+}
+
+ModelRegistry::~ModelRegistry() {
+  for (int i = 0; i < max_readers_; ++i)
+    CHECK_EQ(reader_epochs_[i].load(), 0)
+    << "ModelRegistry destroyed while readers are active";
+}
+
+template<typename Update>
+void ModelRegistry::update_table(Update update) {
+  std::lock_guard<std::mutex> lock(writer_mutex_);
+  std::shared_ptr<Table> next = std::make_shared<Table>(*table_owner_);
+  update(next.get());
+  next->resolve_routes();
+
+  table_.store(next.get());
+  // Readers pinned after this increment see `next`, readers with an epoch
+  // up to `retired` may still use the old table and its models.
+  const uint64_t retired = global_epoch_.fetch_add(1);
+  retired_.push_back({retired, table_owner_});
+  table_owner_ = next;
+  collect_locked();
+}
+
+void ModelRegistry::publish(const std::string& name,
+                            std::shared_ptr<const Model> model) {
+  CHECK(model != nullptr) << "Can't publish an empty model: " << name;
+  update_table([&](Table* table) { table->models[name] = model; });
+}
+
+bool ModelRegistry::load(const std::string& name, const std::string& path,
+                         std::string* error) {
+  std::shared_ptr<const Model> model = Model::open_snapshot(path, error);
+  if (model == nullptr) return false;
+  publish(name, std::move(model));
+  return true;
+}
+
+void ModelRegistry::remove(const std::string& name) {
+  update_table([&](Table* table) {
+    for (const auto& route : table->weights)
+      for (const auto& item : route.second)
+        CHECK(item.first != name)
+        << "Model " << name << " is used by route " << route.first;
+    table->models.erase(name);
+  });
+}
+
+void ModelRegistry::set_route(
+    const std::string& route,
+    const std::vector<std::pair<std::string, double>>& weights) {
+  CHECK(!weights.empty()) << "Route without models: " << route;
+  update_table([&](Table* table) {
+    double total = 0;
+    for (const auto& item : weights) {
+      CHECK(table->models.count(item.first) > 0)
+      << "Route " << route << " uses unknown model " << item.first;
+      CHECK_GE(item.second, 0);
+      total += item.second;
+    }
+    CHECK_GT(total, 0) << "Route weights sum to zero: " << route;
+    table->weights[route] = weights;
+  });
+}
+
+void ModelRegistry::collect() {
+  std::lock_guard<std::mutex> lock(writer_mutex_);
+  collect_locked();
+}
+
+void ModelRegistry::collect_locked() {
+  uint64_t min_active = std::numeric_limits<uint64_t>::max();
+  for (int i = 0; i < max_readers_; ++i) {
+    const uint64_t epoch = reader_epochs_[i].load();
+    if (epoch != 0) min_active = std::min(min_active, epoch);
+  }
+  retired_.erase(std::remove_if(retired_.begin(), retired_.end(),
+                                [min_active](const Retired& r) {
+                                  return r.epoch < min_active;
+                                }),
+                 retired_.end());
+}
+
+size_t ModelRegistry::n_retired() const {
+  std::lock_guard<std::mutex> lock(writer_mutex_);
+  return retired_.size();
+}
+
+ModelRegistry::Reader::Reader(const ModelRegistry* registry)
+    : registry_(registry), slot_(-1), table_(NULL) {
+  // Start the slot search at a per thread offset to avoid contention.
+  const int n = registry->max_readers_;
+  int slot = std::hash<std::thread::id>()(std::this_thread::get_id()) % n;
+  while (true) {
+    uint64_t expected = 0;
+    const uint64_t epoch = registry->global_epoch_.load();
+    if (registry->reader_epochs_[slot].compare_exchange_strong(expected,
+                                                               epoch)) {
+      break;
+    }
+    slot = (slot + 1) % n;
+    if (slot == 0) std::this_thread::yield();
+  }
+  slot_ = slot;
+  table_ = registry->table_.load();
+}
+
+ModelRegistry::Reader::~Reader() {
+  registry_->reader_epochs_[slot_].store(0);
+}
+
+const Model* ModelRegistry::Reader::get(const std::string& name) const {
+  auto it = table_->models.find(name);
+  return it != table_->models.end() ? it->second.get() : NULL;
+}
+
+const Model* ModelRegistry::Reader::route(const std::string& route,
+                                          uint64_t key) const {
+  auto it = table_->routes.find(route);
+  if (it == table_->routes.end()) return NULL;
+  const Table::Split& split = it->second;
+  // Uniform in [0, 1) from the top 53 bits of the mixed key.
+  const double u = (Mix(key) >> 11) * (1.0 / (1ULL << 53));
+  const size_t i = std::upper_bound(split.cumulative.begin(),
+                                    split.cumulative.end(), u)
+      - split.cumulative.begin();
+  return split.models[std::min(i, split.models.size() - 1)];
+}
+
+}  // namespace fastfm
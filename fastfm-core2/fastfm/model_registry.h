@@ -0,0 +1,133 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_MODEL_REGISTRY_H_
+#define FASTFM_CORE2_FASTFM_MODEL_REGISTRY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "fastfm.h"
+
+namespace fastfm {
+
+/** @brief Named model snapshots with hot reload and weighted routing.
+ *
+ * Readers pin the registry with a `ModelRegistry::Reader` and look models
+ * up by name or route without locks or reference counting. Writers publish
+ * a new routing table atomically; replaced models and tables are retired
+ * and freed once no reader that could still see them is active
+ * (epoch based reclamation). Writers are serialized by a mutex.
+ *
+ * Example:
+ *   registry.load("ctr_v2", "ctr_v2.ffm", &error);
+ *   registry.set_route("ctr", {{"ctr_v1", 0.9}, {"ctr_v2", 0.1}});
+ *   {
+ *     ModelRegistry::Reader reader(&registry);
+ *     const Model* m = reader.route("ctr", user_id);
+ *     predict_rows(*m, ...);
+ *   }  // m must not be used after the reader is gone
+ */
+class ModelRegistry {
+  struct Table;
+
+ public:
+  explicit ModelRegistry(int max_readers = 256);
+  ~ModelRegistry();
+
+  // Adds or replaces the model `name`.
+  void publish(const std::string& name, std::shared_ptr<const Model> model);
+
+  // Maps a file written by `Model::save` (see `Model::open_snapshot`) and
+  // publishes it. Returns false and sets error if the file is missing or
+  // corrupt, the published version of `name` stays in place.
+  bool load(const std::string& name, const std::string& path,
+            std::string* error);
+
+  void remove(const std::string& name);
+
+  // Splits the traffic of `route` between models proportional to the
+  // weights. All models have to be published.
+  void set_route(const std::string& route,
+                 const std::vector<std::pair<std::string, double>>& weights);
+
+  // Frees retired models that no active reader can reach anymore.
+  // Called by all writer functions.
+  void collect();
+
+  // Number of retired but not yet freed objects.
+  size_t n_retired() const;
+
+  /** @brief Pins the current models for the lifetime of the reader.
+   *
+   * Models returned by `get` and `route` stay valid until the reader is
+   * destroyed, even if they are replaced in the meantime. Readers are
+   * cheap and meant to be scoped to a single request.
+   */
+  class Reader {
+   public:
+    explicit Reader(const ModelRegistry* registry);
+    ~Reader();
+
+    // Null if there is no model `name`.
+    const Model* get(const std::string& name) const;
+
+    // Model of `route` for a request key, the same key always maps to the
+    // same model for a fixed split. Null if the route does not exist.
+    const Model* route(const std::string& route, uint64_t key) const;
+
+   private:
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    const ModelRegistry* registry_;
+    int slot_;
+    const Table* table_;
+  };
+
+ private:
+  struct Retired {
+    uint64_t epoch;
+    std::shared_ptr<const void> object;
+  };
+
+  // Copies the current table, applies `update` and publishes the result.
+  template<typename Update>
+  void update_table(Update update);
+  void collect_locked();
+
+  ModelRegistry(const ModelRegistry&) = delete;
+  ModelRegistry& operator=(const ModelRegistry&) = delete;
+
+  std::atomic<const Table*> table_;
+  std::shared_ptr<const Table> table_owner_;
+
+  mutable std::atomic<uint64_t> global_epoch_;
+  // Epoch of each active reader, 0 for free slots.
+  std::unique_ptr<std::atomic<uint64_t>[]> reader_epochs_;
+  int max_readers_;
+
+  mutable std::mutex writer_mutex_;
+  std::vector<Retired> retired_;
+};
+
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_MODEL_REGISTRY_H_
@@ -0,0 +1,166 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sample_order.h"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <utility>
+
+#define LOGURU_REPLACE_GLOG 1
+#include "../3rdparty/loguru/loguru.hpp"
+
+namespace fastfm {
+namespace order {
+
+std::vector<int> ReverseCuthillMcKee(constSpMatRef x) {
+  const int n_samples = x.rows();
+  const int n_features = x.cols();
+
+  // Features of every sample, only the sparsity pattern is read (binary
+  // matrices have no values).
+  std::vector<int> degree(n_samples, 0);
+  for (int col = 0; col < n_features; ++col)
+    for (constSpMatRef::InnerIterator it(x, col); it; ++it) ++degree[it.row()];
+  std::vector<size_t> row_begin(n_samples + 1, 0);
+  for (int i = 0; i < n_samples; ++i)
+    row_begin[i + 1] = row_begin[i] + degree[i];
+  std::vector<int> row_cols(row_begin[n_samples]);
+  {
+    std::vector<size_t> next(row_begin.begin(), row_begin.end() - 1);
+    for (int col = 0; col < n_features; ++col)
+      for (constSpMatRef::InnerIterator it(x, col); it; ++it)
+        row_cols[next[it.row()]++] = col;
+  }
+
+  // Start each connected component at a sample of minimal degree.
+  std::vector<int> start(n_samples);
+  std::iota(start.begin(), start.end(), 0);
+  std::stable_sort(start.begin(), start.end(),
+                   [&degree](int a, int b) { return degree[a] < degree[b]; });
+
+  std::vector<int> perm;
+  perm.reserve(n_samples);
+  std::vector<bool> row_seen(n_samples, false);
+  std::vector<bool> col_seen(n_features, false);
+  std::vector<int> level;
+
+  for (int s : start) {
+    if (row_seen[s]) continue;
+    row_seen[s] = true;
+    perm.push_back(s);
+    // Breadth first search, `perm` doubles as queue. Each feature is expanded
+    // only once which keeps the traversal linear in the number of non-zeros.
+    for (size_t head = perm.size() - 1; head < perm.size(); ++head) {
+      for (size_t k = row_begin[perm[head]]; k < row_begin[perm[head] + 1];
+           ++k) {
+        const int col = row_cols[k];
+        if (col_seen[col]) continue;
+        col_seen[col] = true;
+
+        level.clear();
+        for (constSpMatRef::InnerIterator it_c(x, col); it_c; ++it_c) {
+          const int row = it_c.row();
+          if (row_seen[row]) continue;
+          row_seen[row] = true;
+          level.push_back(row);
+        }
+        std::stable_sort(level.begin(), level.end(),
+                         [&degree](int a, int b) {
+                           return degree[a] < degree[b];
+                         });
+        perm.insert(perm.end(), level.begin(), level.end());
+      }
+    }
+  }
+  std::reverse(perm.begin(), perm.end());
+  return perm;
+}
+
+std::vector<int> DominantFeatureOrder(constSpMatRef x) {
+  const int n_samples = x.rows();
+
+  // key[i] is the most frequent feature of sample i,
+  // -1 for samples without any feature.
+  std::vector<int> key(n_samples, -1);
+  std::vector<int> key_nnz(n_samples, -1);
+  for (int col = 0; col < x.cols(); ++col) {
+    const int nnz = x.outerIndexPtr()[col + 1] - x.outerIndexPtr()[col];
+    for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
+      const int row = it.row();
+      if (nnz > key_nnz[row]) {
+        key_nnz[row] = nnz;
+        key[row] = col;
+      }
+    }
+  }
+
+  std::vector<int> perm(n_samples);
+  std::iota(perm.begin(), perm.end(), 0);
+  std::stable_sort(perm.begin(), perm.end(),
+                   [&key](int a, int b) { return key[a] < key[b]; });
+  return perm;
+}
+
+std::vector<int> RandomOrder(int n_samples, int seed) {
+  std::vector<int> perm(n_samples);
+  std::iota(perm.begin(), perm.end(), 0);
+  std::shuffle(perm.begin(), perm.end(), std::mt19937(seed));
+  return perm;
+}
+
+std::vector<int> SampleOrder(const std::string& method, constSpMatRef x,
+                             int seed) {
+  if (method == "rcm") {
+    return ReverseCuthillMcKee(x);
+  } else if (method == "dominant") {
+    return DominantFeatureOrder(x);
+  } else if (method == "random") {
+    return RandomOrder(x.rows(), seed);
+  } else if (method == "none") {
+    std::vector<int> perm(x.rows());
+    std::iota(perm.begin(), perm.end(), 0);
+    return perm;
+  }
+  CHECK(false) << "Sample order: " << method << " is not supported";
+  return std::vector<int>();
+}
+
+SpMat PermuteRows(constSpMatRef x, const std::vector<int>& perm) {
+  CHECK_EQ(perm.size(), x.rows());
+  std::vector<int> inverse(perm.size());
+  for (size_t i = 0; i < perm.size(); ++i) inverse[perm[i]] = i;
+
+  SpMat res(x.rows(), x.cols());
+  res.reserve(x.nonZeros());
+  // Binary matrices have no values, every non-zero is 1.
+  const bool binary = x.valuePtr() == nullptr;
+  std::vector<std::pair<int, double>> column;
+  for (int col = 0; col < x.cols(); ++col) {
+    column.clear();
+    for (constSpMatRef::InnerIterator it(x, col); it; ++it)
+      column.emplace_back(inverse[it.row()], binary ? 1 : it.value());
+    std::sort(column.begin(), column.end());
+
+    res.startVec(col);
+    for (const auto& entry : column)
+      res.insertBack(entry.first, col) = entry.second;
+  }
+  res.finalize();
+  return res;
+}
+
+}  // namespace order
+}  // namespace fastfm
@@ -0,0 +1,50 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_SAMPLE_ORDER_H_
+#define FASTFM_CORE2_FASTFM_SAMPLE_ORDER_H_
+
+#include <string>
+#include <vector>
+
+#include "fastfm_decl.h"
+
+namespace fastfm {
+namespace order {
+
+// All functions return a permutation `perm` where the new sample `i`
+// is the original sample `perm[i]`.
+
+// Reverse Cuthill-McKee on the bipartite sample / feature graph.
+// Samples that share features receive neighbouring indices.
+std::vector<int> ReverseCuthillMcKee(constSpMatRef x);
+
+// Groups samples by the feature with the most non-zeros they contain.
+std::vector<int> DominantFeatureOrder(constSpMatRef x);
+
+// Uniformly random order of n_samples samples, seeded by `seed`.
+std::vector<int> RandomOrder(int n_samples, int seed);
+
+// Dispatches on `method`, supported are `rcm`, `dominant`, `random`
+// (seeded by `seed`) and `none`.
+std::vector<int> SampleOrder(const std::string& method, constSpMatRef x,
+                             int seed = 0);
+
+// Returns a copy of x with the rows arranged in `perm` order.
+SpMat PermuteRows(constSpMatRef x, const std::vector<int>& perm);
+
+}  // namespace order
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_SAMPLE_ORDER_H_
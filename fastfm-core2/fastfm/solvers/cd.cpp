@@ -17,6 +17,14 @@
 
 #include "solvers.h"
 #include "cd_impl.h"
+#include "numa.h"
+#include "parallel.h"
+#include "quantize.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
 
 #define LOGURU_REPLACE_GLOG 1
 #include "../../3rdparty/loguru/loguru.hpp"
@@ -24,25 +32,20 @@
 namespace fastfm {
 namespace cd {
 
-void Predict(Model* m, Data* d) {
+void Predict(const Model* m, Data* d) {
   Data::Impl* data = Internal::get_impl(d);
-  Model::Impl* model = Internal::get_impl(m);
-
-  const bool third_order = model->coef_->getw3().rows() > 0;
+  const Model::Impl* model = Internal::get_impl(m);
 
-  if (third_order)
-    impl::Predict(data->get_design_matrix_col_major(),
-                  model->coef_->getw3(),
-                  model->coef_->getw2(),
-                  model->coef_->getw1(),
-                  model->coef_->getw0(),
-                  data->get_prediction());
-  else
+  const QuantizedParam* quantized = model->coef_->get_quantized();
+  if (quantized != NULL) {
+    quant::Predict(data->get_design_matrix_col_major(), *quantized,
+                   data->get_prediction());
+  } else {
     impl::Predict(data->get_design_matrix_col_major(),
-                  model->coef_->getw2(),
-                  model->coef_->getw1(),
-                  model->coef_->getw0(),
+                  model->coef_,
                   data->get_prediction());
+  }
+  data->restore_prediction_order();
 }
 
 void FitSquareLoss(Data* d,
@@ -79,11 +82,36 @@ void FitSquareLoss(Data* d,
                         model->coef_,
                         data->get_prediction(),
                         cb, python_func);
+    data->restore_prediction_order();
   } else {
-    impl::FitSquareLoss(data->get_design_matrix_col_major(),
+    SolverSettings solver = settings->settings_;
+    // Column to group index for the per group penalties.
+    if (data->has_vector("feature_group")) {
+      constVectorRef group = data->get_vector("feature_group");
+          CHECK_EQ(group.size(), n_features);
+      solver.feature_group.assign(group.data(), group.data() + n_features);
+    }
+
+    // The threads of a layer parallel fit read the design matrix from the
+    // nodes of all workers, place a copy accordingly.
+    SpMat placed;
+    // Binary matrices are read in place, a copy would need values.
+    const bool place = solver.memory_placement != "default"
+        && solver.n_threads > 1 && solver.n_processes <= 1
+        && !data->is_binary("x");
+    if (place) {
+      const std::vector<int> cpus =
+          numa::WorkerCpus(solver.thread_affinity, solver.n_threads);
+      CHECK(!cpus.empty()) << "memory_placement requires a thread_affinity";
+      placed = numa::PlacedCopy(solver.memory_placement, cpus,
+                                data->get_design_matrix_col_major());
+    }
+    impl::FitSquareLoss(place ? constSpMatRef(placed)
+                              : constSpMatRef(
+                                  data->get_design_matrix_col_major()),
                         data->get_train_target(),
                         data->get_vector("cost"),
-                        settings->settings_,
+                        solver,
                         model->coef_,
                         cb, python_func);
   }
@@ -93,5 +121,84 @@ void FitSquareLoss(Data* d, Model* m, Settings* s) {
   FitSquareLoss(d, m, s, nullptr, nullptr);
 }
 
+std::vector<double> CrossValidate(Data* d, const Model* m, Settings* s,
+                                  int n_folds, int n_threads) {
+  Data::Impl* data = Internal::get_impl(d);
+  const Model::Impl* model = Internal::get_impl(m);
+  SolverSettings settings = Internal::get_impl(s)->settings_;
+  CHECK(settings.solver == "cd") << "cross-validation requires the cd solver";
+  CHECK_EQ(settings.n_processes, 1)
+  << "cross-validation does not support n_processes";
+  data->check_col_major_train();
+
+  constSpMatRef x = data->get_design_matrix_col_major();
+  constVectorRef y = data->get_train_target();
+  constVectorRef cost = data->get_vector("cost");
+  const int n_samples = x.rows();
+  CHECK(n_folds >= 2 && n_folds <= n_samples)
+  << "n_folds: " << n_folds << " is not supported";
+  settings.rank_w2 = model->coef_->getw2().rows();
+  settings.rank_w3 = model->coef_->getw3().rows();
+  if (data->has_vector("feature_group")) {
+    constVectorRef group = data->get_vector("feature_group");
+    settings.feature_group.assign(group.data(), group.data() + x.cols());
+  }
+
+  // Shuffled, balanced assignment of the samples to the folds.
+  std::vector<int> perm(n_samples);
+  std::iota(perm.begin(), perm.end(), 0);
+  std::shuffle(perm.begin(), perm.end(), std::mt19937(settings.rng_seed));
+  std::vector<int> fold_of(n_samples);
+  for (int i = 0; i < n_samples; ++i) fold_of[perm[i]] = i % n_folds;
+
+  // Every fold fits its own copy of the model on x, the held out samples
+  // get zero cost.
+  std::vector<double> errors(n_folds);
+  parallel::ParallelFor(n_threads, n_folds, [&](int fold) {
+    Vector train_cost(n_samples);
+    Vector test_cost(n_samples);
+    for (int i = 0; i < n_samples; ++i) {
+      const double cost_i = cost.size() == 0 ? 1 : cost.coeff(i);
+      const bool held_out = fold_of[i] == fold;
+      train_cost(i) = held_out ? 0 : cost_i;
+      test_cost(i) = held_out ? cost_i : 0;
+    }
+    std::unique_ptr<ModelParam> coef = model->coef_->deep_copy();
+    coef->set_quantized(nullptr);
+    impl::FitSquareLoss(x, y, train_cost, settings, coef.get(),
+                        nullptr, nullptr);
+
+    Vector y_pred(n_samples);
+    impl::Predict(x, coef.get(), y_pred);
+    errors[fold] = MeanLoss(settings.loss, y, y_pred, test_cost);
+  });
+  return errors;
+}
+
+double MeanLoss(const std::string& loss, constVectorRef y_true,
+                constVectorRef y_pred, constVectorRef weight) {
+      CHECK_EQ(y_true.size(), y_pred.size());
+  const bool no_weight = weight.size() == 0;
+  const bool logistic = loss == "logistic";
+  double sum = 0;
+  double weight_sum = 0;
+  for (int i = 0; i < y_true.size(); ++i) {
+    const double weight_i = no_weight ? 1 : weight.coeff(i);
+    if (weight_i == 0) continue;
+    double loss_i;
+    if (logistic) {
+      const double margin = (y_true.coeff(i) > 0 ? 1 : -1) * y_pred.coeff(i);
+      loss_i = std::log1p(std::exp(-std::abs(margin)))
+          + std::max(-margin, 0.);
+    } else {
+      const double diff = y_true.coeff(i) - y_pred.coeff(i);
+      loss_i = diff * diff;
+    }
+    sum += weight_i * loss_i;
+    weight_sum += weight_i;
+  }
+  return weight_sum > 0 ? sum / weight_sum : 0;
+}
+
 }  // namespace cd
 }  // namespace fastfm
@@ -0,0 +1,548 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cd_distributed.h"
+#include "cd_impl.h"
+#include "coordinate_order.h"
+#include "numa.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <new>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define FASTFM_HAS_FORK 1
+#endif
+
+#define LOGURU_REPLACE_GLOG 1
+#include "../../3rdparty/loguru/loguru.hpp"
+
+namespace fastfm {
+namespace cd {
+namespace impl {
+
+#if FASTFM_HAS_FORK
+namespace {
+
+// The atomics are shared between processes and must not hide a lock.
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "int atomics are not lock free");
+
+// Control block at the start of the shared mapping.
+struct Control {
+  std::atomic<int> arrived;
+  std::atomic<int> generation;
+  std::atomic<int> stop;
+};
+
+const size_t kControlBytes = 64;
+
+/** @brief Worker processes and the memory they share.
+ *
+ * The mapping is created before the workers are forked, all processes see
+ * the same pages. Layout after the control block (doubles):
+ * w0 | w1 | w2 (rank x n_features) | err | q | err of each worker |
+ * q of each worker | order size of each worker.
+ */
+class WorkerGroup {
+ public:
+  WorkerGroup(int n_workers, int n_samples, int n_features, int rank)
+      : n_workers_(n_workers), n_samples_(n_samples),
+        n_features_(n_features), rank_(rank), id_(0),
+        coordinator_(getpid()) {
+    const size_t n_doubles = 1 + n_features
+        + static_cast<size_t>(rank) * n_features
+        + (2 + 2 * static_cast<size_t>(n_workers)) * n_samples + n_workers;
+    size_ = kControlBytes + n_doubles * sizeof(double);
+    void* data = mmap(NULL, size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    CHECK(data != MAP_FAILED) << "Can't map " << size_
+                              << " bytes of shared memory";
+    control_ = new(data) Control();
+    control_->arrived = 0;
+    control_->generation = 0;
+    control_->stop = 0;
+    w0_ = reinterpret_cast<double*>(static_cast<char*>(data) + kControlBytes);
+    w1_ = w0_ + 1;
+    w2_ = w1_ + n_features;
+    err_ = w2_ + static_cast<size_t>(rank) * n_features;
+    q_ = err_ + n_samples;
+    worker_err_ = q_ + n_samples;
+    worker_q_ = worker_err_ + static_cast<size_t>(n_workers) * n_samples;
+    order_size_ = worker_q_ + static_cast<size_t>(n_workers) * n_samples;
+  }
+
+  ~WorkerGroup() {
+    if (id_ == 0) Kill();
+    munmap(control_, size_);
+  }
+
+  // Forks the workers 1, ..., n_workers - 1, returns the id of the
+  // calling process. Workers have to leave with `_exit`.
+  int Fork() {
+    for (int w = 1; w < n_workers_; ++w) {
+      const pid_t pid = fork();
+      CHECK_GE(pid, 0) << "Can't fork worker process";
+      if (pid == 0) {
+        id_ = w;
+        workers_.clear();
+        return w;
+      }
+      workers_.push_back(pid);
+    }
+    return 0;
+  }
+
+  // Waits for all workers to exit, coordinator only.
+  void Join() {
+    for (pid_t& pid : workers_) {
+      int status = 0;
+      waitpid(pid, &status, 0);
+      pid = -1;
+      CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+      << "Worker process failed";
+    }
+    workers_.clear();
+  }
+
+  void Barrier() {
+    const int generation = control_->generation.load();
+    if (control_->arrived.fetch_add(1) == n_workers_ - 1) {
+      control_->arrived = 0;
+      control_->generation.fetch_add(1);
+      return;
+    }
+    for (int spin = 1; control_->generation.load() == generation; ++spin) {
+      if (spin > 64) std::this_thread::yield();
+      if (spin % 4096 == 0) CheckPeers();
+    }
+  }
+
+  int n_workers() const { return n_workers_; }
+
+  bool stopped() const { return control_->stop.load() != 0; }
+  void stop() { control_->stop = 1; }
+
+  double& w0() { return *w0_; }
+  Eigen::Map<Vector> w1() { return Eigen::Map<Vector>(w1_, n_features_); }
+  Eigen::Map<Matrix> w2() {
+    return Eigen::Map<Matrix>(w2_, rank_, n_features_);
+  }
+  Eigen::Map<Vector> err() { return Eigen::Map<Vector>(err_, n_samples_); }
+  Eigen::Map<Vector> q() { return Eigen::Map<Vector>(q_, n_samples_); }
+  Eigen::Map<Vector> worker_err(int w) {
+    return Eigen::Map<Vector>(
+        worker_err_ + static_cast<size_t>(w) * n_samples_, n_samples_);
+  }
+  Eigen::Map<Vector> worker_q(int w) {
+    return Eigen::Map<Vector>(
+        worker_q_ + static_cast<size_t>(w) * n_samples_, n_samples_);
+  }
+  double& order_size(int w) { return order_size_[w]; }
+
+  void CopyTo(ModelParam* coef) {
+    coef->setw0(w0());
+    coef->getw1() = w1();
+    if (rank_ > 0) coef->getw2() = w2();
+  }
+
+ private:
+  WorkerGroup(const WorkerGroup&) = delete;
+  WorkerGroup& operator=(const WorkerGroup&) = delete;
+
+  // A worker that waits forever for a dead peer would never return.
+  void CheckPeers() {
+    if (id_ != 0) {
+      if (getppid() != coordinator_) _exit(1);
+      return;
+    }
+    bool exited = false;
+    for (pid_t& pid : workers_) {
+      if (pid > 0 && waitpid(pid, NULL, WNOHANG) == pid) {
+        pid = -1;
+        exited = true;
+      }
+    }
+    if (exited) {
+      Kill();
+      CHECK(false) << "Worker process exited during fit";
+    }
+  }
+
+  void Kill() {
+    for (pid_t pid : workers_) {
+      if (pid <= 0) continue;
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+    }
+    workers_.clear();
+  }
+
+  int n_workers_;
+  int n_samples_;
+  int n_features_;
+  int rank_;
+  int id_;
+  pid_t coordinator_;
+  std::vector<pid_t> workers_;
+
+  size_t size_;
+  Control* control_;
+  double* w0_;
+  double* w1_;
+  double* w2_;
+  double* err_;
+  double* q_;
+  double* worker_err_;
+  double* worker_q_;
+  double* order_size_;
+};
+
+// Splits the columns in n_parts contiguous ranges with about the same
+// number of non-zeros, part p is [bounds[p], bounds[p + 1]).
+std::vector<int> PartitionColumns(constSpMatRef x, int n_parts) {
+  std::vector<double> cum_nnz(x.cols() + 1, 0);
+  for (int j = 0; j < x.cols(); ++j)
+    cum_nnz[j + 1] = cum_nnz[j] + x.innerVector(j).nonZeros();
+
+  std::vector<int> bounds(n_parts + 1, x.cols());
+  bounds[0] = 0;
+  for (int p = 1; p < n_parts; ++p) {
+    const double target = cum_nnz.back() * p / n_parts;
+    const int j = std::lower_bound(cum_nnz.begin(), cum_nnz.end(), target)
+        - cum_nnz.begin();
+    bounds[p] = std::max(bounds[p - 1],
+                         std::min(j, static_cast<int>(x.cols())));
+  }
+  return bounds;
+}
+
+// Epoch loop of one worker, executed by every process of the group.
+class Worker {
+ public:
+  // x_local has to hold the owned columns of x at the same indices.
+  Worker(int id, constSpMatRef x, constSpMatRef x_local, constVectorRef y,
+         constVectorRef cost, const SolverSettings& settings,
+         const std::vector<int>& bounds, WorkerGroup* group)
+      : id_(id), x_(x), x_local_(x_local), y_(y), cost_(cost),
+        settings_(settings),
+        group_(group), lo_(bounds[id]), hi_(bounds[id + 1]),
+        sample_lo_(static_cast<int64_t>(x.rows()) * id
+                       / group->n_workers()),
+        sample_hi_(static_cast<int64_t>(x.rows()) * (id + 1)
+                       / group->n_workers()),
+        rank_(group->w2().rows()),
+        coords_(settings, 1 + rank_, hi_ - lo_),
+        l2_reg_w1_(ColumnL2Reg(settings.l2_reg_w1, settings.group_l2_reg_w1,
+                               settings.feature_group, x.cols())),
+        l2_reg_w2_(ColumnL2Reg(settings.l2_reg_w2, settings.group_l2_reg_w2,
+                               settings.feature_group, x.cols())) {
+    // Concurrent workers overshoot without damping.
+    step_size_ = settings.layer_damping > 0
+                 ? settings.layer_damping : 1. / group->n_workers();
+  }
+
+  // Copies the owned parameters into the shared memory and zeros the
+  // owned samples, the pages are first touched by the worker using them.
+  void Init(const ModelParam& coef) {
+    for (int i = sample_lo_; i < sample_hi_; ++i) {
+      group_->err()(i) = 0;
+      group_->q()(i) = 0;
+    }
+    group_->worker_err(id_).setZero();
+    group_->worker_q(id_).setZero();
+    for (int j = lo_; j < hi_; ++j) {
+      group_->w1()(j) = coef.getw1().coeff(j);
+      for (int f = 0; f < rank_; ++f)
+        group_->w2()(f, j) = coef.getw2().coeff(f, j);
+    }
+  }
+
+  // Returns after the last epoch or an early stop of the callback,
+  // `coef` and the callback are only used by the coordinator.
+  void Run(ModelParam* coef, fit_callback_t cb,
+           python_function_t python_func) {
+    for (int i = 0; ; ++i) {
+      group_->Barrier();
+      if (i == settings_.iter || group_->stopped()) break;
+      if (id_ == 0) InitResidual();
+      group_->Barrier();
+
+      coords_.next_epoch();
+      if (settings_.first_order) Sweep(0, -1);
+      for (int f = 0; f < rank_; ++f) {
+        SumQcache(f);
+        Sweep(1 + f, f);
+      }
+
+      if (id_ == 0 && cb != nullptr && python_func != nullptr) {
+        // The callback might inspect the model parameter.
+        group_->CopyTo(coef);
+        if (cb("{}", python_func)) group_->stop();
+      }
+    }
+  }
+
+ private:
+  // err = y - y_pred with the exact prediction, then updates the bias,
+  // weighted by the cost if given.
+  void InitResidual() {
+    Eigen::Map<Vector> err = group_->err();
+    Predict(x_, group_->w2(), group_->w1(), group_->w0(), err);
+    err = y_ - err;
+    if (settings_.zero_order) {
+      const double w_old = group_->w0();
+      if (cost_.size() > 0) {
+        const double weight_sum = cost_.sum();
+        group_->w0() = (cost_.dot(err) + w_old * weight_sum) / weight_sum;
+      } else {
+        const double n = static_cast<double>(x_.rows());
+        group_->w0() = (err.sum() + w_old * n) / n;
+      }
+      err = err.array() + (w_old - group_->w0());
+    }
+  }
+
+  // Sums the q cache of layer f over the column partitions.
+  void SumQcache(const int f) {
+    Eigen::Map<Vector> q_w = group_->worker_q(id_);
+    q_w.setZero();
+    Eigen::Map<Matrix> w2 = group_->w2();
+    const bool binary = IsBinary(x_local_);
+    for (int j = lo_; j < hi_; ++j) {
+      for (constSpMatRef::InnerIterator it(x_local_, j); it; ++it)
+        q_w.coeffRef(it.row()) += (binary ? 1 : it.value()) * w2.coeff(f, j);
+    }
+    group_->Barrier();
+    Eigen::Map<Vector> q = group_->q();
+    for (int i = sample_lo_; i < sample_hi_; ++i) {
+      double sum = 0;
+      for (int w = 0; w < group_->n_workers(); ++w)
+        sum += group_->worker_q(w).coeff(i);
+      q.coeffRef(i) = sum;
+    }
+    group_->Barrier();
+  }
+
+  // Updates the owned coordinates of `block`, w1 for layer < 0, and
+  // exchanges the residual every `exchange_block` coordinates.
+  void Sweep(const int block, const int layer) {
+    const std::vector<int>& order = coords_.order(block);
+    group_->order_size(id_) = order.size();
+    group_->Barrier();
+    double max_size = 0;
+    for (int w = 0; w < group_->n_workers(); ++w)
+      max_size = std::max(max_size, group_->order_size(w));
+    const int n_exchanges = static_cast<int>(
+        std::ceil(max_size / settings_.exchange_block));
+    // The next sweep overwrites the order sizes.
+    if (n_exchanges == 0) group_->Barrier();
+
+    Eigen::Map<Vector> w1 = group_->w1();
+    Eigen::Map<Matrix> w2 = group_->w2();
+    for (int e = 0; e < n_exchanges; ++e) {
+      err_ = group_->err();
+      if (layer >= 0) q_ = group_->q();
+      const int begin = std::min<int64_t>(
+          static_cast<int64_t>(e) * settings_.exchange_block, order.size());
+      const int end = std::min<int64_t>(
+          static_cast<int64_t>(begin) + settings_.exchange_block,
+          order.size());
+      for (int k = begin; k < end; ++k) {
+        const int j = lo_ + order[k];
+        double chsqr = 0;
+        double che = 0;
+        if (layer < 0) {
+          const double w_old = w1.coeff(j);
+          FirstOrderStats(j, cost_, x_local_, err_, &chsqr, &che);
+          const double w_new =
+              (che + w_old * chsqr) / (chsqr + l2_reg_w1_.coeff(j));
+          w1.coeffRef(j) = w_old + step_size_ * (w_new - w_old);
+          coords_.report(block, order[k], w1.coeff(j) - w_old);
+          FirstOrderErrUpdate(j, w1.coeff(j), w_old, x_local_, &err_);
+        } else {
+          const double w_old = w2.coeff(layer, j);
+          SecondOrderStats(layer, j, cost_, x_local_, w2, err_, q_,
+                           &chsqr, &che);
+          const double w_new =
+              (che + w_old * chsqr) / (chsqr + l2_reg_w2_.coeff(j));
+          w2.coeffRef(layer, j) = w_old + step_size_ * (w_new - w_old);
+          coords_.report(block, order[k], w2.coeff(layer, j) - w_old);
+          SecondOrderErrAndQcacheUpdate(layer, j, w2, w_old, x_local_,
+                                        &err_, &q_);
+        }
+      }
+      group_->worker_err(id_) = err_;
+      if (layer >= 0) group_->worker_q(id_) = q_;
+      group_->Barrier();
+      Merge(layer >= 0);
+      group_->Barrier();
+    }
+  }
+
+  // Adds the changes of all workers to the owned slice of the samples.
+  // Exact for q, the residual misses the interactions between features
+  // of different workers that changed in the same exchange.
+  void Merge(const bool with_q) {
+    Eigen::Map<Vector> err = group_->err();
+    Eigen::Map<Vector> q = group_->q();
+    for (int i = sample_lo_; i < sample_hi_; ++i) {
+      const double err_old = err.coeff(i);
+      const double q_old = with_q ? q.coeff(i) : 0;
+      double err_delta = 0;
+      double q_delta = 0;
+      for (int w = 0; w < group_->n_workers(); ++w) {
+        err_delta += group_->worker_err(w).coeff(i) - err_old;
+        if (with_q) q_delta += group_->worker_q(w).coeff(i) - q_old;
+      }
+      err.coeffRef(i) = err_old + err_delta;
+      if (with_q) q.coeffRef(i) = q_old + q_delta;
+    }
+  }
+
+  const int id_;
+  constSpMatRef x_;
+  constSpMatRef x_local_;
+  constVectorRef y_;
+  constVectorRef cost_;
+  const SolverSettings& settings_;
+  WorkerGroup* group_;
+  const int lo_;
+  const int hi_;
+  const int sample_lo_;
+  const int sample_hi_;
+  const int rank_;
+  double step_size_;
+  CoordinateOrder coords_;
+  const Vector l2_reg_w1_;
+  const Vector l2_reg_w2_;
+
+  // Working copies, allocated after the fork in the worker's memory.
+  Vector err_;
+  Vector q_;
+};
+
+// Copy of x that holds only the columns [lo, hi), at their indices in x.
+SpMat OwnedColumns(constSpMatRef x, int lo, int hi) {
+  const bool binary = IsBinary(x);
+  sparse_index_t nnz = 0;
+  for (int j = lo; j < hi; ++j) nnz += x.innerVector(j).nonZeros();
+  SpMat owned(x.rows(), x.cols());
+  owned.resizeNonZeros(nnz);
+  sparse_index_t k = 0;
+  for (int j = 0; j < x.cols(); ++j) {
+    owned.outerIndexPtr()[j] = k;
+    if (j < lo || j >= hi) continue;
+    for (constSpMatRef::InnerIterator it(x, j); it; ++it, ++k) {
+      owned.innerIndexPtr()[k] = it.row();
+      owned.valuePtr()[k] = binary ? 1 : it.value();
+    }
+  }
+  owned.outerIndexPtr()[x.cols()] = k;
+  return owned;
+}
+
+void RunWorker(int id, constSpMatRef x, constVectorRef y,
+               constVectorRef cost, const SolverSettings& settings,
+               const std::vector<int>& bounds, const std::vector<int>& cpus,
+               WorkerGroup* group, ModelParam* coef, fit_callback_t cb,
+               python_function_t python_func) {
+  numa::ScopedPin pin(cpus.empty() ? -1 : cpus[id]);
+  // Partitioned placement, each worker reads its columns from
+  // a copy on its own node.
+  const bool partitioned = settings.memory_placement == "partitioned";
+  SpMat owned;
+  if (partitioned) owned = OwnedColumns(x, bounds[id], bounds[id + 1]);
+
+  Worker worker(id, x, partitioned ? constSpMatRef(owned) : x, y, cost,
+                settings, bounds, group);
+  worker.Init(*coef);
+  worker.Run(coef, cb, python_func);
+}
+
+}  // namespace
+
+void FitSquareLossDistributed(constSpMatRef x, constVectorRef y,
+                              constVectorRef cost, SolverSettings settings,
+                              ModelParam* coef, fit_callback_t cb,
+                              python_function_t python_func) {
+  CHECK(settings.solver != "mcmc")
+  << "mcmc does not support distributed fits";
+  CHECK(settings.loss != "logistic")
+  << "distributed fits support the squared loss only";
+  CHECK_EQ(settings.rank_w3, 0)
+  << "distributed fits do not support third order models";
+  CHECK_GT(settings.exchange_block, 0);
+
+  const int n_features = x.cols();
+  const int rank = settings.rank_w2 > 0 ? coef->getw2().rows() : 0;
+  const int n_workers = std::max(1, std::min(settings.n_processes,
+                                             n_features));
+  const std::vector<int> bounds = PartitionColumns(x, n_workers);
+  const std::vector<int> cpus =
+      numa::WorkerCpus(settings.thread_affinity, n_workers);
+  CHECK(settings.memory_placement == "default" || !cpus.empty())
+  << "memory_placement requires a thread_affinity";
+
+  // Interleaved placement, the pages of x are spread over the nodes of
+  // the workers before they share them. Binary matrices are shared in place.
+  const bool interleave = settings.memory_placement == "interleaved"
+      && !IsBinary(x);
+  SpMat interleaved;
+  if (interleave) interleaved = numa::PlacedCopy("interleaved", cpus, x);
+  constSpMatRef x_shared = interleave ? constSpMatRef(interleaved) : x;
+
+  WorkerGroup group(n_workers, x.rows(), n_features, rank);
+  group.w0() = coef->getw0();
+  const int id = group.Fork();
+  if (id != 0) {
+    // Workers must neither return into the caller nor run its
+    // exit handlers.
+    try {
+      RunWorker(id, x_shared, y, cost, settings, bounds, cpus, &group,
+                coef, nullptr, nullptr);
+    } catch (...) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  RunWorker(0, x_shared, y, cost, settings, bounds, cpus, &group,
+            coef, cb, python_func);
+  group.Join();
+  group.CopyTo(coef);
+}
+
+#else  // FASTFM_HAS_FORK
+
+void FitSquareLossDistributed(constSpMatRef x, constVectorRef y,
+                              constVectorRef cost, SolverSettings settings,
+                              ModelParam* coef, fit_callback_t cb,
+                              python_function_t python_func) {
+  CHECK(false) << "distributed fits require a POSIX system";
+}
+
+#endif  // FASTFM_HAS_FORK
+
+}  // namespace impl
+}  // namespace cd
+}  // namespace fastfm
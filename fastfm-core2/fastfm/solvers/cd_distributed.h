@@ -0,0 +1,51 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_SOLVERS_CD_DISTRIBUTED_H_
+#define FASTFM_CORE2_FASTFM_SOLVERS_CD_DISTRIBUTED_H_
+
+#include "fastfm_impl.h"
+
+namespace fastfm {
+namespace cd {
+namespace impl {
+
+/** @brief Square loss CD with the features split between worker processes.
+ *
+ * The calling process acts as coordinator and worker 0, it forks
+ * `settings.n_processes - 1` further workers. Each worker owns a contiguous
+ * range of columns of `x` with roughly the same number of non-zeros and
+ * sweeps its coordinates in the order of the serial solver
+ * (w1, then w2 layer by layer). Parameters, residual and q cache live in
+ * an anonymous shared memory mapping; after every `settings.exchange_block`
+ * coordinates the workers merge their residual and q cache deltas.
+ *
+ * Workers update against the residual of the last exchange (Jacobi across
+ * workers), the steps are damped with `settings.layer_damping`. The
+ * coordinator recomputes the exact residual at the start of every epoch.
+ * Workers are pinned according to `settings.thread_affinity`, with
+ * `partitioned` memory placement each worker copies its columns of x into
+ * its own memory, `interleaved` spreads one shared copy over the nodes.
+ * Requires a POSIX system, third order models and mcmc are not supported.
+ */
+void FitSquareLossDistributed(constSpMatRef x, constVectorRef y,
+                              constVectorRef cost, SolverSettings settings,
+                              ModelParam* coef, fit_callback_t cb,
+                              python_function_t python_func);
+
+}  // namespace impl
+}  // namespace cd
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_SOLVERS_CD_DISTRIBUTED_H_
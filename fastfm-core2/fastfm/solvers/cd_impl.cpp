@@ -16,10 +16,20 @@
 // limitations under the License.
 
 #include "cd_impl.h"
+#include "cd_distributed.h"
+#include "compressed_index.h"
+#include "coordinate_order.h"
+#include "numa.h"
+#include "parallel.h"
 
 #include <Eigen/Sparse>
 #include <Eigen/Core>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
 #include <string>
+#include <vector>
 
 #define LOGURU_REPLACE_GLOG 1
 #include "../../3rdparty/loguru/loguru.hpp"
@@ -34,11 +44,26 @@ namespace fastfm {
 namespace cd {
 namespace impl {
 
-void Predict(constSpMatRef x,
-             constMatrixRef w2,
-             constVectorRef w1,
-             const double w0,
-             VectorRef res) {
+// res += x * w1
+template<bool kBinary>
+void AddLinear(constSpMatRef x, constVectorRef w1, VectorRef res) {
+  if (!kBinary) {
+    res += x * w1;
+    return;
+  }
+  for (int l = 0; l < x.cols(); ++l) {
+    const double w_l = w1.coeff(l);
+    for (constSpMatRef::InnerIterator it(x, l); it; ++it)
+      res.coeffRef(it.row()) += w_l;
+  }
+}
+
+template<bool kBinary>
+void PredictKernel(constSpMatRef x,
+                   constMatrixRef w2,
+                   constVectorRef w1,
+                   const double w0,
+                   VectorRef res) {
   // Set to zero first
   res *= 0;
 //    CHECK(!std::isnan(w0));
@@ -52,7 +77,7 @@ void Predict(constSpMatRef x,
   // res += X * w.T
   if (w1.size() != 0) {
         CHECK_EQ(x.cols(), w1.size());
-    res += x * w1;
+    AddLinear<kBinary>(x, w1, res);
   }
 
   // res += sum_i sum_j x_i * x_j * <v_i, v_j>
@@ -60,7 +85,7 @@ void Predict(constSpMatRef x,
     Vector xv_sum = Vector::Zero(x.rows());
     for (int l = 0; l < x.cols(); ++l) {
       for (constSpMatRef::InnerIterator it(x, l); it; ++it) {
-        const double x_l = it.value();
+        const double x_l = XValue<kBinary>(it);
         const int row = it.row();
         const double w_k_l = w2.coeffRef(k, l);
 //                CHECK(!std::isnan(w_k_l));
@@ -76,36 +101,144 @@ void Predict(constSpMatRef x,
 }
 
 void Predict(constSpMatRef x,
-             constMatrixRef w3,
              constMatrixRef w2,
              constVectorRef w1,
              const double w0,
              VectorRef res) {
-  // Get the second order Predictions.
-  Predict(x, w2, w1, w0, res);
+  if (IsBinary(x)) {
+    PredictKernel<true>(x, w2, w1, w0, res);
+  } else {
+    PredictKernel<false>(x, w2, w1, w0, res);
+  }
+}
 
-  // Return predictions if now third order parameter are given.
+template<bool kBinary>
+void PredictKernel(constSpMatRef x,
+                   constMatrixRef w3,
+                   constMatrixRef w2,
+                   constVectorRef w1,
+                   const double w0,
+                   VectorRef res) {
+  // Return second order predictions if no third order parameter are given.
   if (w3.rows() == 0 || w3.cols() == 0) {
+    Predict(x, w2, w1, w0, res);
     return;
   }
 
       CHECK_EQ(x.cols(), w3.cols());
-  for (int k = 0; k < w3.rows(); ++k) {
-    Vector xv_sum = Vector::Zero(x.rows());
-    Vector x2v2_sum = Vector::Zero(x.rows());
+  res.setConstant(w0);
+  if (w1.size() != 0) {
+        CHECK_EQ(x.cols(), w1.size());
+    AddLinear<kBinary>(x, w1, res);
+  }
+
+  // Layer k of w2 and layer k of w3 share one pass over x.
+  // order 2: 1/2 (q^2 - s2)
+  // order 3: 1/6 q^3 - 1/2 q s2 + 1/3 s3
+  const int n_layers = std::max(w2.rows(), w3.rows());
+  Vector xv_sum(x.rows());
+  Vector xv3_sum(x.rows());
+  Vector x2v2_sum(x.rows());
+  for (int k = 0; k < n_layers; ++k) {
+    const bool second_order = k < w2.rows();
+    const bool third_order = k < w3.rows();
+    xv_sum.setZero();
+    xv3_sum.setZero();
+    x2v2_sum.setZero();
     for (int l = 0; l < x.cols(); ++l) {
+      const double w_k_l = second_order ? w2.coeff(k, l) : 0;
+      const double w3_k_l = third_order ? w3.coeff(k, l) : 0;
       for (constSpMatRef::InnerIterator it(x, l); it; ++it) {
-        const double x_l = it.value();
+        const double x_l = XValue<kBinary>(it);
         const int row = it.row();
-        const double w_k_l = w3.coeffRef(k, l);
+        const double wx = w_k_l * x_l;
+        const double w3x = w3_k_l * x_l;
 
-        xv_sum.coeffRef(row) += w_k_l * x_l;
-        x2v2_sum.coeffRef(row) += w_k_l * w_k_l * x_l * x_l;
-        res.coeffRef(row) += (1. / 3) * w_k_l * w_k_l * w_k_l * x_l * x_l * x_l;
+        xv_sum.coeffRef(row) += wx;
+        xv3_sum.coeffRef(row) += w3x;
+        x2v2_sum.coeffRef(row) += w3x * w3x;
+        res.coeffRef(row) += (1. / 3) * w3x * w3x * w3x - .5 * wx * wx;
       }
     }
-    res += (1. / 6) * xv_sum.cwiseProduct(xv_sum).cwiseProduct(xv_sum);
-    res -= .5 * xv_sum.cwiseProduct(x2v2_sum);
+    res += .5 * xv_sum.cwiseProduct(xv_sum);
+    res += (1. / 6) * xv3_sum.cwiseProduct(xv3_sum).cwiseProduct(xv3_sum);
+    res -= .5 * xv3_sum.cwiseProduct(x2v2_sum);
+  }
+}
+
+void Predict(constSpMatRef x,
+             constMatrixRef w3,
+             constMatrixRef w2,
+             constVectorRef w1,
+             const double w0,
+             VectorRef res) {
+  if (IsBinary(x)) {
+    PredictKernel<true>(x, w3, w2, w1, w0, res);
+  } else {
+    PredictKernel<false>(x, w3, w2, w1, w0, res);
+  }
+}
+
+template<bool kBinary>
+void PredictFeatureMajorKernel(constSpMatRef x,
+                               constMatrixRef w2t,
+                               constVectorRef w1,
+                               const double w0,
+                               VectorRef res) {
+  res.setConstant(w0);
+
+  // res += X * w.T
+  if (w1.size() != 0) {
+        CHECK_EQ(x.cols(), w1.size());
+    AddLinear<kBinary>(x, w1, res);
+  }
+
+  const int rank = w2t.cols();
+  if (rank == 0) return;
+      CHECK_EQ(x.cols(), w2t.rows());
+
+  // res += sum_i sum_j x_i * x_j * <v_i, v_j>, visiting each feature once.
+  const Vector w2_sqr = w2t.rowwise().squaredNorm();
+  Matrix xv_sum = Matrix::Zero(x.rows(), rank);
+  for (int l = 0; l < x.cols(); ++l) {
+    const double* w_l = w2t.data() + l * w2t.outerStride();
+    for (constSpMatRef::InnerIterator it(x, l); it; ++it) {
+      const double x_l = XValue<kBinary>(it);
+      const int row = it.row();
+      double* xv_row = xv_sum.data() + row * rank;
+      for (int k = 0; k < rank; ++k) xv_row[k] += w_l[k] * x_l;
+      res.coeffRef(row) -= .5 * w2_sqr.coeff(l) * x_l * x_l;
+    }
+  }
+  res += xv_sum.rowwise().squaredNorm() * .5;
+}
+
+void PredictFeatureMajor(constSpMatRef x,
+                         constMatrixRef w2t,
+                         constVectorRef w1,
+                         const double w0,
+                         VectorRef res) {
+  if (IsBinary(x)) {
+    PredictFeatureMajorKernel<true>(x, w2t, w1, w0, res);
+  } else {
+    PredictFeatureMajorKernel<false>(x, w2t, w1, w0, res);
+  }
+}
+
+void Predict(constSpMatRef x, const ModelParam* coef, VectorRef res) {
+  if (!coef->is_w2_feature_major()) {
+    Predict(x, coef->getw3(), coef->getw2(), coef->getw1(), coef->getw0(),
+            res);
+    return;
+  }
+
+  PredictFeatureMajor(x, coef->getw2_feature_major(), coef->getw1(),
+                      coef->getw0(), res);
+  if (coef->getw3().rows() > 0) {
+    // Third order contribution only.
+    Vector res3(res.size());
+    Predict(x, coef->getw3(), Matrix(), Vector(), 0, res3);
+    res += res3;
   }
 }
 
@@ -124,12 +257,58 @@ void FitSquareLoss(constSpMatRef x, constVectorRef y, constVectorRef cost,
 void FitSquareLoss(constSpMatRef x, constVectorRef y, constVectorRef cost,
                    SolverSettings settings, ModelParam* coef, VectorRef res,
                    fit_callback_t cb, python_function_t python_func) {
+  if (settings.n_processes > 1) {
+    CHECK_EQ(settings.row_fraction, 1)
+    << "n_processes does not support row_fraction";
+    FitSquareLossDistributed(x, y, cost, settings, coef, cb, python_func);
+    return;
+  }
+
   const int n_samples = x.rows();
   const int n_features = x.cols();
   const bool second_order = settings.rank_w2 > 0;
   const bool third_order = settings.rank_w3 > 0;
   const bool irls = settings.loss == "logistic";
   const bool is_mcmc = settings.solver == "mcmc";
+  const bool w2_feature_major =
+      second_order && settings.w2_layout == "feature_major";
+  CHECK(settings.w2_layout == "rank_major"
+            || settings.w2_layout == "feature_major")
+  << "w2 layout: " << settings.w2_layout << " is not supported";
+  const bool layer_parallel =
+      second_order && !w2_feature_major && settings.n_threads > 1;
+  CHECK(!(layer_parallel && is_mcmc))
+  << "mcmc does not support parallel layer updates";
+  const std::vector<int> cpus = layer_parallel
+      ? numa::WorkerCpus(settings.thread_affinity, settings.n_threads)
+      : std::vector<int>();
+
+  // Stochastic epochs fit a random window of window_rows consecutive rows
+  // of x, whose rows have to be in random order (`fit` shuffles the Data).
+  // The dense work of an epoch is sized to the window as well, only the
+  // logistic working response of all rows is recomputed every
+  // refresh_epochs epochs.
+  CHECK(settings.row_fraction > 0 && settings.row_fraction <= 1)
+  << "row_fraction: " << settings.row_fraction << " is not supported";
+  const bool stochastic = settings.row_fraction < 1;
+  CHECK(!(stochastic && is_mcmc)) << "mcmc does not support row_fraction";
+  CHECK(!(stochastic && settings.index_compression != "none"))
+  << "index_compression does not support row_fraction";
+  CHECK_GE(settings.residual_refresh, 0);
+  const int window_rows = stochastic
+      ? std::max(1, static_cast<int>(std::round(settings.row_fraction
+                                                    * n_samples)))
+      : n_samples;
+  const int refresh_epochs = settings.residual_refresh > 0
+      ? settings.residual_refresh
+      : std::max(1, static_cast<int>(std::round(1 / settings.row_fraction)));
+  std::mt19937 window_rng(settings.rng_seed);
+  std::uniform_int_distribution<int> window_begin(0, n_samples - window_rows);
+  std::unique_ptr<RowWindow> window;
+  if (stochastic) window.reset(new RowWindow(x));
+  // The statistics of a window are scaled to the full data by scaling the
+  // penalties with the sampled fraction of the rows.
+  const double window_scale = static_cast<double>(window_rows) / n_samples;
 
   #if !EXTERNAL_RELEASE
   mcmc::GibbsSampler sampler(123);
@@ -137,55 +316,119 @@ void FitSquareLoss(constSpMatRef x, constVectorRef y, constVectorRef cost,
 
   double step_size = 1;
 
-  Vector weight;
+  // IRLS weights of the logistic loss.
+  Vector irls_weight;
+  // Working residual of the last logistic linearization.
+  Vector err_lin;
   if (irls) {
+    irls_weight = Vector::Zero(y.size());
     #if !EXTERNAL_RELEASE
-    weight = Vector::Zero(y.size());
     step_size = settings.step_size;
     #endif
-  } else if (cost.size() > 0) {
-    // TODO(Immanuel): avoid copy
-    weight = cost;
   }
+  // Sample weights of all rows, the caller's cost is used without copying.
+  const constVectorRef weight = irls ? constVectorRef(irls_weight) : cost;
+  // Sample weights of the window of stochastic epochs.
+  Vector weight_window;
 
-  Vector err(y.size());
+  if (w2_feature_major) {
+    coef->to_w2_feature_major();
+  }
+
+  // Blocks: w1, layers of w2, layers of w3.
+  // The feature major w2 update uses the first w2 block for all layers.
+  CoordinateOrder coords(settings,
+                         1 + settings.rank_w2 + settings.rank_w3,
+                         n_features);
+
+  // Penalties are looked up per column, grouped or not.
+  const Vector l2_reg_w1 = window_scale
+      * ColumnL2Reg(settings.l2_reg_w1, settings.group_l2_reg_w1,
+                    settings.feature_group, n_features);
+  const Vector l2_reg_w2 = window_scale
+      * ColumnL2Reg(settings.l2_reg_w2, settings.group_l2_reg_w2,
+                    settings.feature_group, n_features);
+  const double l2_reg_w3 = window_scale * settings.l2_reg_w3;
+
+  // The column updates read the row indices from the compressed copy if
+  // enabled, the passes over all of x (predictions, q caches) read x.
+  std::unique_ptr<CompressedColumns> compressed;
+  if (settings.index_compression != "none") {
+    compressed.reset(new CompressedColumns(settings.index_compression, x));
+  }
+
+  const std::vector<int> no_coords;
+  // Per non-zero gradients of the column in the third order update.
+  std::vector<double> h_buffer;
+  // Residual of the rows read by an epoch.
+  Vector err(window_rows);
+  // First touch by the pinned workers, unless placement is disabled.
+  numa::PlacedZero(settings.memory_placement, cpus, err.data(),
+                   err.size() * sizeof(double));
+  // Targets of the window residuals of stochastic epochs, the logistic
+  // working response of all rows at the last linearization.
+  Vector target;
   int i = 0;
   for (; i < settings.iter; ++i) {
-    // init err with predictions
-    if (third_order) {
-      Predict(x,
-              coef->getw3(), coef->getw2(), coef->getw1(), coef->getw0(),
-              err);
-    } else {
-      Predict(x,
-              coef->getw2(), coef->getw1(), coef->getw0(),
-              err);
-    }
-
-    // save prediction
-    #if !EXTERNAL_RELEASE
-    if (is_mcmc) {
-      // train
-      utils::streaming_mean(i, err, res);
+    // The epoch reads x_epoch, all of x or the rows [begin, begin + n) of
+    // x with row i of x_epoch being row begin + i of x.
+    const int begin = stochastic ? window_begin(window_rng) : 0;
+    const int n = window_rows;
+    constSpMatRef x_epoch = stochastic
+        ? constSpMatRef(window->view(begin, begin + n)) : x;
+    auto column = [&](int j) -> constSpMatRef {
+      return compressed ? constSpMatRef(compressed->column(j)) : x_epoch;
+    };
 
-      // test
-      if (cb != nullptr && python_func != nullptr) {
-        cb(R"({"stage": "update_prediction"})", python_func);
+    if (stochastic) {
+      // The logistic loss is relinearized on all rows every refresh_epochs
+      // epochs, the residual of the window is exact for the current model.
+      if (irls && i % refresh_epochs == 0) {
+        target.resize(n_samples);
+        Predict(x, coef, target);
+        Vector eta = target;
+        LogisticWorkingResponse(y, cost, &target, &irls_weight);
+        target += eta;
       }
+      Predict(x_epoch, coef, err);
+      err = (irls ? constVectorRef(target) : y).segment(begin, n) - err;
+      if (weight.size() > 0) weight_window = weight.segment(begin, n);
     }
-    #endif
+    const constVectorRef weight_epoch =
+        stochastic ? constVectorRef(weight_window) : weight;
 
-    // err = y - y_pred
-    if (irls) {
+    // The working response of the logistic loss stays valid while the
+    // predictions move less than irls_tol from the linearization point,
+    // err then continues to track the same weighted least squares problem.
+    const bool relinearize = !stochastic && (!irls || i == 0
+        || settings.irls_tol <= 0
+        || (err - err_lin).lpNorm<Eigen::Infinity>() > settings.irls_tol);
+
+    if (relinearize) {
+      // init err with predictions
+      Predict(x, coef, err);
+
+      // save prediction
       #if !EXTERNAL_RELEASE
-      // calculate error and cost based on working response
-      logistic_error_weight(y, &err, &weight);
-      if (cost.rows() > 0) {
-        weight = weight * cost;
+      if (is_mcmc) {
+        // train
+        utils::streaming_mean(i, err, res);
+
+        // test
+        if (cb != nullptr && python_func != nullptr) {
+          cb(R"({"stage": "update_prediction"})", python_func);
+        }
       }
       #endif
-    } else {
-      err = y + -1 * err;
+
+      // err = y - y_pred
+      if (irls) {
+        // calculate error and cost based on working response
+        LogisticWorkingResponse(y, cost, &err, &irls_weight);
+        if (settings.irls_tol > 0) err_lin = err;
+      } else {
+        err = y + -1 * err;
+      }
     }
 
     #if !EXTERNAL_RELEASE
@@ -205,15 +448,21 @@ void FitSquareLoss(constSpMatRef x, constVectorRef y, constVectorRef cost,
     }
     #endif
 
+    coords.next_epoch();
+
     // Update Zero Order (Bias) Parameter
     if (settings.zero_order) {
       const double w_old = coef->getw0();
-      const double n = static_cast<double>(n_samples);
 
       if (is_mcmc) {
         #if !EXTERNAL_RELEASE
         coef->setw0(sampler.draw_w0(w_old, n, err.sum()));
         #endif
+      } else if (weight_epoch.size() > 0) {
+        // Weighted least squares, e.g. on the working response.
+        const double weight_sum = weight_epoch.sum();
+        coef->setw0((weight_epoch.dot(err) + w_old * weight_sum)
+                        / weight_sum);
       } else {
         coef->setw0((err.sum() + w_old * n) / n);
       }
@@ -224,33 +473,82 @@ void FitSquareLoss(constSpMatRef x, constVectorRef y, constVectorRef cost,
     }
 
     // Update First (Linear) Order Parameter
-    for (int j = 0; settings.first_order && j < n_features; ++j) {
+    for (int j : settings.first_order ? coords.order(0) : no_coords) {
+      constSpMatRef x_j = column(j);
       double chsqr = 0;
       double che = 0;
       const double w_old = coef->getw1().coeff(j);
       // TODO(Immanuel) don't recalculate che it's constant
-      FirstOrderStats(j, weight, x, err, &chsqr, &che);
+      FirstOrderStats(j, weight_epoch, x_j, err, &chsqr, &che);
       double w_new = 0;
       if (is_mcmc) {
         #if !EXTERNAL_RELEASE
         w_new = sampler.draw_w1(w_old, chsqr, che);
         #endif
       } else {
-        w_new = (che + w_old * chsqr) / (chsqr + settings.l2_reg_w1);
+        w_new = (che + w_old * chsqr) / (chsqr + l2_reg_w1.coeff(j));
       }
       coef->getw1().coeffRef(j) = w_old + step_size * (w_new - w_old);
-      FirstOrderErrUpdate(j, coef->getw1().coeff(j), w_old, x, &err);
+      coords.report(0, j, coef->getw1().coeff(j) - w_old);
+      FirstOrderErrUpdate(j, coef->getw1().coeff(j), w_old, x_j, &err);
+    }
+
+    // Update Second Order Parameter, all layers of a feature at once.
+    if (w2_feature_major) {
+      MatrixRef w2t = coef->getw2_feature_major();
+      Matrix q_cache = QcacheFeatureMajor(x_epoch, w2t);
+      for (int j : coords.order(1)) {
+        double delta = 0;
+        for (int f = 0; f < w2t.cols(); ++f) {
+          double chsqr = 0;
+          double che = 0;
+          const double w_old = w2t.coeff(j, f);
+          SecondOrderStatsFeatureMajor(f, j, weight_epoch,
+                                       x_epoch, w2t, err,
+                                       q_cache, &chsqr, &che);
+          double w_new = 0;
+          if (is_mcmc) {
+            #if !EXTERNAL_RELEASE
+            w_new = sampler.draw_w2(f, w_old, chsqr, che);
+            #endif
+          } else {
+            w_new = (che + w_old * chsqr) / (chsqr + l2_reg_w2.coeff(j));
+          }
+          w2t.coeffRef(j, f) = w_old + step_size * (w_new - w_old);
+          delta = std::max(delta, std::abs(w2t.coeff(j, f) - w_old));
+          SecondOrderErrAndQcacheUpdateFeatureMajor(f, j, w2t, w_old,
+                                                    x_epoch, &err, &q_cache);
+        }
+        coords.report(1, j, delta);
+      }
     }
 
-    // Update Second Order Parameter
-    for (int f = 0; second_order && f < coef->getw2().rows(); ++f) {
-      Vector q_cache = Qcache(f, x, coef->getw2());
-      for (int j = 0; j < n_features; ++j) {
+    // Update Second Order Parameter, n_threads layers at a time.
+    for (int f = 0; second_order && layer_parallel
+        && f < coef->getw2().rows(); f += settings.n_threads) {
+      const int n_layers =
+          std::min(settings.n_threads,
+                   static_cast<int>(coef->getw2().rows()) - f);
+      // Layers fitted against the same residual overshoot without damping.
+      const double damping = settings.layer_damping > 0
+                             ? settings.layer_damping : 1. / n_layers;
+      SecondOrderLayersParallel(f, n_layers, weight_epoch, x_epoch,
+                                l2_reg_w2,
+                                step_size * damping,
+                                coef->getw2(), &err, &coords, cpus);
+    }
+
+    // Update Second Order Parameter, one layer at a time.
+    for (int f = 0; second_order && !w2_feature_major && !layer_parallel
+        && f < coef->getw2().rows(); ++f) {
+      Vector q_cache = Qcache(f, x_epoch, coef->getw2());
+      for (int j : coords.order(1 + f)) {
+        constSpMatRef x_j = column(j);
         double chsqr = 0;
         double che = 0;
         const double w_old = coef->getw2().coeff(f, j);
-        SecondOrderStats(f, j, weight,
-                         x, coef->getw2(), err,
+        SecondOrderStats(f, j, weight_epoch,
+                         x_j, coef->getw2(), err,
                          q_cache, &chsqr, &che);
         double w_new = 0;
         if (is_mcmc) {
@@ -258,37 +556,36 @@ void FitSquareLoss(constSpMatRef x, constVectorRef y, constVectorRef cost,
           w_new = sampler.draw_w2(f, w_old, chsqr, che);
           #endif
         } else {
-          w_new = (che + w_old * chsqr) / (chsqr + settings.l2_reg_w2);
+          w_new = (che + w_old * chsqr) / (chsqr + l2_reg_w2.coeff(j));
         }
         coef->getw2().coeffRef(f, j) = w_old + step_size * (w_new - w_old);
+        coords.report(1 + f, j, coef->getw2().coeff(f, j) - w_old);
         SecondOrderErrAndQcacheUpdate(f, j, coef->getw2(), w_old,
-                                      x, &err, &q_cache);
+                                      x_j, &err, &q_cache);
       }
     }
 
-    #if !EXTERNAL_RELEASE
-    // Update Third Order Parameter
+    // Update Third Order Parameter, both caches of a layer in one pass.
+    CHECK(!(third_order && is_mcmc)) << "3'rd order not supported by mcmc";
     for (int f = 0; third_order && f < coef->getw3().rows(); ++f) {
-      Vector q_cache = Qcache(f, x, coef->getw3());
-      Vector q2_cache = Q2Cache(f, x, coef->getw3());
-      for (int j = 0; j < n_features; ++j) {
-        if (is_mcmc) CHECK(false) << "3'rd order not supported by mcmc";
-        double chsqr = 0;
-        double che = 0;
-        const double w_old = coef->getw3().coeff(f, j);
-        ThirdOrderStats(f, j, weight,
-                        x, coef->getw3(), err,
-                        q_cache, q2_cache, &chsqr, &che);
-        const double
-            w_new = (che + w_old * chsqr) / (chsqr + settings.l2_reg_w3);
-        coef->getw3().coeffRef(f, j) = w_old + step_size * (w_new - w_old);
-        ThirdOrderErrAndQcacheUpdate(f, j, coef->getw3(), w_old,
-                                     x, &err, &q_cache, &q2_cache);
+      const int block = 1 + settings.rank_w2 + f;
+      Vector q_cache;
+      Vector q2_cache;
+      ThirdOrderQcache(f, x_epoch, coef->getw3(), &q_cache, &q2_cache);
+      for (int j : coords.order(block)) {
+        const double delta = ThirdOrderUpdate(f, j, weight_epoch, column(j),
+                                              l2_reg_w3, step_size,
+                                              coef->getw3(), &err,
+                                              &q_cache, &q2_cache, &h_buffer);
+        coords.report(block, j, delta);
       }
     }
-    #endif
 
     if (cb != nullptr && python_func != nullptr) {
+      // The callback might inspect the model parameter.
+      if (w2_feature_major) {
+        coef->sync_w2_feature_major();
+      }
       bool early_stop = false;
       if (is_mcmc) {
         #if !EXTERNAL_RELEASE
@@ -314,42 +611,183 @@ void FitSquareLoss(constSpMatRef x, constVectorRef y, constVectorRef cost,
       cb(R"({"stage": "update_prediction"})", python_func);
     }
 
-    if (third_order) {
-      Predict(x,
-              coef->getw3(), coef->getw2(), coef->getw1(), coef->getw0(),
-              err);
-    } else {
-      Predict(x,
-              coef->getw2(), coef->getw1(), coef->getw0(),
-              err);
-    }
+    Predict(x, coef, err);
     utils::streaming_mean(i, err, res);
   }
   #endif
+
+  if (w2_feature_major) {
+    coef->from_w2_feature_major();
+  }
 }
 
-void FirstOrderStats(const int col, constVectorRef cost, constSpMatRef x,
-                     constVectorRef err, double* chsqr, double* che) {
-  const bool no_cost = cost.size() == 0;
+void LogisticWorkingResponse(constVectorRef y, constVectorRef cost,
+                             Vector* err, Vector* weight) {
+  // Weights are floored, the residual of a saturated sample would
+  // overflow otherwise. The products weight * err stay exact.
+  const double min_weight = 1e-8;
+  // Blocks small enough to stay in L1 between the passes, each pass is a
+  // vectorized Eigen array expression.
+  const int block = 512;
+  const int n = y.size();
+  weight->resize(n);
+  for (int begin = 0; begin < n; begin += block) {
+    const int len = std::min(block, n - begin);
+    auto eta = err->segment(begin, len).array();
+    auto w = weight->segment(begin, len).array();
+    // w = p = sigmoid(eta), probability of the positive class.
+    w = (1 + (-eta).exp()).inverse();
+    eta = ((y.segment(begin, len).array() > 0).cast<double>() - w)
+        / (w * (1 - w)).max(min_weight);
+    w = (w * (1 - w)).max(min_weight);
+    if (cost.size() > 0) w *= cost.segment(begin, len).array();
+  }
+}
+
+void SecondOrderLayersParallel(const int first_layer,
+                               const int n_layers,
+                               constVectorRef cost,
+                               constSpMatRef x,
+                               constVectorRef l2_reg,
+                               const double step_size,
+                               MatrixRef w2,
+                               Vector* err,
+                               CoordinateOrder* coords,
+                               const std::vector<int>& cpus) {
+  // The coordinate orders are not thread safe, fix them up front.
+  std::vector<const std::vector<int>*> orders(n_layers);
+  for (int t = 0; t < n_layers; ++t)
+    orders[t] = &coords->order(1 + first_layer + t);
+
+  // Each layer starts from the snapshot and tracks its own residual.
+  const Vector err_snapshot = *err;
+  std::vector<Vector> err_local(n_layers);
+
+  parallel::ParallelFor(cpus, n_layers, n_layers, [&](int t) {
+    const int f = first_layer + t;
+    Vector& err_f = err_local[t];
+    err_f = err_snapshot;
+    Vector q_cache = Qcache(f, x, w2);
+    for (int j : *orders[t]) {
+      double chsqr = 0;
+      double che = 0;
+      const double w_old = w2.coeff(f, j);
+      SecondOrderStats(f, j, cost, x, w2, err_f, q_cache, &chsqr, &che);
+      const double w_new =
+          (che + w_old * chsqr) / (chsqr + l2_reg.coeff(j));
+      w2.coeffRef(f, j) = w_old + step_size * (w_new - w_old);
+      coords->report(1 + f, j, w2.coeff(f, j) - w_old);
+      SecondOrderErrAndQcacheUpdate(f, j, w2, w_old, x, &err_f, &q_cache);
+    }
+  });
+
+  // The layers contribute additively to the prediction,
+  // summing the residual changes is therefore exact.
+  for (int t = 0; t < n_layers; ++t) *err += err_local[t] - err_snapshot;
+}
+
+// The stats kernels are instantiated for weighted and unweighted samples
+// (and binary or valued x), the unweighted kernels never read the cost.
+template<bool kWeighted>
+inline double CostAt(constVectorRef cost, const int row) {
+  return kWeighted ? cost.coeff(row) : 1;
+}
+
+Vector ColumnL2Reg(const double l2_reg,
+                   const std::vector<double>& group_l2_reg,
+                   const std::vector<int>& feature_group,
+                   const int n_features) {
+  Vector res = Vector::Constant(n_features, l2_reg);
+  if (group_l2_reg.empty() || feature_group.empty()) return res;
+      CHECK_EQ(feature_group.size(), n_features);
+  const int n_groups = group_l2_reg.size();
+  for (int j = 0; j < n_features; ++j) {
+    const int group = feature_group[j];
+    if (group < 0) continue;
+    CHECK_LT(group, n_groups) << "no penalty for group " << group;
+    res(j) = group_l2_reg[group];
+  }
+  return res;
+}
+
+RowWindow::RowWindow(constSpMatRef x)
+    : x_(x),
+      binary_(IsBinary(x)),
+      view_outer_(x.cols() + 1) {
+  // The windows are located by binary search over the rows.
+  for (int col = 0; col < x.cols(); ++col) {
+    int prev = -1;
+    for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
+      CHECK_LT(prev, it.row())
+      << "row windows require sorted, unique row indices in column " << col;
+      prev = it.row();
+    }
+  }
+}
+
+Eigen::Map<SpMat> RowWindow::view(int begin, int end) {
+  const sparse_index_t* inner = x_.innerIndexPtr();
+  const sparse_index_t* outer = x_.outerIndexPtr();
+  const sparse_index_t* col_nnz = x_.innerNonZeroPtr();
+  view_inner_.clear();
+  view_values_.clear();
+  for (int col = 0; col < x_.cols(); ++col) {
+    const sparse_index_t* col_end = inner + (col_nnz == nullptr
+        ? outer[col + 1] : outer[col] + col_nnz[col]);
+    const sparse_index_t* first =
+        std::lower_bound(inner + outer[col], col_end, begin);
+    const sparse_index_t* last = std::lower_bound(first, col_end, end);
+    view_outer_[col] = view_inner_.size();
+    for (const sparse_index_t* k = first; k != last; ++k) {
+      view_inner_.push_back(*k - begin);
+      if (!binary_) view_values_.push_back(x_.valuePtr()[k - inner]);
+    }
+  }
+  view_outer_[x_.cols()] = view_inner_.size();
+  return Eigen::Map<SpMat>(end - begin, x_.cols(), view_inner_.size(),
+                           view_outer_.data(), view_inner_.data(),
+                           binary_ ? nullptr : view_values_.data());
+}
+
+template<bool kBinary, bool kWeighted>
+void FirstOrderStatsKernel(const int col, constVectorRef cost, constSpMatRef x,
+                           constVectorRef err, double* chsqr, double* che) {
   *chsqr = *che = 0;
   for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
     const int row = it.row();
-    const double x_col_i = it.value();
-    const double cost_i = no_cost ? 1 : cost.coeffRef(row);
+    const double x_col_i = XValue<kBinary>(it);
+    const double cost_i = CostAt<kWeighted>(cost, row);
     *chsqr += cost_i * x_col_i * x_col_i;
     *che += cost_i * x_col_i * err.coeffRef(row);
   }
 }
 
-void SecondOrderStats(const int layer, const int col, constVectorRef cost,
-                      constSpMatRef x, constMatrixRef w2, constVectorRef err,
-                      constVectorRef q_cache, double* chsqr, double* che) {
-  const bool no_cost = cost.size() == 0;
+void FirstOrderStats(const int col, constVectorRef cost, constSpMatRef x,
+                     constVectorRef err, double* chsqr, double* che) {
+  if (IsBinary(x)) {
+    if (cost.size() == 0) {
+      FirstOrderStatsKernel<true, false>(col, cost, x, err, chsqr, che);
+    } else {
+      FirstOrderStatsKernel<true, true>(col, cost, x, err, chsqr, che);
+    }
+  } else if (cost.size() == 0) {
+    FirstOrderStatsKernel<false, false>(col, cost, x, err, chsqr, che);
+  } else {
+    FirstOrderStatsKernel<false, true>(col, cost, x, err, chsqr, che);
+  }
+}
+
+template<bool kBinary, bool kWeighted>
+void SecondOrderStatsKernel(const int layer, const int col,
+                            constVectorRef cost, constSpMatRef x,
+                            constMatrixRef w2, constVectorRef err,
+                            constVectorRef q_cache,
+                            double* chsqr, double* che) {
   *chsqr = *che = 0;
   for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
     const int row = it.row();
-    const double x_col_i = it.value();
-    const double cost_i = no_cost ? 1 : cost.coeffRef(row);
+    const double x_col_i = XValue<kBinary>(it);
+    const double cost_i = CostAt<kWeighted>(cost, row);
     const double q_i = q_cache.coeffRef(row);
     const double h_i = x_col_i * (q_i - w2.coeffRef(layer, col) * x_col_i);
 
@@ -358,10 +796,31 @@ void SecondOrderStats(const int layer, const int col, constVectorRef cost,
   }
 }
 
-Vector Qcache(const int f,
-              constSpMatRef x,
-              constVectorRef cost,
-              constMatrixRef w) {
+void SecondOrderStats(const int layer, const int col, constVectorRef cost,
+                      constSpMatRef x, constMatrixRef w2, constVectorRef err,
+                      constVectorRef q_cache, double* chsqr, double* che) {
+  if (IsBinary(x)) {
+    if (cost.size() == 0) {
+      SecondOrderStatsKernel<true, false>(layer, col, cost, x, w2, err, q_cache,
+                                          chsqr, che);
+    } else {
+      SecondOrderStatsKernel<true, true>(layer, col, cost, x, w2, err, q_cache,
+                                         chsqr, che);
+    }
+  } else if (cost.size() == 0) {
+    SecondOrderStatsKernel<false, false>(layer, col, cost, x, w2, err, q_cache,
+                                         chsqr, che);
+  } else {
+    SecondOrderStatsKernel<false, true>(layer, col, cost, x, w2, err, q_cache,
+                                        chsqr, che);
+  }
+}
+
+template<bool kBinary>
+Vector QcacheKernel(const int f,
+                    constSpMatRef x,
+                    constVectorRef cost,
+                    constMatrixRef w) {
   const bool no_cost = cost.size() == 0;
 
   if (!no_cost) {
@@ -371,7 +830,7 @@ Vector Qcache(const int f,
   Vector q_cache = Vector::Zero(x.rows());
   for (int k = 0; k < x.cols(); ++k) {
     for (constSpMatRef::InnerIterator it(x, k); it; ++it) {
-      const double x_kl = it.value();
+      const double x_kl = XValue<kBinary>(it);
       const int row = it.row();   // row index
       const double cost_ = no_cost ? 1.0 : cost.coeffRef(row);
       q_cache.coeffRef(row) += x_kl * w.coeffRef(f, k) * cost_;
@@ -380,11 +839,22 @@ Vector Qcache(const int f,
   return q_cache;
 }
 
-Vector Qcache(const int f, constSpMatRef x, constMatrixRef w) {
+Vector Qcache(const int f,
+              constSpMatRef x,
+              constVectorRef cost,
+              constMatrixRef w) {
+  if (IsBinary(x)) {
+    return QcacheKernel<true>(f, x, cost, w);
+  }
+  return QcacheKernel<false>(f, x, cost, w);
+}
+
+template<bool kBinary>
+Vector QcacheKernel(const int f, constSpMatRef x, constMatrixRef w) {
   Vector q_cache = Vector::Zero(x.rows());
   for (int k = 0; k < x.cols(); ++k) {
     for (constSpMatRef::InnerIterator it(x, k); it; ++it) {
-      const double x_kl = it.value();
+      const double x_kl = XValue<kBinary>(it);
       const int row = it.row();   // row index
       q_cache.coeffRef(row) += x_kl * w.coeffRef(f, k);
     }
@@ -392,23 +862,367 @@ Vector Qcache(const int f, constSpMatRef x, constMatrixRef w) {
   return q_cache;
 }
 
+Vector Qcache(const int f, constSpMatRef x, constMatrixRef w) {
+  if (IsBinary(x)) {
+    return QcacheKernel<true>(f, x, w);
+  }
+  return QcacheKernel<false>(f, x, w);
+}
+
+template<bool kBinary>
+Matrix QcacheFeatureMajorKernel(constSpMatRef x, constMatrixRef wt) {
+  const int rank = wt.cols();
+  Matrix q_cache = Matrix::Zero(x.rows(), rank);
+  for (int k = 0; k < x.cols(); ++k) {
+    const double* w_k = wt.data() + k * wt.outerStride();
+    for (constSpMatRef::InnerIterator it(x, k); it; ++it) {
+      const double x_kl = XValue<kBinary>(it);
+      double* q_row = q_cache.data() + it.row() * rank;
+      for (int f = 0; f < rank; ++f) q_row[f] += x_kl * w_k[f];
+    }
+  }
+  return q_cache;
+}
+
+Matrix QcacheFeatureMajor(constSpMatRef x, constMatrixRef wt) {
+  if (IsBinary(x)) {
+    return QcacheFeatureMajorKernel<true>(x, wt);
+  }
+  return QcacheFeatureMajorKernel<false>(x, wt);
+}
+
+template<bool kBinary, bool kWeighted>
+void SecondOrderStatsFeatureMajorKernel(const int layer, const int col,
+                                        constVectorRef cost, constSpMatRef x,
+                                        constMatrixRef w2t, constVectorRef err,
+                                        constMatrixRef q_cache,
+                                        double* chsqr, double* che) {
+  const double w_col = w2t.coeff(col, layer);
+  *chsqr = *che = 0;
+  for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
+    const int row = it.row();
+    const double x_col_i = XValue<kBinary>(it);
+    const double cost_i = CostAt<kWeighted>(cost, row);
+    const double q_i = q_cache.coeff(row, layer);
+    const double h_i = x_col_i * (q_i - w_col * x_col_i);
+
+    *chsqr += cost_i * h_i * h_i;
+    *che += cost_i * h_i * err.coeffRef(row);
+  }
+}
+
+void SecondOrderStatsFeatureMajor(const int layer, const int col,
+                                  constVectorRef cost, constSpMatRef x,
+                                  constMatrixRef w2t, constVectorRef err,
+                                  constMatrixRef q_cache,
+                                  double* chsqr, double* che) {
+  if (IsBinary(x)) {
+    if (cost.size() == 0) {
+      SecondOrderStatsFeatureMajorKernel<true, false>(layer, col, cost, x, w2t,
+                                                      err, q_cache, chsqr, che);
+    } else {
+      SecondOrderStatsFeatureMajorKernel<true, true>(layer, col, cost, x, w2t,
+                                                     err, q_cache, chsqr, che);
+    }
+  } else if (cost.size() == 0) {
+    SecondOrderStatsFeatureMajorKernel<false, false>(layer, col, cost, x, w2t,
+                                                     err, q_cache, chsqr, che);
+  } else {
+    SecondOrderStatsFeatureMajorKernel<false, true>(layer, col, cost, x, w2t,
+                                                    err, q_cache, chsqr, che);
+  }
+}
+
+template<bool kBinary>
+void SecondOrderErrAndQcacheUpdateFeatureMajorKernel(const int layer,
+                                                     const int col,
+                                                     constMatrixRef w2t,
+                                                     const double w_old,
+                                                     constSpMatRef x,
+                                                     Vector* err,
+                                                     Matrix* q_cache) {
+  double const w_new = w2t.coeff(col, layer);
+  for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
+    const int row = it.row();
+    const double x_col_i = XValue<kBinary>(it);
+
+    const double q_i = q_cache->coeff(row, layer);
+    const double h_i = x_col_i * (q_i - w_old * x_col_i);
+
+    q_cache->coeffRef(row, layer) += (w_new - w_old) * x_col_i;
+    err->coeffRef(row) += (w_old - w_new) * h_i;
+  }
+}
+
+void SecondOrderErrAndQcacheUpdateFeatureMajor(const int layer,
+                                               const int col,
+                                               constMatrixRef w2t,
+                                               const double w_old,
+                                               constSpMatRef x,
+                                               Vector* err,
+                                               Matrix* q_cache) {
+  if (IsBinary(x)) {
+    SecondOrderErrAndQcacheUpdateFeatureMajorKernel<true>(layer, col, w2t,
+                                                          w_old, x, err,
+                                                          q_cache);
+  } else {
+    SecondOrderErrAndQcacheUpdateFeatureMajorKernel<false>(layer, col, w2t,
+                                                           w_old, x, err,
+                                                           q_cache);
+  }
+}
+
+template<bool kBinary>
+void ThirdOrderQcacheKernel(const int f, constSpMatRef x, constMatrixRef w,
+                            Vector* q_cache, Vector* q2_cache) {
+  q_cache->setZero(x.rows());
+  q2_cache->setZero(x.rows());
+  for (int k = 0; k < x.cols(); ++k) {
+    const double w_f_k = w.coeff(f, k);
+    for (constSpMatRef::InnerIterator it(x, k); it; ++it) {
+      const double wx = w_f_k * XValue<kBinary>(it);
+      q_cache->coeffRef(it.row()) += wx;
+      q2_cache->coeffRef(it.row()) += wx * wx;
+    }
+  }
+}
+
+void ThirdOrderQcache(const int f, constSpMatRef x, constMatrixRef w,
+                      Vector* q_cache, Vector* q2_cache) {
+  if (IsBinary(x)) {
+    ThirdOrderQcacheKernel<true>(f, x, w, q_cache, q2_cache);
+  } else {
+    ThirdOrderQcacheKernel<false>(f, x, w, q_cache, q2_cache);
+  }
+}
+
+// The third order term is linear in each single parameter, its partial
+// derivative with q' = q - w x and q2' = q2 - (w x)^2 of the other
+// features is h = x * 1/2 (q'^2 - q2').
+template<bool kBinary, bool kWeighted>
+void ThirdOrderStatsKernel(const int layer, const int col,
+                           constVectorRef cost, constSpMatRef x,
+                           constMatrixRef w3, constVectorRef err,
+                           constVectorRef q_cache, constVectorRef q2_cache,
+                           double* chsqr, double* che) {
+  const double w = w3.coeff(layer, col);
+  *chsqr = *che = 0;
+  for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
+    const int row = it.row();
+    const double x_col_i = XValue<kBinary>(it);
+    const double cost_i = CostAt<kWeighted>(cost, row);
+    const double q_i = q_cache.coeff(row) - w * x_col_i;
+    const double q2_i = q2_cache.coeff(row) - w * w * x_col_i * x_col_i;
+    const double h_i = x_col_i * .5 * (q_i * q_i - q2_i);
+
+    *chsqr += cost_i * h_i * h_i;
+    *che += cost_i * h_i * err.coeff(row);
+  }
+}
+
+void ThirdOrderStats(const int layer, const int col, constVectorRef cost,
+                     constSpMatRef x, constMatrixRef w3, constVectorRef err,
+                     constVectorRef q_cache, constVectorRef q2_cache,
+                     double* chsqr, double* che) {
+  if (IsBinary(x)) {
+    if (cost.size() == 0) {
+      ThirdOrderStatsKernel<true, false>(layer, col, cost, x, w3, err, q_cache,
+                                         q2_cache, chsqr, che);
+    } else {
+      ThirdOrderStatsKernel<true, true>(layer, col, cost, x, w3, err, q_cache,
+                                        q2_cache, chsqr, che);
+    }
+  } else if (cost.size() == 0) {
+    ThirdOrderStatsKernel<false, false>(layer, col, cost, x, w3, err, q_cache,
+                                        q2_cache, chsqr, che);
+  } else {
+    ThirdOrderStatsKernel<false, true>(layer, col, cost, x, w3, err, q_cache,
+                                       q2_cache, chsqr, che);
+  }
+}
+
+template<bool kBinary>
+void ThirdOrderErrAndQcacheUpdateKernel(const int layer,
+                                        const int col,
+                                        constMatrixRef w3,
+                                        const double w_old,
+                                        constSpMatRef x,
+                                        Vector* err,
+                                        Vector* q_cache,
+                                        Vector* q2_cache) {
+  const double w_new = w3.coeff(layer, col);
+  for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
+    const int row = it.row();
+    const double x_col_i = XValue<kBinary>(it);
+    const double q_i = q_cache->coeff(row) - w_old * x_col_i;
+    const double q2_i =
+        q2_cache->coeff(row) - w_old * w_old * x_col_i * x_col_i;
+    const double h_i = x_col_i * .5 * (q_i * q_i - q2_i);
+
+    err->coeffRef(row) += (w_old - w_new) * h_i;
+    q_cache->coeffRef(row) += (w_new - w_old) * x_col_i;
+    q2_cache->coeffRef(row) +=
+        (w_new * w_new - w_old * w_old) * x_col_i * x_col_i;
+  }
+}
+
+void ThirdOrderErrAndQcacheUpdate(const int layer,
+                                  const int col,
+                                  constMatrixRef w3,
+                                  const double w_old,
+                                  constSpMatRef x,
+                                  Vector* err,
+                                  Vector* q_cache,
+                                  Vector* q2_cache) {
+  if (IsBinary(x)) {
+    ThirdOrderErrAndQcacheUpdateKernel<true>(layer, col, w3, w_old, x, err,
+                                             q_cache, q2_cache);
+  } else {
+    ThirdOrderErrAndQcacheUpdateKernel<false>(layer, col, w3, w_old, x, err,
+                                              q_cache, q2_cache);
+  }
+}
+
+template<bool kBinary, bool kWeighted>
+double ThirdOrderUpdateKernel(const int layer,
+                              const int col,
+                              constVectorRef cost,
+                              constSpMatRef x,
+                              const double l2_reg,
+                              const double step_size,
+                              MatrixRef w3,
+                              Vector* err,
+                              Vector* q_cache,
+                              Vector* q2_cache,
+                              std::vector<double>* h) {
+  const double w_old = w3.coeff(layer, col);
+
+  // Gather pass: stats and the gradient of every non-zero.
+  h->resize(x.innerVector(col).nonZeros());
+  double chsqr = 0;
+  double che = 0;
+  int k = 0;
+  for (constSpMatRef::InnerIterator it(x, col); it; ++it, ++k) {
+    const int row = it.row();
+    const double x_col_i = XValue<kBinary>(it);
+    const double cost_i = CostAt<kWeighted>(cost, row);
+    const double wx = w_old * x_col_i;
+    const double q_i = q_cache->coeff(row) - wx;
+    const double q2_i = q2_cache->coeff(row) - wx * wx;
+    const double h_i = x_col_i * .5 * (q_i * q_i - q2_i);
+    (*h)[k] = h_i;
+    chsqr += cost_i * h_i * h_i;
+    che += cost_i * h_i * err->coeff(row);
+  }
+
+  const double w_new = (che + w_old * chsqr) / (chsqr + l2_reg);
+  const double w = w_old + step_size * (w_new - w_old);
+  w3.coeffRef(layer, col) = w;
+  if (w == w_old) return 0;
+
+  // Scatter pass, reuses the gradients.
+  k = 0;
+  for (constSpMatRef::InnerIterator it(x, col); it; ++it, ++k) {
+    const int row = it.row();
+    const double x_col_i = XValue<kBinary>(it);
+    err->coeffRef(row) += (w_old - w) * (*h)[k];
+    q_cache->coeffRef(row) += (w - w_old) * x_col_i;
+    q2_cache->coeffRef(row) += (w * w - w_old * w_old) * x_col_i * x_col_i;
+  }
+  return w - w_old;
+}
+
+double ThirdOrderUpdate(const int layer,
+                        const int col,
+                        constVectorRef cost,
+                        constSpMatRef x,
+                        const double l2_reg,
+                        const double step_size,
+                        MatrixRef w3,
+                        Vector* err,
+                        Vector* q_cache,
+                        Vector* q2_cache,
+                        std::vector<double>* h) {
+  if (IsBinary(x)) {
+    if (cost.size() == 0) {
+      return ThirdOrderUpdateKernel<true, false>(layer, col, cost, x, l2_reg,
+                                                 step_size, w3, err, q_cache,
+                                                 q2_cache, h);
+    }
+    return ThirdOrderUpdateKernel<true, true>(layer, col, cost, x, l2_reg,
+                                              step_size, w3, err, q_cache,
+                                              q2_cache, h);
+  }
+  if (cost.size() == 0) {
+    return ThirdOrderUpdateKernel<false, false>(layer, col, cost, x, l2_reg,
+                                                step_size, w3, err, q_cache,
+                                                q2_cache, h);
+  }
+  return ThirdOrderUpdateKernel<false, true>(layer, col, cost, x, l2_reg,
+                                             step_size, w3, err, q_cache,
+                                             q2_cache, h);
+}
+
+template<bool kBinary>
+void FirstOrderErrUpdateKernel(const int col, const double w_new,
+                               const double w_old,
+                               constSpMatRef x, Vector* err) {
+  for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
+    const int row = it.row();
+    const double x_col_i = XValue<kBinary>(it);
+
+    err->coeffRef(row) += (w_old - w_new) * x_col_i;
+  }
+}
+
 void FirstOrderErrUpdate(const int col, const double w_new, const double w_old,
                          constSpMatRef x, Vector* err) {
+  if (IsBinary(x)) {
+    FirstOrderErrUpdateKernel<true>(col, w_new, w_old, x, err);
+  } else {
+    FirstOrderErrUpdateKernel<false>(col, w_new, w_old, x, err);
+  }
+}
+
+template<bool kBinary>
+void FirstOrderPredUpdateKernel(const int col, const double w_new,
+                                const double w_old,
+                                constSpMatRef x, Vector* y_pred) {
   for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
     const int row = it.row();
-    const double x_col_i = it.value();
+    const double x_col_i = XValue<kBinary>(it);
 
-    err->coeffRef(row) += (w_old - w_new) * x_col_i;
+    y_pred->coeffRef(row) += (w_new - w_old) * x_col_i;
   }
 }
 
 void FirstOrderPredUpdate(const int col, const double w_new, const double w_old,
                           constSpMatRef x, Vector* y_pred) {
+  if (IsBinary(x)) {
+    FirstOrderPredUpdateKernel<true>(col, w_new, w_old, x, y_pred);
+  } else {
+    FirstOrderPredUpdateKernel<false>(col, w_new, w_old, x, y_pred);
+  }
+}
+
+template<bool kBinary>
+void SecondOrderErrAndQcacheUpdateKernel(const int layer,
+                                         const int col,
+                                         constMatrixRef w2,
+                                         const double w_old,
+                                         constSpMatRef x,
+                                         Vector* err,
+                                         Vector* q_cache) {
+  double const w_new = w2.coeffRef(layer, col);
   for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
     const int row = it.row();
-    const double x_col_i = it.value();
+    const double x_col_i = XValue<kBinary>(it);
 
-    y_pred->coeffRef(row) += (w_new - w_old) * x_col_i;
+    const double q_i = q_cache->coeffRef(row);
+    const double h_i = x_col_i * (q_i - w_old * x_col_i);
+
+    q_cache->coeffRef(row) += (w_new - w_old) * x_col_i;
+    err->coeffRef(row) += (w_old - w_new) * h_i;
   }
 }
 
@@ -419,16 +1233,33 @@ void SecondOrderErrAndQcacheUpdate(const int layer,
                                    constSpMatRef x,
                                    Vector* err,
                                    Vector* q_cache) {
+  if (IsBinary(x)) {
+    SecondOrderErrAndQcacheUpdateKernel<true>(layer, col, w2, w_old, x, err,
+                                              q_cache);
+  } else {
+    SecondOrderErrAndQcacheUpdateKernel<false>(layer, col, w2, w_old, x, err,
+                                               q_cache);
+  }
+}
+
+template<bool kBinary>
+void SecondOrderPredAndQcacheUpdateKernel(const int layer,
+                                          const int col,
+                                          constMatrixRef w2,
+                                          const double w_old,
+                                          constSpMatRef x,
+                                          Vector* y_pred,
+                                          Vector* q_cache) {
   double const w_new = w2.coeffRef(layer, col);
   for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
     const int row = it.row();
-    const double x_col_i = it.value();
+    const double x_col_i = XValue<kBinary>(it);
 
     const double q_i = q_cache->coeffRef(row);
     const double h_i = x_col_i * (q_i - w_old * x_col_i);
 
     q_cache->coeffRef(row) += (w_new - w_old) * x_col_i;
-    err->coeffRef(row) += (w_old - w_new) * h_i;
+    y_pred->coeffRef(row) += (w_new - w_old) * h_i;
   }
 }
 
@@ -439,16 +1270,12 @@ void SecondOrderPredAndQcacheUpdate(const int layer,
                                     constSpMatRef x,
                                     Vector* y_pred,
                                     Vector* q_cache) {
-  double const w_new = w2.coeffRef(layer, col);
-  for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
-    const int row = it.row();
-    const double x_col_i = it.value();
-
-    const double q_i = q_cache->coeffRef(row);
-    const double h_i = x_col_i * (q_i - w_old * x_col_i);
-
-    q_cache->coeffRef(row) += (w_new - w_old) * x_col_i;
-    y_pred->coeffRef(row) += (w_new - w_old) * h_i;
+  if (IsBinary(x)) {
+    SecondOrderPredAndQcacheUpdateKernel<true>(layer, col, w2, w_old, x, y_pred,
+                                               q_cache);
+  } else {
+    SecondOrderPredAndQcacheUpdateKernel<false>(layer, col, w2, w_old, x,
+                                                y_pred, q_cache);
   }
 }
 
@@ -18,12 +18,27 @@
 #ifndef FASTFM_CORE2_FASTFM_SOLVERS_CD_IMPL_H_
 #define FASTFM_CORE2_FASTFM_SOLVERS_CD_IMPL_H_
 
+#include <vector>
+
 #include "fastfm_impl.h"
 
 namespace fastfm {
 namespace cd {
+
+class CoordinateOrder;
+
 namespace impl {
 
+// Binary design matrices are mapped without a values array, every non-zero
+// is 1. The kernels below dispatch to specializations that don't read x
+// values for them.
+inline bool IsBinary(constSpMatRef x) { return x.valuePtr() == nullptr; }
+
+template<bool kBinary>
+inline double XValue(const constSpMatRef::InnerIterator& it) {
+  return kBinary ? 1 : it.value();
+}
+
 void Predict(constSpMatRef x,
              constMatrixRef w2,
              constVectorRef w1,
@@ -37,6 +52,16 @@ void Predict(constSpMatRef x,
              const double w0,
              VectorRef res);
 
+// Single pass over x, w2t is the feature major (n_features x rank) w2.
+void PredictFeatureMajor(constSpMatRef x,
+                         constMatrixRef w2t,
+                         constVectorRef w1,
+                         const double w0,
+                         VectorRef res);
+
+// Predictions with the current working layout of coef.
+void Predict(constSpMatRef x, const ModelParam* coef, VectorRef res);
+
 void FitSquareLoss(constSpMatRef x, constVectorRef y, constVectorRef cost,
                    SolverSettings settings, ModelParam* coef, VectorRef res,
                    fit_callback_t cb, python_function_t python_func);
@@ -48,6 +73,41 @@ void FitSquareLoss(constSpMatRef x, constVectorRef y, constVectorRef cost,
 void FitSquareLoss(constSpMatRef x, constVectorRef y, constVectorRef cost,
                    SolverSettings settings, ModelParam* coef);
 
+// Linearization of the logistic loss for labels y > 0 (positive) and
+// y <= 0 (negative). On entry err holds the predictions, on exit the
+// working residual (t - p) / w with the IRLS weights w = p (1 - p) (times
+// cost if given) in weight.
+void LogisticWorkingResponse(constVectorRef y, constVectorRef cost,
+                             Vector* err, Vector* weight);
+
+// L2 penalty of every column, group_l2_reg[feature_group[j]] for grouped
+// columns and l2_reg otherwise.
+Vector ColumnL2Reg(const double l2_reg,
+                   const std::vector<double>& group_l2_reg,
+                   const std::vector<int>& feature_group,
+                   const int n_features);
+
+// Windows of consecutive rows of x, read in place. The view of rows
+// [begin, end) has end - begin rows, row i of the view is row begin + i of
+// x. The columns are located by binary search and only the row indices
+// (and values) inside the window are copied, the CD kernels read the view
+// like x. The rows of every column of x have to be sorted and unique.
+class RowWindow {
+ public:
+  explicit RowWindow(constSpMatRef x);
+
+  // The view is valid until the next call.
+  Eigen::Map<SpMat> view(int begin, int end);
+
+ private:
+  constSpMatRef x_;
+  bool binary_;
+  // Backing arrays of the compressed view, no values for a binary x.
+  std::vector<sparse_index_t> view_outer_;
+  std::vector<sparse_index_t> view_inner_;
+  std::vector<double> view_values_;
+};
+
 void FirstOrderStats(const int col, constVectorRef cost, constSpMatRef x,
                      constVectorRef err, double* chsqr, double* che);
 
@@ -57,11 +117,77 @@ void SecondOrderStats(const int layer, const int col, constVectorRef cost,
 
 Vector Qcache(const int f, constSpMatRef x, constMatrixRef w);
 
+// Jacobi style update of the layers [first_layer, first_layer + n_layers)
+// of w2, one thread per layer against a snapshot of the residual.
+// Thread t is pinned to cpus[t] if cpus is not empty.
+void SecondOrderLayersParallel(const int first_layer,
+                               const int n_layers,
+                               constVectorRef cost,
+                               constSpMatRef x,
+                               constVectorRef l2_reg,
+                               const double step_size,
+                               MatrixRef w2,
+                               Vector* err,
+                               CoordinateOrder* coords,
+                               const std::vector<int>& cpus);
+
+// Returns the (n_samples x rank) q_cache of all layers,
+// wt is the feature major (n_features x rank) parameter.
+Matrix QcacheFeatureMajor(constSpMatRef x, constMatrixRef wt);
+
+void SecondOrderStatsFeatureMajor(const int layer, const int col,
+                                  constVectorRef cost, constSpMatRef x,
+                                  constMatrixRef w2t, constVectorRef err,
+                                  constMatrixRef q_cache,
+                                  double* chsqr, double* che);
+
+void SecondOrderErrAndQcacheUpdateFeatureMajor(const int layer,
+                                               const int col,
+                                               constMatrixRef w2t,
+                                               const double w_old,
+                                               constSpMatRef x,
+                                               Vector* err,
+                                               Matrix* q_cache);
+
 Vector Qcache(const int f,
               constSpMatRef x,
               constVectorRef cost,
               constMatrixRef w);
 
+// q_cache and q2_cache of layer f of the third order parameter w in one
+// pass, q = sum_k w_k x_k and q2 = sum_k (w_k x_k)^2.
+void ThirdOrderQcache(const int f, constSpMatRef x, constMatrixRef w,
+                      Vector* q_cache, Vector* q2_cache);
+
+void ThirdOrderStats(const int layer, const int col, constVectorRef cost,
+                     constSpMatRef x, constMatrixRef w3, constVectorRef err,
+                     constVectorRef q_cache, constVectorRef q2_cache,
+                     double* chsqr, double* che);
+
+void ThirdOrderErrAndQcacheUpdate(const int layer,
+                                  const int col,
+                                  constMatrixRef w3,
+                                  const double w_old,
+                                  constSpMatRef x,
+                                  Vector* err,
+                                  Vector* q_cache,
+                                  Vector* q2_cache);
+
+// Fused ThirdOrderStats, parameter update and ThirdOrderErrAndQcacheUpdate,
+// the gradients of the column are computed once and kept in h.
+// Returns the parameter change.
+double ThirdOrderUpdate(const int layer,
+                        const int col,
+                        constVectorRef cost,
+                        constSpMatRef x,
+                        const double l2_reg,
+                        const double step_size,
+                        MatrixRef w3,
+                        Vector* err,
+                        Vector* q_cache,
+                        Vector* q2_cache,
+                        std::vector<double>* h);
+
 void FirstOrderPredUpdate(const int col, const double w_new, const double w_old,
                           constSpMatRef x, Vector* y_pred);
 
@@ -0,0 +1,99 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "compressed_index.h"
+
+#include <algorithm>
+
+#define LOGURU_REPLACE_GLOG 1
+#include "../../3rdparty/loguru/loguru.hpp"
+
+namespace fastfm {
+namespace cd {
+
+CompressedColumns::CompressedColumns(const std::string& method,
+                                     constSpMatRef x)
+    : n_rows_(x.rows()),
+      n_cols_(x.cols()),
+      values_(x.valuePtr()),
+      value_begin_(x.cols() + 1),
+      byte_begin_(x.cols() + 1),
+      view_outer_(x.cols() + 1, 0),
+      view_nnz_(x.cols(), 0),
+      view_col_(0) {
+  CHECK(method == "varint") << "index_compression: " << method
+                            << " is not supported";
+  CHECK(x.isCompressed()) << "index_compression requires a compressed x";
+
+  sparse_index_t max_nnz = 0;
+  for (int col = 0; col < n_cols_; ++col) {
+    value_begin_[col] = x.outerIndexPtr()[col];
+    byte_begin_[col] = bytes_.size();
+    // Gaps are encoded minus one, rows are strictly increasing.
+    sparse_index_t last = -1;
+    for (constSpMatRef::InnerIterator it(x, col); it; ++it) {
+      CHECK_GT(it.row(), last) << "index_compression requires sorted, "
+                               << "unique row indices in column " << col;
+      uint32_t gap = it.row() - last - 1;
+      last = it.row();
+      while (gap >= 0x80) {
+        bytes_.push_back(static_cast<uint8_t>(gap | 0x80));
+        gap >>= 7;
+      }
+      bytes_.push_back(static_cast<uint8_t>(gap));
+    }
+    max_nnz = std::max(max_nnz,
+                       x.outerIndexPtr()[col + 1] - x.outerIndexPtr()[col]);
+  }
+  value_begin_[n_cols_] = x.outerIndexPtr()[n_cols_];
+  byte_begin_[n_cols_] = bytes_.size();
+  bytes_.shrink_to_fit();
+  rows_.resize(max_nnz);
+}
+
+Eigen::Map<SpMat> CompressedColumns::column(int col) {
+  const sparse_index_t nnz = value_begin_[col + 1] - value_begin_[col];
+  const uint8_t* in = bytes_.data() + byte_begin_[col];
+  sparse_index_t* out = rows_.data();
+  sparse_index_t row = -1;
+  for (sparse_index_t k = 0; k < nnz; ++k) {
+    // Single byte gaps are the common case of dense columns.
+    uint32_t gap = *in++;
+    if (gap >= 0x80) {
+      gap &= 0x7f;
+      int shift = 7;
+      uint32_t byte;
+      do {
+        byte = *in++;
+        gap |= (byte & 0x7f) << shift;
+        shift += 7;
+      } while (byte >= 0x80);
+    }
+    row += gap + 1;
+    out[k] = row;
+  }
+
+  view_nnz_[view_col_] = 0;
+  view_nnz_[col] = nnz;
+  view_col_ = col;
+  return Eigen::Map<SpMat>(n_rows_, n_cols_, nnz, view_outer_.data(),
+                           rows_.data(),
+                           values_ == nullptr
+                           ? nullptr
+                           : const_cast<double*>(values_) + value_begin_[col],
+                           view_nnz_.data());
+}
+
+}  // namespace cd
+}  // namespace fastfm
@@ -0,0 +1,69 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_SOLVERS_COMPRESSED_INDEX_H_
+#define FASTFM_CORE2_FASTFM_SOLVERS_COMPRESSED_INDEX_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fastfm_impl.h"
+
+namespace fastfm {
+namespace cd {
+
+/** @brief Column major design matrix with compressed row indices.
+ *
+ * The row indices of a column are delta encoded as LEB128 varints
+ * (`index_compression` setting `varint`), gaps below 128 rows take one
+ * byte instead of the four bytes of an `int` index. The values of x are
+ * referenced, not copied, and must outlive the object.
+ *
+ * Columns are decoded one at a time. The decoded view has the shape of x
+ * but only the decoded column is non-empty, the CD column kernels read it
+ * like x itself.
+ */
+class CompressedColumns {
+ public:
+  CompressedColumns(const std::string& method, constSpMatRef x);
+
+  // Decodes column `col`, the view is valid until the next call.
+  Eigen::Map<SpMat> column(int col);
+
+  // Bytes of the encoded row indices.
+  size_t index_bytes() const { return bytes_.size(); }
+
+ private:
+  int n_rows_;
+  int n_cols_;
+  // Values of x, nullptr for a binary x.
+  const double* values_;
+  // Start of each column in the values and in the encoded bytes.
+  std::vector<sparse_index_t> value_begin_;
+  std::vector<size_t> byte_begin_;
+  std::vector<uint8_t> bytes_;
+
+  // Backing arrays of the view. The view is stored uncompressed with all
+  // outer indices 0 and the non-zeros of the decoded column only.
+  std::vector<sparse_index_t> rows_;
+  std::vector<sparse_index_t> view_outer_;
+  std::vector<sparse_index_t> view_nnz_;
+  int view_col_;
+};
+
+}  // namespace cd
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_SOLVERS_COMPRESSED_INDEX_H_
@@ -0,0 +1,113 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "coordinate_order.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+#define LOGURU_REPLACE_GLOG 1
+#include "../../3rdparty/loguru/loguru.hpp"
+
+namespace fastfm {
+namespace cd {
+
+CoordinateOrder::CoordinateOrder(const SolverSettings& settings,
+                                 int n_blocks,
+                                 int n_features)
+    : method_(settings.coord_order),
+      fraction_(settings.coord_fraction),
+      n_features_(n_features),
+      track_(settings.coord_order == "greedy"),
+      rng_(settings.rng_seed),
+      shrinking_(settings.shrink_tol > 0),
+      shrink_tol_(settings.shrink_tol),
+      shrink_patience_(settings.shrink_patience),
+      shrink_check_every_(settings.shrink_check_every),
+      epoch_(-1),
+      verify_(true),
+      order_(n_blocks),
+      visit_(n_blocks),
+      valid_(n_blocks, false) {
+  CHECK(method_ == "cyclic" || method_ == "random" || method_ == "greedy")
+  << "Coordinate order: " << method_ << " is not supported";
+  CHECK(fraction_ > 0 && fraction_ <= 1)
+  << "coord_fraction has to be in (0, 1]";
+  CHECK_GT(shrink_patience_, 0);
+
+  if (shrinking_) stall_.assign(n_blocks * n_features, 0);
+
+  for (auto& block : order_) {
+    block.resize(n_features);
+    std::iota(block.begin(), block.end(), 0);
+  }
+  // Unseen coordinates are the most important ones.
+  if (track_) {
+    importance_ = Matrix::Constant(n_blocks, n_features,
+                                   std::numeric_limits<double>::infinity());
+  }
+}
+
+void CoordinateOrder::next_epoch() {
+  std::fill(valid_.begin(), valid_.end(), false);
+  ++epoch_;
+  verify_ = epoch_ == 0
+      || (shrink_check_every_ > 0 && epoch_ % shrink_check_every_ == 0);
+}
+
+const std::vector<int>& CoordinateOrder::order(int block) {
+  if (!valid_[block]) {
+    valid_[block] = true;
+    const std::vector<int>& candidates = candidate_order(block);
+    if (is_verification_epoch()) return candidates;
+
+    std::vector<int>& res = visit_[block];
+    res.clear();
+    for (int col : candidates)
+      if (is_active(block, col)) res.push_back(col);
+  }
+  return is_verification_epoch() ? order_[block] : visit_[block];
+}
+
+const std::vector<int>& CoordinateOrder::candidate_order(int block) {
+  std::vector<int>& res = order_[block];
+  if (method_ == "cyclic") return res;
+
+  if (method_ == "random") {
+    std::shuffle(res.begin(), res.end(), rng_);
+    return res;
+  }
+
+  // greedy: restore all coordinates, then move the most important to front.
+  res.resize(n_features_);
+  std::iota(res.begin(), res.end(), 0);
+  const int n_visit = std::max(
+      1, static_cast<int>(std::ceil(fraction_ * n_features_)));
+  const double* importance = importance_.data() + block * n_features_;
+  auto more_important = [importance](int a, int b) {
+    return importance[a] > importance[b];
+  };
+  if (n_visit < n_features_) {
+    std::nth_element(res.begin(), res.begin() + n_visit, res.end(),
+                     more_important);
+    res.resize(n_visit);
+  }
+  std::sort(res.begin(), res.end(), more_important);
+  return res;
+}
+
+}  // namespace cd
+}  // namespace fastfm
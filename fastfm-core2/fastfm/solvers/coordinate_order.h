@@ -0,0 +1,107 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_SOLVERS_COORDINATE_ORDER_H_
+#define FASTFM_CORE2_FASTFM_SOLVERS_COORDINATE_ORDER_H_
+
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "fastfm_impl.h"
+
+namespace fastfm {
+namespace cd {
+
+/** @brief Selects the coordinates visited by the CD solver in each epoch.
+ *
+ * Coordinates are grouped in blocks (w1, each layer of w2, each layer of w3),
+ * every block holds one coordinate per feature.
+ * Supported `coord_order` settings:
+ *   - `cyclic`: features in index order.
+ *   - `random`: new random permutation per block and epoch.
+ *   - `greedy`: features sorted by the magnitude of their last update
+ *               (Gauss-Southwell approximation). Only the leading
+ *               `coord_fraction` of the features is visited, coordinates
+ *               that stopped moving are therefore skipped until the
+ *               remaining updates become smaller.
+ *
+ * Independent of the order, active-set shrinking is enabled with
+ * `shrink_tol` > 0. A coordinate whose update stayed below `shrink_tol` for
+ * `shrink_patience` consecutive visits is removed from the active set.
+ * Every `shrink_check_every` epochs (never for values <= 0) all coordinates
+ * are visited again and coordinates that moved by at least `shrink_tol`
+ * rejoin the active set.
+ */
+class CoordinateOrder {
+ public:
+  CoordinateOrder(const SolverSettings& settings, int n_blocks,
+                  int n_features);
+
+  // Invalidates the orders of the previous epoch.
+  void next_epoch();
+
+  // Coordinates of `block` to visit in the current epoch.
+  const std::vector<int>& order(int block);
+
+  // Records the parameter change of coordinate `col` in `block`.
+  void report(int block, int col, double delta) {
+    const double abs_delta = std::abs(delta);
+    if (track_) importance_.coeffRef(block, col) = abs_delta;
+    if (shrinking_) {
+      int& stall = stall_[block * n_features_ + col];
+      stall = abs_delta < shrink_tol_ ? stall + 1 : 0;
+    }
+  }
+
+  // True if the current epoch visits all coordinates.
+  bool is_verification_epoch() const {
+    return !shrinking_ || verify_;
+  }
+
+ private:
+  // Order of all candidate coordinates, before shrinking.
+  const std::vector<int>& candidate_order(int block);
+
+  bool is_active(int block, int col) const {
+    return stall_[block * n_features_ + col] < shrink_patience_;
+  }
+
+  std::string method_;
+  double fraction_;
+  int n_features_;
+  bool track_;
+  std::mt19937 rng_;
+
+  bool shrinking_;
+  double shrink_tol_;
+  int shrink_patience_;
+  int shrink_check_every_;
+  int epoch_;
+  bool verify_;
+  // Number of consecutive updates below `shrink_tol_` per coordinate.
+  std::vector<int> stall_;
+
+  // Candidate order of each block and the coordinates visited this epoch.
+  std::vector<std::vector<int>> order_;
+  std::vector<std::vector<int>> visit_;
+  std::vector<bool> valid_;
+  Matrix importance_;
+};
+
+}  // namespace cd
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_SOLVERS_COORDINATE_ORDER_H_
@@ -0,0 +1,267 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "numa.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#define FASTFM_HAS_AFFINITY 1
+#endif
+
+#define LOGURU_REPLACE_GLOG 1
+#include "../../3rdparty/loguru/loguru.hpp"
+
+namespace fastfm {
+namespace numa {
+
+namespace {
+
+// Granularity of the first touch placement.
+const size_t kPageBytes = 4096;
+
+// Parses a cpu list like `0-3,8-11`.
+std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() || range == "\n") continue;
+    const size_t dash = range.find('-');
+    const int first = std::atoi(range.c_str());
+    const int last = dash == std::string::npos
+                     ? first : std::atoi(range.c_str() + dash + 1);
+    for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+// CPUs the process may run on.
+std::vector<int> UsableCpus() {
+  std::vector<int> cpus;
+#if FASTFM_HAS_AFFINITY
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+      if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+  }
+#endif
+  if (cpus.empty()) {
+    const int n = std::max(1u, std::thread::hardware_concurrency());
+    for (int cpu = 0; cpu < n; ++cpu) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+void CheckPlacement(const std::string& placement) {
+  CHECK(placement == "default" || placement == "partitioned"
+            || placement == "interleaved")
+  << "memory placement: " << placement << " is not supported";
+}
+
+// Calls fn(begin, end) for the byte ranges of each thread.
+template<typename Fn>
+void ForPlacedRanges(const std::string& placement,
+                     const std::vector<int>& cpus, size_t bytes, Fn fn) {
+  const int n_threads = cpus.size();
+  const size_t n_pages = (bytes + kPageBytes - 1) / kPageBytes;
+  const bool interleaved = placement == "interleaved";
+  parallel::ParallelFor(cpus, n_threads, n_threads, [&](int t) {
+    if (interleaved) {
+      for (size_t p = t; p < n_pages; p += n_threads)
+        fn(p * kPageBytes, std::min((p + 1) * kPageBytes, bytes));
+    } else {
+      const size_t begin = n_pages * t / n_threads * kPageBytes;
+      const size_t end = n_pages * (t + 1) / n_threads * kPageBytes;
+      if (begin < bytes) fn(begin, std::min(end, bytes));
+    }
+  });
+}
+
+// Sets n doubles at data to 1, placed like `PlacedCopy`.
+void PlacedOnes(const std::string& placement, const std::vector<int>& cpus,
+                double* data, size_t n) {
+  CheckPlacement(placement);
+  if (placement == "default" || cpus.empty()) {
+    std::fill(data, data + n, 1.);
+    return;
+  }
+  // The ranges are page aligned, whole doubles.
+  ForPlacedRanges(placement, cpus, n * sizeof(double),
+                  [data](size_t begin, size_t end) {
+    std::fill(data + begin / sizeof(double), data + end / sizeof(double), 1.);
+  });
+}
+
+}  // namespace
+
+std::vector<std::vector<int>> NodeCpus() {
+  const std::vector<int> usable = UsableCpus();
+  std::vector<std::vector<int>> nodes;
+#if FASTFM_HAS_AFFINITY
+  const std::string root = "/sys/devices/system/node";
+  std::vector<int> node_ids;
+  if (DIR* dir = opendir(root.c_str())) {
+    while (dirent* entry = readdir(dir)) {
+      int id;
+      char tail;
+      if (std::sscanf(entry->d_name, "node%d%c", &id, &tail) == 1)
+        node_ids.push_back(id);
+    }
+    closedir(dir);
+  }
+  std::sort(node_ids.begin(), node_ids.end());
+  for (int id : node_ids) {
+    std::ifstream file(root + "/node" + std::to_string(id) + "/cpulist");
+    std::string list;
+    std::getline(file, list);
+    std::vector<int> cpus;
+    for (int cpu : ParseCpuList(list)) {
+      if (std::find(usable.begin(), usable.end(), cpu) != usable.end())
+        cpus.push_back(cpu);
+    }
+    if (!cpus.empty()) nodes.push_back(cpus);
+  }
+#endif
+  if (nodes.empty()) nodes.push_back(usable);
+  return nodes;
+}
+
+std::vector<int> WorkerCpus(const std::string& affinity, int n_workers) {
+  if (affinity == "none") return std::vector<int>();
+  CHECK(affinity == "compact" || affinity == "scatter")
+  << "thread affinity: " << affinity << " is not supported";
+
+  const std::vector<std::vector<int>> nodes = NodeCpus();
+  std::vector<int> cpus(n_workers);
+  if (affinity == "compact") {
+    std::vector<int> all;
+    for (const auto& node : nodes) all.insert(all.end(), node.begin(),
+                                              node.end());
+    for (int w = 0; w < n_workers; ++w) cpus[w] = all[w % all.size()];
+  } else {
+    const int n_nodes = nodes.size();
+    for (int w = 0; w < n_workers; ++w) {
+      const std::vector<int>& node = nodes[w % n_nodes];
+      cpus[w] = node[(w / n_nodes) % node.size()];
+    }
+  }
+  return cpus;
+}
+
+struct ScopedPin::Mask {
+#if FASTFM_HAS_AFFINITY
+  cpu_set_t set;
+#endif
+};
+
+ScopedPin::ScopedPin(int cpu) {
+#if FASTFM_HAS_AFFINITY
+  if (cpu < 0) return;
+  previous_.reset(new Mask());
+  if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                             &previous_->set) != 0) {
+    previous_.reset();
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    LOG(WARNING) << "Can't pin thread to cpu " << cpu;
+    previous_.reset();
+  }
+#endif
+}
+
+ScopedPin::~ScopedPin() {
+#if FASTFM_HAS_AFFINITY
+  if (previous_)
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                           &previous_->set);
+#endif
+}
+
+void PlacedCopy(const std::string& placement, const std::vector<int>& cpus,
+                void* dst, const void* src, size_t bytes) {
+  CheckPlacement(placement);
+  if (placement == "default" || cpus.empty()) {
+    std::memcpy(dst, src, bytes);
+    return;
+  }
+  char* to = static_cast<char*>(dst);
+  const char* from = static_cast<const char*>(src);
+  ForPlacedRanges(placement, cpus, bytes, [to, from](size_t begin,
+                                                     size_t end) {
+    std::memcpy(to + begin, from + begin, end - begin);
+  });
+}
+
+SpMat PlacedCopy(const std::string& placement, const std::vector<int>& cpus,
+                 constSpMatRef x) {
+  // Binary matrices have no values, every non-zero of the copy is 1.
+  const bool binary = x.valuePtr() == nullptr;
+  if (!x.isCompressed()) {
+    SpMat compressed(x.rows(), x.cols());
+    compressed.reserve(x.nonZeros());
+    for (int col = 0; col < x.cols(); ++col) {
+      compressed.startVec(col);
+      for (constSpMatRef::InnerIterator it(x, col); it; ++it)
+        compressed.insertBack(it.row(), col) = binary ? 1 : it.value();
+    }
+    compressed.finalize();
+    return PlacedCopy(placement, cpus, compressed);
+  }
+  // resizeNonZeros allocates without initializing the arrays.
+  SpMat placed(x.rows(), x.cols());
+  placed.resizeNonZeros(x.nonZeros());
+  std::copy(x.outerIndexPtr(), x.outerIndexPtr() + x.cols() + 1,
+            placed.outerIndexPtr());
+  if (binary) {
+    PlacedOnes(placement, cpus, placed.valuePtr(), x.nonZeros());
+  } else {
+    PlacedCopy(placement, cpus, placed.valuePtr(), x.valuePtr(),
+               x.nonZeros() * sizeof(*x.valuePtr()));
+  }
+  PlacedCopy(placement, cpus, placed.innerIndexPtr(), x.innerIndexPtr(),
+             x.nonZeros() * sizeof(*x.innerIndexPtr()));
+  return placed;
+}
+
+void PlacedZero(const std::string& placement, const std::vector<int>& cpus,
+                void* data, size_t bytes) {
+  CheckPlacement(placement);
+  if (placement == "default" || cpus.empty()) {
+    std::memset(data, 0, bytes);
+    return;
+  }
+  char* to = static_cast<char*>(data);
+  ForPlacedRanges(placement, cpus, bytes, [to](size_t begin, size_t end) {
+    std::memset(to + begin, 0, end - begin);
+  });
+}
+
+}  // namespace numa
+}  // namespace fastfm
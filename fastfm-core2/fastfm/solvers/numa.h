@@ -0,0 +1,72 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_SOLVERS_NUMA_H_
+#define FASTFM_CORE2_FASTFM_SOLVERS_NUMA_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fastfm_decl.h"
+
+namespace fastfm {
+namespace numa {
+
+// Usable CPUs grouped by NUMA node. A single node with all usable CPUs if
+// the topology is unknown.
+std::vector<std::vector<int>> NodeCpus();
+
+// CPU for each of n_workers threads or processes, empty for `none`.
+//   `compact`: fills the CPUs of one node before using the next node.
+//   `scatter`: assigns the workers round robin to the nodes.
+std::vector<int> WorkerCpus(const std::string& affinity, int n_workers);
+
+// Restricts the calling thread to `cpu` and restores the previous CPU mask
+// on destruction. No-op for cpu < 0 or on systems without thread affinity.
+class ScopedPin {
+ public:
+  explicit ScopedPin(int cpu);
+  ~ScopedPin();
+
+ private:
+  ScopedPin(const ScopedPin&) = delete;
+  ScopedPin& operator=(const ScopedPin&) = delete;
+
+  struct Mask;
+  std::unique_ptr<Mask> previous_;
+};
+
+// Copies `bytes` from src to dst with one thread pinned to each of `cpus`.
+// Memory is placed on the node of the thread that touches it first, dst
+// must therefore be freshly allocated (not yet touched) memory.
+//   `partitioned`: contiguous chunk per thread.
+//   `interleaved`: pages round robin over the threads.
+// Plain copy for `default` or without cpus.
+void PlacedCopy(const std::string& placement, const std::vector<int>& cpus,
+                void* dst, const void* src, size_t bytes);
+
+// Copy of x with placed index and value arrays.
+SpMat PlacedCopy(const std::string& placement, const std::vector<int>& cpus,
+                 constSpMatRef x);
+
+// Zeros `bytes` at data, placed like `PlacedCopy`.
+void PlacedZero(const std::string& placement, const std::vector<int>& cpus,
+                void* data, size_t bytes);
+
+}  // namespace numa
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_SOLVERS_NUMA_H_
@@ -0,0 +1,55 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_SOLVERS_PARALLEL_H_
+#define FASTFM_CORE2_FASTFM_SOLVERS_PARALLEL_H_
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "numa.h"
+
+namespace fastfm {
+namespace parallel {
+
+// Calls fn(task) for every task in [0, n_tasks) using up to n_threads
+// threads. Task t is executed by thread t % n_threads, the calling thread
+// takes part as thread 0. Thread t runs pinned to cpus[t % cpus.size()]
+// unless cpus is empty.
+template<typename Fn>
+void ParallelFor(const std::vector<int>& cpus, int n_threads, int n_tasks,
+                 Fn fn) {
+  n_threads = std::max(1, std::min(n_threads, n_tasks));
+  auto worker = [&fn, &cpus, n_threads, n_tasks](int thread) {
+    numa::ScopedPin pin(cpus.empty() ? -1 : cpus[thread % cpus.size()]);
+    for (int task = thread; task < n_tasks; task += n_threads) fn(task);
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(n_threads - 1);
+  for (int t = 1; t < n_threads; ++t) threads.emplace_back(worker, t);
+  worker(0);
+  for (auto& thread : threads) thread.join();
+}
+
+template<typename Fn>
+void ParallelFor(int n_threads, int n_tasks, Fn fn) {
+  ParallelFor(std::vector<int>(), n_threads, n_tasks, fn);
+}
+
+}  // namespace parallel
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_SOLVERS_PARALLEL_H_
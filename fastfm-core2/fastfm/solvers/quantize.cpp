@@ -0,0 +1,189 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "quantize.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "cd_impl.h"
+
+#define LOGURU_REPLACE_GLOG 1
+#include "../../3rdparty/loguru/loguru.hpp"
+
+namespace fastfm {
+namespace quant {
+
+namespace {
+
+void QuantizeFactors(constMatrixRef w, const std::string& type,
+                     std::vector<int8_t>* w_i8,
+                     std::vector<float>* scale,
+                     std::vector<Eigen::half>* w_f16) {
+  const int rank = w.rows();
+  const int n_features = w.cols();
+  if (rank == 0) return;
+
+  if (type == "fp16") {
+    w_f16->resize(rank * n_features);
+    for (int j = 0; j < n_features; ++j)
+      for (int f = 0; f < rank; ++f)
+        (*w_f16)[j * rank + f] = Eigen::half(static_cast<float>(w.coeff(f, j)));
+    return;
+  }
+
+  // Symmetric int8 with one scale per feature.
+  w_i8->resize(rank * n_features);
+  scale->resize(n_features);
+  for (int j = 0; j < n_features; ++j) {
+    const double max_abs = w.col(j).cwiseAbs().maxCoeff();
+    const double s = max_abs > 0 ? max_abs / 127 : 1;
+    (*scale)[j] = s;
+    for (int f = 0; f < rank; ++f)
+      (*w_i8)[j * rank + f] =
+          static_cast<int8_t>(std::lround(w.coeff(f, j) / s));
+  }
+}
+
+}  // namespace
+
+QuantizedParam Quantize(const ModelParam& coef, const std::string& type) {
+  CHECK(type == "int8" || type == "fp16")
+  << "Quantization: " << type << " is not supported";
+
+  QuantizedParam q;
+  q.type = type;
+  q.n_features = coef.getw1().size();
+  q.rank_w2 = coef.getw2().rows();
+  q.rank_w3 = coef.getw3().rows();
+  if (q.rank_w2 > 0) q.n_features = coef.getw2().cols();
+
+  q.w0 = coef.getw0();
+  constVectorRef w1 = coef.getw1();
+  q.w1.assign(w1.data(), w1.data() + w1.size());
+
+  QuantizeFactors(coef.getw2(), type, &q.w2_i8, &q.w2_scale, &q.w2_f16);
+  QuantizeFactors(coef.getw3(), type, &q.w3_i8, &q.w3_scale, &q.w3_f16);
+  return q;
+}
+
+void Dequantize(const std::vector<int8_t>& w_i8,
+                const std::vector<float>& scale,
+                const std::vector<Eigen::half>& w_f16,
+                const int rank, const int col, double* out) {
+  if (!w_f16.empty()) {
+    const Eigen::half* w = w_f16.data() + col * rank;
+    for (int f = 0; f < rank; ++f) out[f] = static_cast<float>(w[f]);
+  } else {
+    const int8_t* w = w_i8.data() + col * rank;
+    const double s = scale[col];
+    for (int f = 0; f < rank; ++f) out[f] = s * w[f];
+  }
+}
+
+namespace {
+
+template<bool kBinary>
+void PredictKernel(constSpMatRef x, const QuantizedParam& q, VectorRef res) {
+  res.setConstant(q.w0);
+
+  // res += X * w.T
+  if (!q.w1.empty()) {
+        CHECK_EQ(x.cols(), q.w1.size());
+    for (int l = 0; l < x.cols(); ++l) {
+      const double w_l = q.w1[l];
+      for (constSpMatRef::InnerIterator it(x, l); it; ++it)
+        res.coeffRef(it.row()) += w_l * cd::impl::XValue<kBinary>(it);
+    }
+  }
+
+  // res += sum_i sum_j x_i * x_j * <v_i, v_j>, one pass over x.
+  const int r2 = q.rank_w2;
+  if (r2 > 0) {
+        CHECK_EQ(x.cols(), q.n_features);
+    Vector v(r2);
+    Matrix xv_sum = Matrix::Zero(x.rows(), r2);
+    for (int l = 0; l < x.cols(); ++l) {
+      Dequantize(q.w2_i8, q.w2_scale, q.w2_f16, r2, l, v.data());
+      const double v_sqr = v.squaredNorm();
+      for (constSpMatRef::InnerIterator it(x, l); it; ++it) {
+        const double x_l = cd::impl::XValue<kBinary>(it);
+        const int row = it.row();
+        double* xv_row = xv_sum.data() + row * r2;
+        for (int k = 0; k < r2; ++k) xv_row[k] += v.coeff(k) * x_l;
+        res.coeffRef(row) -= .5 * v_sqr * x_l * x_l;
+      }
+    }
+    res += xv_sum.rowwise().squaredNorm() * .5;
+  }
+
+  // Third order, see cd::impl::Predict.
+  const int r3 = q.rank_w3;
+  if (r3 > 0) {
+        CHECK_EQ(x.cols(), q.n_features);
+    Vector v(r3);
+    Matrix xv_sum = Matrix::Zero(x.rows(), r3);
+    Matrix x2v2_sum = Matrix::Zero(x.rows(), r3);
+    for (int l = 0; l < x.cols(); ++l) {
+      Dequantize(q.w3_i8, q.w3_scale, q.w3_f16, r3, l, v.data());
+      const double v_cube = v.array().cube().sum();
+      for (constSpMatRef::InnerIterator it(x, l); it; ++it) {
+        const double x_l = cd::impl::XValue<kBinary>(it);
+        const int row = it.row();
+        double* xv_row = xv_sum.data() + row * r3;
+        double* x2v2_row = x2v2_sum.data() + row * r3;
+        for (int k = 0; k < r3; ++k) {
+          xv_row[k] += v.coeff(k) * x_l;
+          x2v2_row[k] += v.coeff(k) * v.coeff(k) * x_l * x_l;
+        }
+        res.coeffRef(row) += (1. / 3) * v_cube * x_l * x_l * x_l;
+      }
+    }
+    res += (1. / 6) * xv_sum.array().cube().rowwise().sum().matrix();
+    res -= .5 * xv_sum.cwiseProduct(x2v2_sum).rowwise().sum();
+  }
+}
+
+}  // namespace
+
+void Predict(constSpMatRef x, const QuantizedParam& q, VectorRef res) {
+  if (cd::impl::IsBinary(x)) {
+    PredictKernel<true>(x, q, res);
+  } else {
+    PredictKernel<false>(x, q, res);
+  }
+}
+
+std::map<std::string, double> Report(constSpMatRef x,
+                                     const ModelParam& coef,
+                                     const QuantizedParam& q) {
+  Vector y_ref(x.rows());
+  cd::impl::Predict(x, coef.getw3(), coef.getw2(), coef.getw1(),
+                    coef.getw0(), y_ref);
+  Vector y_q(x.rows());
+  Predict(x, q, y_q);
+
+  const Vector diff = y_q - y_ref;
+  std::map<std::string, double> report;
+  report["max_abs_error"] = diff.size() > 0 ? diff.cwiseAbs().maxCoeff() : 0;
+  report["rmse"] =
+      diff.size() > 0 ? std::sqrt(diff.squaredNorm() / diff.size()) : 0;
+  report["bytes_fp64"] = sizeof(double) * (1 + coef.getw1().size()
+      + coef.getw2().size() + coef.getw3().size());
+  report["bytes_quantized"] = q.bytes();
+  return report;
+}
+
+}  // namespace quant
+}  // namespace fastfm
@@ -0,0 +1,48 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_SOLVERS_QUANTIZE_H_
+#define FASTFM_CORE2_FASTFM_SOLVERS_QUANTIZE_H_
+
+#include <map>
+#include <string>
+
+#include "fastfm_impl.h"
+
+namespace fastfm {
+namespace quant {
+
+// Returns a low precision copy of coef, `type` is `int8` or `fp16`.
+// w0 and w1 are stored as fp32.
+QuantizedParam Quantize(const ModelParam& coef, const std::string& type);
+
+// Writes the factors of feature col into out[0, rank).
+void Dequantize(const std::vector<int8_t>& w_i8,
+                const std::vector<float>& scale,
+                const std::vector<Eigen::half>& w_f16,
+                const int rank, const int col, double* out);
+
+// Predictions of the quantized model, the factors are dequantized on the fly.
+void Predict(constSpMatRef x, const QuantizedParam& q, VectorRef res);
+
+// Compares the quantized predictions on x with the fp64 predictions.
+// Returns `max_abs_error`, `rmse`, `bytes_fp64` and `bytes_quantized`.
+std::map<std::string, double> Report(constSpMatRef x,
+                                     const ModelParam& coef,
+                                     const QuantizedParam& q);
+
+}  // namespace quant
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_SOLVERS_QUANTIZE_H_
@@ -0,0 +1,255 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "row_predict.h"
+
+#include <algorithm>
+
+#define LOGURU_REPLACE_GLOG 1
+#include "../../3rdparty/loguru/loguru.hpp"
+
+namespace fastfm {
+namespace row {
+
+namespace {
+
+// Ranks are processed in chunks to keep the accumulators on the stack.
+const int kChunk = 32;
+
+// Loaders return factor f of feature col for the different storages.
+struct RankMajorLoad {
+  const double* data;
+  int stride;
+  double operator()(int col, int f) const { return data[f * stride + col]; }
+};
+
+struct FeatureMajorLoad {
+  const double* data;
+  int stride;
+  double operator()(int col, int f) const { return data[col * stride + f]; }
+};
+
+struct Int8Load {
+  const int8_t* data;
+  const float* scale;
+  int rank;
+  double operator()(int col, int f) const {
+    return static_cast<double>(scale[col]) * data[col * rank + f];
+  }
+};
+
+struct Fp16Load {
+  const Eigen::half* data;
+  int rank;
+  double operator()(int col, int f) const {
+    return static_cast<float>(data[col * rank + f]);
+  }
+};
+
+// Calls visitor(rank, load) with a loader for the factors of order kOrder
+// in the storage the model currently uses. Returns 0 if there are none.
+template<int kOrder, typename Visitor>
+double VisitFactors(const ModelParam& coef, const Visitor& visitor) {
+  const QuantizedParam* q = coef.get_quantized();
+  if (q != NULL) {
+    const int rank = kOrder == 2 ? q->rank_w2 : q->rank_w3;
+    if (rank == 0) return 0;
+    const std::vector<Eigen::half>& w_f16 = kOrder == 2 ? q->w2_f16
+                                                        : q->w3_f16;
+    if (!w_f16.empty()) return visitor(rank, Fp16Load{w_f16.data(), rank});
+    const std::vector<int8_t>& w_i8 = kOrder == 2 ? q->w2_i8 : q->w3_i8;
+    const std::vector<float>& scale = kOrder == 2 ? q->w2_scale : q->w3_scale;
+    return visitor(rank, Int8Load{w_i8.data(), scale.data(), rank});
+  }
+
+  if (kOrder == 2 && coef.is_w2_feature_major()) {
+    // One contiguous factor vector per non-zero.
+    constMatrixRef w2t = coef.getw2_feature_major();
+    if (w2t.cols() == 0) return 0;
+    return visitor(w2t.cols(), FeatureMajorLoad{
+        w2t.data(), static_cast<int>(w2t.outerStride())});
+  }
+  constMatrixRef w = kOrder == 2 ? coef.getw2() : coef.getw3();
+  if (w.rows() == 0) return 0;
+  return visitor(w.rows(), RankMajorLoad{
+      w.data(), static_cast<int>(w.outerStride())});
+}
+
+// Sum of all interactions of order kOrder (2 or 3) between the non-zeros
+// of a row and, if given, the precomputed context sums `init`.
+//   order 2: 1/2 (q^2 - s2)
+//   order 3: 1/6 q^3 - 1/2 q s2 + 1/3 s3
+// with q = sum_k v_k x_k, s2 = sum_k (v_k x_k)^2, s3 = sum_k (v_k x_k)^3.
+template<int kOrder, typename T>
+struct Interactions {
+  const int* idx;
+  const T* val;
+  int nnz;
+  const FactorSums* init;
+
+  template<typename Load>
+  double operator()(int rank, Load load) const {
+    double res = 0;
+    for (int f0 = 0; f0 < rank; f0 += kChunk) {
+      const int n = std::min(kChunk, rank - f0);
+      double q[kChunk] = {0};
+      double s2[kChunk] = {0};
+      double s3[kChunk] = {0};
+      if (init != NULL) {
+        std::copy(init->q.begin() + f0, init->q.begin() + f0 + n, q);
+        std::copy(init->s2.begin() + f0, init->s2.begin() + f0 + n, s2);
+        if (kOrder == 3)
+          std::copy(init->s3.begin() + f0, init->s3.begin() + f0 + n, s3);
+      }
+      for (int k = 0; k < nnz; ++k) {
+        const double x = val[k];
+        for (int f = 0; f < n; ++f) {
+          const double vx = load(idx[k], f0 + f) * x;
+          q[f] += vx;
+          s2[f] += vx * vx;
+          if (kOrder == 3) s3[f] += vx * vx * vx;
+        }
+      }
+      for (int f = 0; f < n; ++f) {
+        if (kOrder == 2)
+          res += .5 * (q[f] * q[f] - s2[f]);
+        else
+          res += q[f] * q[f] * q[f] / 6 - .5 * q[f] * s2[f] + s3[f] / 3;
+      }
+    }
+    return res;
+  }
+};
+
+// Stores q, s2 and s3 of the non-zeros in sums.
+template<typename T>
+struct Accumulate {
+  const int* idx;
+  const T* val;
+  int nnz;
+  FactorSums* sums;
+
+  template<typename Load>
+  double operator()(int rank, Load load) const {
+    sums->q.assign(rank, 0);
+    sums->s2.assign(rank, 0);
+    sums->s3.assign(rank, 0);
+    for (int k = 0; k < nnz; ++k) {
+      const double x = val[k];
+      for (int f = 0; f < rank; ++f) {
+        const double vx = load(idx[k], f) * x;
+        sums->q[f] += vx;
+        sums->s2[f] += vx * vx;
+        sums->s3[f] += vx * vx * vx;
+      }
+    }
+    return 0;
+  }
+};
+
+template<typename T>
+double Linear(const ModelParam& coef, const int* idx, const T* val, int nnz) {
+  double res = 0;
+  const QuantizedParam* q = coef.get_quantized();
+  if (q != NULL) {
+    if (q->w1.empty()) return 0;
+    for (int k = 0; k < nnz; ++k) {
+      DCHECK_LT(idx[k], q->w1.size());
+      res += q->w1[idx[k]] * val[k];
+    }
+    return res;
+  }
+  constVectorRef w1 = coef.getw1();
+  if (w1.size() == 0) return 0;
+  for (int k = 0; k < nnz; ++k) {
+    DCHECK_LT(idx[k], w1.size());
+    res += w1.coeff(idx[k]) * val[k];
+  }
+  return res;
+}
+
+double Bias(const ModelParam& coef) {
+  const QuantizedParam* q = coef.get_quantized();
+  return q != NULL ? q->w0 : coef.getw0();
+}
+
+}  // namespace
+
+template<typename T>
+double PredictRow(const ModelParam& coef,
+                  const int* idx, const T* val, int nnz) {
+  return Bias(coef) + Linear(coef, idx, val, nnz)
+      + VisitFactors<2>(coef, Interactions<2, T>{idx, val, nnz, NULL})
+      + VisitFactors<3>(coef, Interactions<3, T>{idx, val, nnz, NULL});
+}
+
+template<typename T>
+void PredictRows(const ModelParam& coef, const int* indptr,
+                 const int* idx, const T* val, int n_rows, double* out) {
+  for (int i = 0; i < n_rows; ++i) {
+    const int begin = indptr[i];
+    out[i] = PredictRow(coef, idx + begin, val + begin, indptr[i + 1] - begin);
+  }
+}
+
+template<typename T>
+void PrecomputeContext(const ModelParam& coef, const int* idx, const T* val,
+                       int nnz, CandidateContext* context) {
+  context->base = Bias(coef) + Linear(coef, idx, val, nnz);
+  VisitFactors<2>(coef, Accumulate<T>{idx, val, nnz, &context->w2});
+  VisitFactors<3>(coef, Accumulate<T>{idx, val, nnz, &context->w3});
+}
+
+template<typename T>
+void PredictCandidates(const ModelParam& coef, const CandidateContext& context,
+                       const int* indptr, const int* idx, const T* val,
+                       int n_candidates, double* out) {
+  for (int i = 0; i < n_candidates; ++i) {
+    const int begin = indptr[i];
+    const int nnz = indptr[i + 1] - begin;
+    const int* idx_i = idx + begin;
+    const T* val_i = val + begin;
+    // Starting from the context sums yields all interactions of the
+    // concatenated row at O(nnz * rank) cost.
+    out[i] = context.base + Linear(coef, idx_i, val_i, nnz)
+        + VisitFactors<2>(coef, Interactions<2, T>{idx_i, val_i, nnz,
+                                                   &context.w2})
+        + VisitFactors<3>(coef, Interactions<3, T>{idx_i, val_i, nnz,
+                                                   &context.w3});
+  }
+}
+
+template double PredictRow<double>(const ModelParam&, const int*,
+                                   const double*, int);
+template double PredictRow<float>(const ModelParam&, const int*,
+                                  const float*, int);
+template void PredictRows<double>(const ModelParam&, const int*, const int*,
+                                  const double*, int, double*);
+template void PredictRows<float>(const ModelParam&, const int*, const int*,
+                                 const float*, int, double*);
+template void PrecomputeContext<double>(const ModelParam&, const int*,
+                                        const double*, int, CandidateContext*);
+template void PrecomputeContext<float>(const ModelParam&, const int*,
+                                       const float*, int, CandidateContext*);
+template void PredictCandidates<double>(const ModelParam&,
+                                        const CandidateContext&, const int*,
+                                        const int*, const double*, int,
+                                        double*);
+template void PredictCandidates<float>(const ModelParam&,
+                                       const CandidateContext&, const int*,
+                                       const int*, const float*, int,
+                                       double*);
+
+}  // namespace row
+}  // namespace fastfm
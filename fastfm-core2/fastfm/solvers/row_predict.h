@@ -0,0 +1,68 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_SOLVERS_ROW_PREDICT_H_
+#define FASTFM_CORE2_FASTFM_SOLVERS_ROW_PREDICT_H_
+
+#include <vector>
+
+#include "fastfm_impl.h"
+
+namespace fastfm {
+namespace row {
+
+// Per rank sums over a set of non-zeros, q = sum_k v_k x_k,
+// s2 = sum_k (v_k x_k)^2 and s3 = sum_k (v_k x_k)^3.
+struct FactorSums {
+  std::vector<double> q;
+  std::vector<double> s2;
+  std::vector<double> s3;
+};
+
+// Everything the candidates of one request share with the context.
+struct CandidateContext {
+  double base = 0;  // w0 + linear term of the context
+  FactorSums w2;
+  FactorSums w3;
+};
+
+// Prediction of a single sample given by the feature indices `idx` and
+// values `val` of its non-zeros. Reads the quantized copy if present.
+// Allocates no memory.
+template<typename T>
+double PredictRow(const ModelParam& coef,
+                  const int* idx, const T* val, int nnz);
+
+// Predictions of the CSR rows [0, n_rows), row i spans
+// [indptr[i], indptr[i + 1]) of idx and val.
+template<typename T>
+void PredictRows(const ModelParam& coef, const int* indptr,
+                 const int* idx, const T* val, int n_rows, double* out);
+
+// Computes the context part of a candidate request once.
+template<typename T>
+void PrecomputeContext(const ModelParam& coef, const int* idx, const T* val,
+                       int nnz, CandidateContext* context);
+
+// Predictions of the context concatenated with each CSR candidate row,
+// only the candidate non-zeros are visited. Allocates no memory.
+template<typename T>
+void PredictCandidates(const ModelParam& coef, const CandidateContext& context,
+                       const int* indptr, const int* idx, const T* val,
+                       int n_candidates, double* out);
+
+}  // namespace row
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_SOLVERS_ROW_PREDICT_H_
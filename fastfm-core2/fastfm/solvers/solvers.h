@@ -16,6 +16,9 @@
 #define FASTFM_CORE2_FASTFM_SOLVERS_SOLVERS_H_
 
 #include <Eigen/Core>
+#include <string>
+#include <vector>
+
 #include "fastfm.h"
 #include "fastfm_impl.h"
 
@@ -23,7 +26,7 @@ namespace fastfm {
 namespace cd {
 #define CD
 
-void Predict(Model* m, Data* d);
+void Predict(const Model* m, Data* d);
 
 void FitSquareLoss(Data* d,
                    Model* m,
@@ -33,6 +36,16 @@ void FitSquareLoss(Data* d,
 
 void FitSquareLoss(Data* d, Model* m, Settings* s);
 
+// k-fold cross-validation on the shared design matrix, see
+// `fastfm::cross_validate`.
+std::vector<double> CrossValidate(Data* d, const Model* m, Settings* s,
+                                  int n_folds, int n_threads);
+
+// Weighted mean of the squared error (loss `logistic`: log loss with
+// labels > 0 as positive class), unweighted for an empty weight.
+double MeanLoss(const std::string& loss, constVectorRef y_true,
+                constVectorRef y_pred, constVectorRef weight);
+
 }  // namespace cd
 
 // todo: add more solvers here for release =)
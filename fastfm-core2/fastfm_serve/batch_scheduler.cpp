@@ -0,0 +1,144 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "batch_scheduler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <utility>
+
+#include "solvers/numa.h"
+#include "solvers/parallel.h"
+
+namespace fastfm {
+namespace serve {
+
+BatchScheduler::BatchScheduler(SharedModel* model,
+                               const SchedulerOptions& options)
+    : model_(model), options_(options), start_(clock::now()), n_batches_(0) {
+  options_.max_batch = std::max(1, options_.max_batch);
+  options_.n_threads = std::max(1, options_.n_threads);
+  cpus_ = numa::WorkerCpus(options_.thread_affinity, options_.n_threads);
+  worker_ = std::thread(&BatchScheduler::run, this);
+}
+
+BatchScheduler::~BatchScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+}
+
+std::future<double> BatchScheduler::submit(std::vector<int> idx,
+                                           std::vector<double> val) {
+  Request request;
+  request.idx = std::move(idx);
+  request.val = std::move(val);
+  request.arrival = clock::now();
+  std::future<double> result = request.result.get_future();
+  bool wake;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(request));
+    // The worker only waits for the first request of a batch or for a
+    // full batch.
+    wake = queue_.size() == 1
+        || queue_.size() >= static_cast<size_t>(options_.max_batch);
+  }
+  if (wake) cv_.notify_one();
+  return result;
+}
+
+void BatchScheduler::run() {
+  // The worker scores as thread 0 of every batch.
+  numa::ScopedPin pin(cpus_.empty() ? -1 : cpus_[0]);
+  std::vector<Request> batch;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) return;  // stopped and drained
+
+      const clock::time_point deadline = queue_.front().arrival
+          + std::chrono::microseconds(options_.max_delay_us);
+      cv_.wait_until(lock, deadline, [this]() {
+        return stop_
+            || queue_.size() >= static_cast<size_t>(options_.max_batch);
+      });
+
+      const size_t n = std::min(queue_.size(),
+                                static_cast<size_t>(options_.max_batch));
+      batch.clear();
+      for (size_t i = 0; i < n; ++i) {
+        batch.push_back(std::move(queue_.front()));
+        queue_.pop_front();
+      }
+    }
+    score(&batch);
+  }
+}
+
+void BatchScheduler::score(std::vector<Request>* batch) {
+  const int n_rows = batch->size();
+  indptr_.assign(1, 0);
+  idx_.clear();
+  val_.clear();
+  for (const Request& request : *batch) {
+    idx_.insert(idx_.end(), request.idx.begin(), request.idx.end());
+    val_.insert(val_.end(), request.val.begin(), request.val.end());
+    indptr_.push_back(idx_.size());
+  }
+  out_.resize(n_rows);
+
+  std::shared_ptr<const Model> model = model_->load();
+  const int n_tasks = std::min(options_.n_threads, n_rows);
+  parallel::ParallelFor(cpus_, options_.n_threads, n_tasks, [&](int task) {
+    const int begin = static_cast<int64_t>(n_rows) * task / n_tasks;
+    const int end = static_cast<int64_t>(n_rows) * (task + 1) / n_tasks;
+    predict_rows(*model, indptr_.data() + begin, idx_.data(), val_.data(),
+                 end - begin, out_.data() + begin);
+  });
+
+  // Statistics first, they are complete once a client has its result.
+  const clock::time_point now = clock::now();
+  for (const Request& request : *batch)
+    latency_.record(std::chrono::duration<double, std::micro>(
+        now - request.arrival).count());
+  batch_size_.record(n_rows);
+  n_batches_.fetch_add(1);
+  for (int i = 0; i < n_rows; ++i) (*batch)[i].result.set_value(out_[i]);
+}
+
+std::string BatchScheduler::stats() const {
+  const double seconds =
+      std::chrono::duration<double>(clock::now() - start_).count();
+  char line[512];
+  std::snprintf(line, sizeof(line),
+                "requests=%llu batches=%llu batch_p50=%.0f batch_max=%.0f "
+                "throughput_rps=%.1f latency_us_p50=%.0f latency_us_p90=%.0f "
+                "latency_us_p99=%.0f latency_us_max=%.0f",
+                static_cast<unsigned long long>(latency_.count()),
+                static_cast<unsigned long long>(n_batches()),
+                batch_size_.percentile(0.5), batch_size_.max(),
+                seconds > 0 ? latency_.count() / seconds : 0.,
+                latency_.percentile(0.5), latency_.percentile(0.9),
+                latency_.percentile(0.99), latency_.max());
+  return line;
+}
+
+}  // namespace serve
+}  // namespace fastfm
@@ -0,0 +1,108 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_SERVE_BATCH_SCHEDULER_H_
+#define FASTFM_CORE2_FASTFM_SERVE_BATCH_SCHEDULER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fastfm.h"
+#include "histogram.h"
+
+namespace fastfm {
+namespace serve {
+
+struct SchedulerOptions {
+  int max_batch = 64;       // rows per micro-batch
+  int max_delay_us = 500;   // max. time the first request of a batch waits
+  int n_threads = 1;        // threads scoring one batch
+  // `none`, `compact` or `scatter` pinning of the scoring threads.
+  std::string thread_affinity = "none";
+};
+
+/** @brief Coalesces concurrent single row requests into micro-batches.
+ *
+ * A batch is scored as soon as it holds `max_batch` rows or its oldest
+ * request has waited `max_delay_us`. Batches are scored with
+ * `predict_rows` on the snapshot that is current when the batch starts.
+ */
+class BatchScheduler {
+ public:
+  BatchScheduler(SharedModel* model, const SchedulerOptions& options);
+  // Scores the pending requests, then stops the worker.
+  ~BatchScheduler();
+
+  std::future<double> submit(std::vector<int> idx, std::vector<double> val);
+
+  // Time from submit to result, microseconds.
+  const Histogram& latency() const { return latency_; }
+  // Rows per scored batch.
+  const Histogram& batch_size() const { return batch_size_; }
+  uint64_t n_batches() const { return n_batches_.load(); }
+
+  // One line summary: requests, batches, throughput and latency percentiles.
+  std::string stats() const;
+
+ private:
+  typedef std::chrono::steady_clock clock;
+
+  struct Request {
+    std::vector<int> idx;
+    std::vector<double> val;
+    std::promise<double> result;
+    clock::time_point arrival;
+  };
+
+  void run();
+  void score(std::vector<Request>* batch);
+
+  BatchScheduler(const BatchScheduler&) = delete;
+  BatchScheduler& operator=(const BatchScheduler&) = delete;
+
+  SharedModel* model_;
+  SchedulerOptions options_;
+  // CPU of each scoring thread, empty if unpinned.
+  std::vector<int> cpus_;
+  clock::time_point start_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Request> queue_;
+  bool stop_ = false;
+
+  // CSR buffers of the current batch, reused across batches.
+  std::vector<int> indptr_;
+  std::vector<int> idx_;
+  std::vector<double> val_;
+  std::vector<double> out_;
+
+  Histogram latency_;
+  Histogram batch_size_;
+  std::atomic<uint64_t> n_batches_;
+
+  std::thread worker_;
+};
+
+}  // namespace serve
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_SERVE_BATCH_SCHEDULER_H_
@@ -0,0 +1,90 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_SERVE_HISTOGRAM_H_
+#define FASTFM_CORE2_FASTFM_SERVE_HISTOGRAM_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+namespace fastfm {
+namespace serve {
+
+/** @brief Lock free histogram with logarithmic buckets.
+ *
+ * Each power of two is split into kSubBuckets buckets, the relative error
+ * of a reported percentile is below 2^(1 / kSubBuckets) - 1 (~19%).
+ * Values below 1 are counted in the first bucket, the maximum is tracked
+ * with integer precision.
+ */
+class Histogram {
+ public:
+  static const int kSubBuckets = 4;
+  static const int kBuckets = 64 * kSubBuckets;
+
+  Histogram() {
+    for (auto& bucket : buckets_) bucket.store(0);
+    count_.store(0);
+    max_.store(0);
+  }
+
+  void record(double value) {
+    buckets_[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    uint64_t v = static_cast<uint64_t>(value);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (v > max && !max_.compare_exchange_weak(max, v)) {}
+  }
+
+  uint64_t count() const { return count_.load(); }
+
+  double max() const { return max_.load(); }
+
+  // Upper bound of the bucket that contains the p-quantile, p in [0, 1],
+  // capped at the maximum.
+  double percentile(double p) const {
+    const uint64_t n = count();
+    if (n == 0) return 0;
+    const uint64_t rank = static_cast<uint64_t>(std::ceil(p * n));
+    uint64_t seen = 0;
+    int b = 0;
+    for (; b < kBuckets - 1; ++b) {
+      seen += buckets_[b].load(std::memory_order_relaxed);
+      if (seen >= rank && seen > 0) break;
+    }
+    return std::min(upper_bound(b), static_cast<double>(max_.load()));
+  }
+
+ private:
+  static int bucket(double value) {
+    if (!(value >= 1)) return 0;
+    const int b = static_cast<int>(std::log2(value) * kSubBuckets) + 1;
+    return b < kBuckets ? b : kBuckets - 1;
+  }
+
+  static double upper_bound(int b) {
+    return std::exp2(static_cast<double>(b) / kSubBuckets);
+  }
+
+  std::atomic<uint64_t> buckets_[kBuckets];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> max_;
+};
+
+}  // namespace serve
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_SERVE_HISTOGRAM_H_
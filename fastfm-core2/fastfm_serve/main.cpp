@@ -0,0 +1,281 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Local inference server for models written by `Model::save`.
+//
+// usage: fastfm_serve --model <path> [--port <port> | --unix <path>]
+//                     [--max_batch 64] [--max_delay_us 500] [--threads 1]
+//
+// Listens on 127.0.0.1:<port> (default 7878) or a Unix socket and speaks
+// the line protocol described in protocol.h.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch_scheduler.h"
+#include "fastfm.h"
+#include "fastfm_impl.h"
+#include "model_loader.h"
+#include "protocol.h"
+
+#define LOGURU_REPLACE_GLOG 1
+#include "../3rdparty/loguru/loguru.hpp"
+
+namespace fastfm {
+namespace serve {
+namespace {
+
+struct ServerOptions {
+  std::string model_path;
+  int port = 7878;
+  std::string unix_path;
+  SchedulerOptions scheduler;
+};
+
+void Usage() {
+  std::fprintf(stderr,
+               "usage: fastfm_serve --model <path> [--port <port> | "
+               "--unix <path>] [--max_batch 64] [--max_delay_us 500] "
+               "[--threads 1] [--affinity none|compact|scatter]\n");
+  std::exit(1);
+}
+
+ServerOptions ParseArgs(int argc, char** argv) {
+  ServerOptions options;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (i + 1 >= argc) Usage();
+    const char* value = argv[++i];
+    if (arg == "--model") {
+      options.model_path = value;
+    } else if (arg == "--port") {
+      options.port = std::atoi(value);
+    } else if (arg == "--unix") {
+      options.unix_path = value;
+    } else if (arg == "--max_batch") {
+      options.scheduler.max_batch = std::atoi(value);
+    } else if (arg == "--max_delay_us") {
+      options.scheduler.max_delay_us = std::atoi(value);
+    } else if (arg == "--threads") {
+      options.scheduler.n_threads = std::atoi(value);
+    } else if (arg == "--affinity") {
+      options.scheduler.thread_affinity = value;
+    } else {
+      Usage();
+    }
+  }
+  if (options.model_path.empty()) Usage();
+  return options;
+}
+
+std::shared_ptr<const Model> LoadModel(const std::string& path) {
+  std::string error;
+  std::shared_ptr<const Model> model = TryLoadModel(path, &error);
+  CHECK(model != nullptr) << error;
+  return model;
+}
+
+int NumFeatures(const Model& model) {
+  return Internal::get_impl(&model)->coef_->getw1().size();
+}
+
+class Server {
+ public:
+  explicit Server(const ServerOptions& options)
+      : options_(options),
+        model_(LoadModel(options.model_path)),
+        n_features_(NumFeatures(*model_.load())),
+        scheduler_(&model_, options.scheduler) {}
+
+  void serve(int listen_fd) {
+    while (true) {
+      const int fd = accept(listen_fd, NULL, NULL);
+      if (fd < 0) {
+        if (errno == EINTR) continue;
+        LOG(ERROR) << "accept failed: " << std::strerror(errno);
+        continue;
+      }
+      std::thread(&Server::handle, this, fd).detach();
+    }
+  }
+
+ private:
+  // Response to one request line. Rows are only submitted, the
+  // prediction is formatted once `prediction` is ready.
+  struct Pending {
+    std::string response;
+    std::future<double> prediction;
+  };
+
+  static bool IsCommand(const std::string& line) {
+    return line == "STATS" || line == "RELOAD";
+  }
+
+  std::string command(const std::string& line) {
+    if (line == "STATS") return scheduler_.stats();
+    // RELOAD
+    std::lock_guard<std::mutex> lock(reload_mutex_);
+    std::string error;
+    std::shared_ptr<const Model> model =
+        TryLoadModel(options_.model_path, &error);
+    // Keep serving the current model if the file is broken.
+    if (model == nullptr) return "ERR " + error;
+    // Rows queued by other connections were checked against n_features_,
+    // scoring them with a narrower model would read out of bounds.
+    if (NumFeatures(*model) != n_features_) {
+      return "ERR model has " + std::to_string(NumFeatures(*model))
+          + " features, served model has " + std::to_string(n_features_);
+    }
+    model_.store(model);
+    return "OK";
+  }
+
+  Pending dispatch(const std::string& line) {
+    Pending pending;
+    if (IsCommand(line)) {
+      pending.response = command(line);
+      return pending;
+    }
+    std::vector<int> idx;
+    std::vector<double> val;
+    std::string error;
+    if (ParseRow(line, n_features_, &idx, &val, &error))
+      pending.prediction = scheduler_.submit(std::move(idx), std::move(val));
+    else
+      pending.response = "ERR " + error;
+    return pending;
+  }
+
+  static void flush(std::vector<Pending>* pending, std::string* responses) {
+    for (Pending& item : *pending) {
+      if (item.prediction.valid())
+        item.response = FormatPrediction(item.prediction.get());
+      *responses += item.response + "\n";
+    }
+    pending->clear();
+  }
+
+  void handle(int fd) {
+    std::string buffer;
+    char chunk[4096];
+    while (true) {
+      const ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) break;
+      buffer.append(chunk, n);
+
+      // Submit all complete rows before waiting, pipelined rows of a
+      // client share micro-batches.
+      std::vector<Pending> pending;
+      std::string responses;
+      size_t begin = 0;
+      size_t end;
+      while ((end = buffer.find('\n', begin)) != std::string::npos) {
+        const std::string line = buffer.substr(begin, end - begin);
+        // Commands see the effect of the rows before them.
+        if (IsCommand(line)) flush(&pending, &responses);
+        pending.push_back(dispatch(line));
+        begin = end + 1;
+      }
+      flush(&pending, &responses);
+      buffer.erase(0, begin);
+      if (buffer.size() > kMaxLineBytes) {
+        write_all(fd, responses + "ERR request line too long\n");
+        break;
+      }
+      if (!write_all(fd, responses)) break;
+    }
+    close(fd);
+  }
+
+  static bool write_all(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+      const ssize_t n = send(fd, data.data() + sent, data.size() - sent, 0);
+      if (n <= 0) return false;
+      sent += n;
+    }
+    return true;
+  }
+
+  ServerOptions options_;
+  SharedModel model_;
+  // Fixed for the lifetime of the server, RELOAD keeps it.
+  const int n_features_;
+  std::mutex reload_mutex_;
+  BatchScheduler scheduler_;
+};
+
+int Listen(const ServerOptions& options) {
+  int fd;
+  if (!options.unix_path.empty()) {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK(fd >= 0) << "socket failed";
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    CHECK_LT(options.unix_path.size(), sizeof(addr.sun_path))
+    << "Unix socket path too long";
+    std::strcpy(addr.sun_path, options.unix_path.c_str());  // NOLINT
+    unlink(options.unix_path.c_str());
+    CHECK(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+    << "Can't bind " << options.unix_path;
+  } else {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(fd >= 0) << "socket failed";
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(options.port);
+    CHECK(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+    << "Can't bind port " << options.port;
+  }
+  CHECK(listen(fd, 128) == 0) << "listen failed";
+  return fd;
+}
+
+}  // namespace
+}  // namespace serve
+}  // namespace fastfm
+
+int main(int argc, char** argv) {
+  using fastfm::serve::ServerOptions;
+  const ServerOptions options = fastfm::serve::ParseArgs(argc, argv);
+  signal(SIGPIPE, SIG_IGN);
+
+  fastfm::serve::Server server(options);
+  const int fd = fastfm::serve::Listen(options);
+  LOG(INFO) << "fastfm_serve: serving " << options.model_path << " on "
+            << (options.unix_path.empty() ? std::to_string(options.port)
+                                          : options.unix_path);
+  server.serve(fd);
+  return 0;
+}
@@ -0,0 +1,28 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "model_loader.h"
+
+namespace fastfm {
+namespace serve {
+
+std::shared_ptr<const Model> TryLoadModel(const std::string& path,
+                                          std::string* error) {
+  // Serves from the mapping, the parameters are not copied.
+  return Model::open_snapshot(path, error);
+}
+
+}  // namespace serve
+}  // namespace fastfm
@@ -0,0 +1,36 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef FASTFM_CORE2_FASTFM_SERVE_MODEL_LOADER_H_
+#define FASTFM_CORE2_FASTFM_SERVE_MODEL_LOADER_H_
+
+#include <memory>
+#include <string>
+
+#include "fastfm.h"
+
+namespace fastfm {
+namespace serve {
+
+// Loads a snapshot of the model file at path. Returns nullptr and sets
+// error if the file is missing, truncated or otherwise corrupt, e.g.
+// while it is being rewritten.
+std::shared_ptr<const Model> TryLoadModel(const std::string& path,
+                                          std::string* error);
+
+}  // namespace serve
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_SERVE_MODEL_LOADER_H_
@@ -0,0 +1,64 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "protocol.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+namespace fastfm {
+namespace serve {
+
+bool ParseRow(const std::string& line, int n_features,
+              std::vector<int>* idx, std::vector<double>* val,
+              std::string* error) {
+  idx->clear();
+  val->clear();
+  const char* p = line.c_str();
+  while (true) {
+    while (*p == ' ' || *p == '\t' || *p == '\r') ++p;
+    if (*p == '\0') return true;
+
+    char* end;
+    errno = 0;
+    const long j = std::strtol(p, &end, 10);  // NOLINT
+    if (end == p || *end != ':' || errno != 0) {
+      *error = "expected <idx>:<val>";
+      return false;
+    }
+    if (j < 0 || j >= n_features) {
+      *error = "feature index out of range";
+      return false;
+    }
+    p = end + 1;
+    const double x = std::strtod(p, &end);
+    if (end == p || errno != 0) {
+      *error = "invalid value";
+      return false;
+    }
+    p = end;
+    idx->push_back(static_cast<int>(j));
+    val->push_back(x);
+  }
+}
+
+std::string FormatPrediction(double prediction) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.17g", prediction);
+  return buffer;
+}
+
+}  // namespace serve
+}  // namespace fastfm
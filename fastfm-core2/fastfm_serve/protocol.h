@@ -0,0 +1,51 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FASTFM_CORE2_FASTFM_SERVE_PROTOCOL_H_
+#define FASTFM_CORE2_FASTFM_SERVE_PROTOCOL_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace fastfm {
+namespace serve {
+
+// Line protocol, one request per line, one response line per request:
+//   `<idx>:<val> <idx>:<val> ...`  ->  `<prediction>`
+//   `STATS`                        ->  `requests=... latency_us_p99=...`
+//   `RELOAD`                       ->  `OK` after the model file is reloaded
+// Malformed requests are answered with `ERR <reason>`, as is a `RELOAD`
+// of a missing or corrupt file or of a model with a different number of
+// features, the previous model is served further.
+// The served model maps its file, replace the file by renaming a new one
+// over it (as `Model::save` does) rather than rewriting it in place.
+// Connections that send more than kMaxLineBytes without a newline are
+// answered with `ERR` and closed.
+
+const size_t kMaxLineBytes = 1 << 20;
+
+// Parses the non-zeros of a request line. Returns false and sets error if
+// the line is malformed or an index is outside [0, n_features).
+bool ParseRow(const std::string& line, int n_features,
+              std::vector<int>* idx, std::vector<double>* val,
+              std::string* error);
+
+// Formats a prediction with round trip precision.
+std::string FormatPrediction(double prediction);
+
+}  // namespace serve
+}  // namespace fastfm
+
+#endif  // FASTFM_CORE2_FASTFM_SERVE_PROTOCOL_H_
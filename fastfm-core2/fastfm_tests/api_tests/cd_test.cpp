@@ -14,10 +14,21 @@
 
 #include <Eigen/Dense>
 
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "../3rdparty/catch/catch.hpp"
 
 #include "fastfm.h"
 #include "fixture.h"
+#include "datasets.h"
+#include "sample_order.h"
+#include "solvers/cd_impl.h"
+#include "solvers/compressed_index.h"
+#include "solvers/coordinate_order.h"
+#include "solvers/solvers.h"
 
 using Matrix = Eigen::Matrix<double,
                              Eigen::Dynamic,
@@ -108,3 +119,1056 @@ TEST_CASE_METHOD(FMExample, "FMExample fit", "[API]") {
   delete m;
   delete s;
 }
+
+TEST_CASE_METHOD(FMExample, "FMExample fit reordered samples", "[API]") {
+  // Reordering the samples must not change the solution (up to rounding).
+  Vector y_true(4);
+  y_true << 1, 2, 3, 4;
+  Vector y_pred = Vector::Zero(x_.rows());
+
+  Vector w1_ref = w1_;
+  Matrix w2_ref = w2_;
+  double w0_ref = w0_;
+
+  std::map<std::string, std::string> settings_ = {
+      {"solver", "cd"},
+      {"loss", "squared"},
+      {"iter", "10"},
+      {"l2_reg_w1", "1"},
+      {"l2_reg_w2", "1"}
+  };
+  Settings* s = new Settings(settings_);
+
+  auto d_ref = fastfm::DataFactory(x_, &y_pred, &y_true).get();
+  auto m_ref = fastfm::ModelFactory(&w0_ref, w1_ref, w2_ref).get();
+  fit(s, m_ref, d_ref);
+
+  auto d = fastfm::DataFactory(x_, &y_pred, &y_true).get();
+  d->reorder_samples("rcm");
+  auto m = fastfm::ModelFactory(&w0_, w1_, w2_).get();
+  fit(s, m, d);
+
+  REQUIRE(Approx(w0_) == w0_ref);
+  for (int j = 0; j < w1_.size(); ++j)
+    REQUIRE(Approx(w1_.coeff(j)) == w1_ref.coeff(j));
+  for (int j = 0; j < w2_.size(); ++j)
+    REQUIRE(Approx(w2_.data()[j]) == w2_ref.data()[j]);
+
+  // Predictions are returned in the original sample order.
+  Vector y_pred_ref = Vector::Zero(x_.rows());
+  auto d_pred_ref = fastfm::DataFactory(x_, &y_pred_ref).get();
+  predict(m_ref, d_pred_ref);
+  predict(m, d);
+  for (int i = 0; i < y_pred.size(); ++i)
+    REQUIRE(Approx(y_pred.coeff(i)) == y_pred_ref.coeff(i));
+
+  delete d_pred_ref;
+  delete d_ref;
+  delete m_ref;
+  delete d;
+  delete m;
+  delete s;
+}
+
+TEST_CASE_METHOD(FMExample, "FMExample fit feature major w2", "[API]") {
+  Vector y_true = Vector::Ones(x_.rows());
+  Vector y_pred = Vector::Zero(x_.rows());
+  auto d = fastfm::DataFactory(x_, &y_pred, &y_true).get();
+
+  w2_.setRandom();
+  const Matrix w2_init = w2_;
+  auto m = fastfm::ModelFactory(&w0_, w1_, w2_).get();
+
+  // Both layouts predict the same values.
+  Vector y_ref = Vector::Zero(x_.rows());
+  fastfm::cd::impl::Predict(x_, w2_, w1_, w0_, y_ref);
+  const Matrix w2t = w2_.transpose();
+  fastfm::cd::impl::PredictFeatureMajor(x_, w2t, w1_, w0_, y_pred);
+  for (int i = 0; i < y_ref.size(); ++i)
+    REQUIRE(Approx(y_pred.coeff(i)) == y_ref.coeff(i));
+  const double init_train_error = (y_pred - y_true).norm();
+
+  std::map<std::string, std::string> settings_ = {
+      {"solver", "cd"},
+      {"loss", "squared"},
+      {"w2_layout", "feature_major"}
+  };
+  Settings* s = new Settings(settings_);
+  fit(s, m, d);
+
+  // The working copy is written back to the caller memory.
+  REQUIRE_FALSE(fastfm::Internal::get_impl(m)->coef_->is_w2_feature_major());
+  REQUIRE_FALSE(w2_init.isApprox(w2_));
+
+  predict(m, d);
+  REQUIRE((y_pred - y_true).norm() < init_train_error);
+
+  delete d;
+  delete m;
+  delete s;
+}
+
+TEST_CASE("CoordinateOrder greedy", "[coordinate_order]") {
+  fastfm::SolverSettings settings;
+  settings.coord_order = "greedy";
+  settings.coord_fraction = 0.5;
+  fastfm::cd::CoordinateOrder coords(settings, 1, 4);
+
+  // Unseen coordinates are visited first.
+  coords.next_epoch();
+  REQUIRE(coords.order(0).size() == 2);
+  coords.report(0, 0, 0.1);
+  coords.report(0, 1, -3);
+  coords.report(0, 2, 2);
+  coords.report(0, 3, 0);
+
+  coords.next_epoch();
+  const std::vector<int> expected = {1, 2};
+  REQUIRE(coords.order(0) == expected);
+}
+
+TEST_CASE_METHOD(FMExample, "FMExample fit coordinate orders", "[API]") {
+  for (const std::string order : {"random", "greedy"}) {
+    Vector y_true = Vector::Ones(x_.rows());
+    Vector y_pred = Vector::Zero(x_.rows());
+    Vector w1 = w1_;
+    Matrix w2 = w2_;
+    double w0 = w0_;
+    auto d = fastfm::DataFactory(x_, &y_pred, &y_true).get();
+    auto m = fastfm::ModelFactory(&w0, w1, w2).get();
+
+    predict(m, d);
+    const double init_train_error = (y_pred - y_true).norm();
+
+    std::map<std::string, std::string> settings_ = {
+        {"solver", "cd"},
+        {"loss", "squared"},
+        {"coord_order", order},
+        {"coord_fraction", "0.7"}
+    };
+    Settings* s = new Settings(settings_);
+    fit(s, m, d);
+
+    predict(m, d);
+    REQUIRE((y_pred - y_true).norm() < init_train_error);
+
+    delete d;
+    delete m;
+    delete s;
+  }
+}
+
+TEST_CASE("CoordinateOrder shrinking", "[coordinate_order]") {
+  fastfm::SolverSettings settings;
+  settings.shrink_tol = 0.01;
+  settings.shrink_patience = 2;
+  settings.shrink_check_every = 3;
+  fastfm::cd::CoordinateOrder coords(settings, 1, 3);
+
+  // Coordinate 1 stalls for two consecutive epochs.
+  for (int epoch = 0; epoch < 2; ++epoch) {
+    coords.next_epoch();
+    REQUIRE(coords.order(0).size() == 3);
+    for (int j : coords.order(0)) coords.report(0, j, j == 1 ? 0.001 : 1);
+  }
+
+  coords.next_epoch();
+  const std::vector<int> active = {0, 2};
+  REQUIRE(coords.order(0) == active);
+  for (int j : coords.order(0)) coords.report(0, j, 1);
+
+  // Verification sweep, coordinate 1 moves again and rejoins.
+  coords.next_epoch();
+  REQUIRE(coords.is_verification_epoch());
+  REQUIRE(coords.order(0).size() == 3);
+  for (int j : coords.order(0)) coords.report(0, j, 1);
+
+  coords.next_epoch();
+  REQUIRE(coords.order(0).size() == 3);
+}
+
+TEST_CASE_METHOD(FMExample, "FMExample fit active set shrinking", "[API]") {
+  Vector y_true = Vector::Ones(x_.rows());
+  Vector y_pred = Vector::Zero(x_.rows());
+  auto d = fastfm::DataFactory(x_, &y_pred, &y_true).get();
+  auto m = fastfm::ModelFactory(&w0_, w1_, w2_).get();
+
+  predict(m, d);
+  const double init_train_error = (y_pred - y_true).norm();
+
+  std::map<std::string, std::string> settings_ = {
+      {"solver", "cd"},
+      {"loss", "squared"},
+      {"shrink_tol", "1e-4"},
+      {"shrink_patience", "2"},
+      {"shrink_check_every", "5"}
+  };
+  Settings* s = new Settings(settings_);
+  fit(s, m, d);
+
+  predict(m, d);
+  REQUIRE((y_pred - y_true).norm() < init_train_error);
+
+  delete d;
+  delete m;
+  delete s;
+}
+
+TEST_CASE("Fit layer parallel", "[API]") {
+  fastfm::utils::DataGenerator generator(200, {2, 5, 10}, {1, 1, 4});
+  SpMat x = generator.x_csc();
+  Vector y_true = generator.y_reg(0.1);
+
+  std::vector<double> train_error;
+  for (const std::string n_threads : {"1", "4"}) {
+    Vector y_pred = Vector::Zero(x.rows());
+    double w0 = 0;
+    Vector w1 = Vector::Zero(x.cols());
+    Matrix w2 = Matrix::Random(4, x.cols()) * .1;
+    auto d = fastfm::DataFactory(x, &y_pred, &y_true).get();
+    auto m = fastfm::ModelFactory(&w0, w1, w2).get();
+
+    std::map<std::string, std::string> settings_ = {
+        {"solver", "cd"},
+        {"loss", "squared"},
+        {"iter", "20"},
+        {"l2_reg_w1", "0.1"},
+        {"l2_reg_w2", "0.1"},
+        {"n_threads", n_threads}
+    };
+    Settings* s = new Settings(settings_);
+    fit(s, m, d);
+    predict(m, d);
+    train_error.push_back((y_pred - y_true).norm() / y_true.norm());
+
+    delete d;
+    delete m;
+    delete s;
+  }
+  // The damped concurrent updates converge slower but still converge.
+  REQUIRE(train_error[0] < 0.01);
+  REQUIRE(train_error[1] < 0.05);
+}
+
+TEST_CASE("Fit group l2 regularization", "[API]") {
+  fastfm::utils::DataGenerator generator(100, {2, 5, 10}, {1, 1, 3});
+  SpMat x = generator.x_csc();
+  Vector y = generator.y_reg(.1);
+  const int n_features = x.cols();
+  Vector feature_group(n_features);
+  for (int j = 0; j < n_features; ++j)
+    feature_group(j) = j < n_features / 2 ? 0 : 1;
+
+  auto fit_model = [&](const std::map<std::string, std::string>& extra,
+                       bool grouped, Vector* w1, Matrix* w2) {
+    double w0 = 0;
+    *w1 = Vector::Zero(n_features);
+    *w2 = .1 * Matrix::Ones(3, n_features);
+    Model* m = fastfm::ModelFactory(&w0, *w1, *w2).get();
+    Vector y_pred = Vector::Zero(x.rows());
+    Data* d = fastfm::DataFactory(x, &y_pred, &y).get();
+    if (grouped)
+      d->add_vector("feature_group", feature_group.data(), n_features);
+    std::map<std::string, std::string> settings_map = {
+        {"solver", "cd"}, {"loss", "squared"}, {"iter", "10"},
+        {"l2_reg_w1", "0.1"}, {"l2_reg_w2", "0.1"}};
+    settings_map.insert(extra.begin(), extra.end());
+    Settings* s = new Settings(settings_map);
+    fit(s, m, d);
+    delete s;
+    delete d;
+    delete m;
+  };
+
+  Vector w1_ref;
+  Matrix w2_ref;
+  fit_model({}, false, &w1_ref, &w2_ref);
+
+  // Group penalties equal to the global ones don't change the fit.
+  Vector w1;
+  Matrix w2;
+  fit_model({{"group_l2_reg_w1", "0.1,0.1"}, {"group_l2_reg_w2", "0.1,0.1"}},
+            true, &w1, &w2);
+  REQUIRE(w1.isApprox(w1_ref));
+  REQUIRE(w2.isApprox(w2_ref));
+
+  // A large penalty switches the second group off.
+  fit_model({{"group_l2_reg_w1", "0.1,1e12"}, {"group_l2_reg_w2", "0.1,1e12"}},
+            true, &w1, &w2);
+  const int half = n_features / 2;
+  REQUIRE(w1.tail(n_features - half).lpNorm<Eigen::Infinity>() < 1e-6);
+  REQUIRE(w2.rightCols(n_features - half).lpNorm<Eigen::Infinity>() < 1e-6);
+  REQUIRE(w1.head(half).norm() > .1);
+}
+
+TEST_CASE("Fit regularization path", "[API]") {
+  fastfm::utils::DataGenerator generator(400, {20, 50, 100}, {1, 1, 3});
+  SpMat x_all = generator.x_csc();
+  Vector y_all = generator.y_reg(.5);
+  SpMat x = x_all.topRows(300);
+  Vector y = y_all.head(300);
+  SpMat x_valid = x_all.bottomRows(100);
+  Vector y_valid = y_all.tail(100);
+
+  double w0 = 0;
+  Vector w1 = Vector::Zero(x.cols());
+  Matrix w2 = .1 * Matrix::Random(3, x.cols());
+  Model* m = fastfm::ModelFactory(&w0, w1, w2).get();
+  Vector y_pred = Vector::Zero(x.rows());
+  Data* d = fastfm::DataFactory(x, &y_pred, &y).get();
+  Vector y_valid_pred = Vector::Zero(x_valid.rows());
+  Data* d_valid = fastfm::DataFactory(x_valid, &y_valid_pred,
+                                      &y_valid).get();
+
+  std::map<std::string, std::string> settings_map = {
+      {"solver", "cd"}, {"loss", "squared"}, {"iter", "20"},
+      {"l2_reg_w1", "0.5"}, {"l2_reg_w2", "0.5"}};
+  Settings* s = new Settings(settings_map);
+  const std::vector<double> l2_regs = {100, 10, 1, .1, .01};
+
+  fastfm::RegularizationPath path =
+      fit_path(s, m, d, l2_regs, d_valid, true);
+  REQUIRE(path.points.size() == l2_regs.size());
+  for (const fastfm::PathPoint& point : path.points) {
+    REQUIRE(point.model != nullptr);
+    REQUIRE(std::isfinite(point.validation_error));
+  }
+  REQUIRE(path.best >= 0);
+  for (const fastfm::PathPoint& point : path.points)
+    REQUIRE(path.points[path.best].validation_error
+                <= point.validation_error);
+  // The strongest penalty underfits.
+  REQUIRE(path.points[path.best].validation_error
+              < path.points[0].validation_error);
+  // The settings are restored.
+  REQUIRE(fastfm::Internal::get_impl(s)->settings_.l2_reg_w1 == .5);
+  REQUIRE(fastfm::Internal::get_impl(s)->settings_.iter == 20);
+
+  // The snapshot of a point scores like the model it was taken from.
+  predict(path.points.back().model.get(), d_valid);
+  const double rmse = (y_valid - y_valid_pred).norm()
+      / std::sqrt(y_valid.size());
+  REQUIRE(rmse == Approx(path.points.back().validation_error));
+
+  // Without keep_all only the best model is kept.
+  path = fit_path(s, m, d, l2_regs, d_valid, false);
+  for (int k = 0; k < static_cast<int>(path.points.size()); ++k)
+    REQUIRE((path.points[k].model != nullptr) == (k == path.best));
+
+  delete s;
+  delete d;
+  delete d_valid;
+  delete m;
+}
+
+TEST_CASE("Cross validation", "[API]") {
+  fastfm::utils::DataGenerator generator(400, {20, 50, 100}, {1, 1, 3});
+  SpMat x = generator.x_csc();
+  Vector y = generator.y_reg(.5);
+  std::map<std::string, std::string> settings_map = {
+      {"solver", "cd"}, {"loss", "squared"}, {"iter", "10"},
+      {"l2_reg_w1", "0.5"}, {"l2_reg_w2", "0.5"}};
+  Settings* s = new Settings(settings_map);
+
+  // Zero cost samples are ignored, as if they were removed from x.
+  Vector cost = Vector::Ones(x.rows());
+  cost.tail(100).setZero();
+  Matrix w2_init = .1 * Matrix::Random(3, x.cols());
+  double w0 = 0;
+  Vector w1 = Vector::Zero(x.cols());
+  Matrix w2 = w2_init;
+  Model* m = fastfm::ModelFactory(&w0, w1, w2).get();
+  Vector y_pred = Vector::Zero(x.rows());
+  Data* d = fastfm::DataFactory(x, &y_pred, &y).get();
+  d->add_vector("cost", cost.data(), cost.size());
+  fit(s, m, d);
+
+  SpMat x_head = x.topRows(300);
+  Vector y_head = y.head(300);
+  double w0_head = 0;
+  Vector w1_head = Vector::Zero(x.cols());
+  Matrix w2_head = w2_init;
+  Model* m_head = fastfm::ModelFactory(&w0_head, w1_head, w2_head).get();
+  Vector y_pred_head = Vector::Zero(300);
+  Data* d_head = fastfm::DataFactory(x_head, &y_pred_head, &y_head).get();
+  fit(s, m_head, d_head);
+  REQUIRE(w0 == Approx(w0_head));
+  REQUIRE(w1.isApprox(w1_head));
+  REQUIRE(w2.isApprox(w2_head));
+
+  // The folds don't depend on the number of threads and leave m unchanged.
+  Data* d_cv = fastfm::DataFactory(x, &y_pred, &y).get();
+  w2 = w2_init;
+  w1.setZero();
+  w0 = 0;
+  const std::vector<double> errors = cross_validate(s, m, d_cv, 4, 1);
+  REQUIRE(errors.size() == 4);
+  REQUIRE(cross_validate(s, m, d_cv, 4, 3) == errors);
+  REQUIRE(w2 == w2_init);
+  REQUIRE(w1.isZero());
+
+  // Held out error is larger than the training error but below the error
+  // of the initial model.
+  fit(s, m, d_cv);
+  predict(m, d_cv);
+  const double train_rmse = (y - y_pred).norm() / std::sqrt(y.size());
+  const double init_rmse = y.norm() / std::sqrt(y.size());
+  for (double error : errors) {
+    REQUIRE(error > train_rmse);
+    REQUIRE(error < init_rmse);
+  }
+
+  delete s;
+  delete d;
+  delete d_head;
+  delete d_cv;
+  delete m;
+  delete m_head;
+}
+
+TEST_CASE("Fit distributed", "[API]") {
+  fastfm::utils::DataGenerator generator(200, {2, 5, 10}, {1, 1, 4});
+  SpMat x = generator.x_csc();
+  Vector y_true = generator.y_reg(0.1);
+
+  std::vector<double> train_error;
+  for (const std::string n_processes : {"1", "2", "4"}) {
+    Vector y_pred = Vector::Zero(x.rows());
+    double w0 = 0;
+    Vector w1 = Vector::Zero(x.cols());
+    Matrix w2 = Matrix::Random(4, x.cols()) * .1;
+    auto d = fastfm::DataFactory(x, &y_pred, &y_true).get();
+    auto m = fastfm::ModelFactory(&w0, w1, w2).get();
+
+    std::map<std::string, std::string> settings_ = {
+        {"solver", "cd"},
+        {"loss", "squared"},
+        {"iter", "20"},
+        {"l2_reg_w1", "0.1"},
+        {"l2_reg_w2", "0.1"},
+        {"n_processes", n_processes},
+        {"exchange_block", "3"}
+    };
+    Settings* s = new Settings(settings_);
+    fit(s, m, d);
+    predict(m, d);
+    train_error.push_back((y_pred - y_true).norm() / y_true.norm());
+
+    delete d;
+    delete m;
+    delete s;
+  }
+  // The damped updates of the workers converge slower but still converge.
+  REQUIRE(train_error[0] < 0.01);
+  REQUIRE(train_error[1] < 0.02);
+  REQUIRE(train_error[2] < 0.02);
+}
+
+TEST_CASE("Fit distributed, weighted", "[API]") {
+  fastfm::utils::DataGenerator generator(200, {2, 5, 10}, {1, 1, 4});
+  SpMat x = generator.x_csc();
+  Vector y_true = generator.y_reg(0.1);
+  // Zero cost samples with a shifted target must not move the bias.
+  Vector cost = Vector::Ones(x.rows());
+  cost.tail(50).setZero();
+  y_true.tail(50).array() += 100;
+  // Seeded, the result does not depend on the tests run before.
+  std::mt19937 init_rng(42);
+  std::uniform_real_distribution<double> init(-.1, .1);
+  Matrix w2_init =
+      Matrix::NullaryExpr(4, x.cols(), [&]() { return init(init_rng); });
+
+  std::vector<double> w0_fit;
+  std::vector<double> train_error;
+  for (const std::string n_processes : {"1", "2", "4"}) {
+    Vector y_pred = Vector::Zero(x.rows());
+    double w0 = 0;
+    Vector w1 = Vector::Zero(x.cols());
+    Matrix w2 = w2_init;
+    auto d = fastfm::DataFactory(x, &y_pred, &y_true).get();
+    d->add_vector("cost", cost.data(), cost.size());
+    auto m = fastfm::ModelFactory(&w0, w1, w2).get();
+
+    std::map<std::string, std::string> settings_ = {
+        {"solver", "cd"},
+        {"loss", "squared"},
+        {"iter", "20"},
+        {"l2_reg_w1", "0.1"},
+        {"l2_reg_w2", "0.1"},
+        {"n_processes", n_processes},
+        {"exchange_block", "3"}
+    };
+    Settings* s = new Settings(settings_);
+    fit(s, m, d);
+    predict(m, d);
+    w0_fit.push_back(w0);
+    train_error.push_back((y_pred - y_true).head(150).norm()
+                              / y_true.head(150).norm());
+
+    delete d;
+    delete m;
+    delete s;
+  }
+  // The distributed fits agree with the serial fit on the weighted bias,
+  // an unweighted bias would be pulled towards the zero cost samples.
+  for (int k = 0; k < 3; ++k) {
+    REQUIRE(train_error[k] < 0.01);
+    REQUIRE(w0_fit[k] == Approx(w0_fit[0]).margin(1));
+  }
+}
+
+TEST_CASE("Fit with pinned threads and placed memory", "[API]") {
+  fastfm::utils::DataGenerator generator(200, {2, 5, 10}, {1, 1, 4});
+  SpMat x = generator.x_csc();
+  Vector y_true = generator.y_reg(0.1);
+  Matrix w2_init = Matrix::Random(4, x.cols()) * .1;
+
+  // Placement and pinning must not change the result.
+  for (const std::string parallel : {"n_threads", "n_processes"}) {
+    std::vector<Matrix> w2_fit;
+    for (const std::string placement : {"default", "partitioned",
+                                        "interleaved"}) {
+      Vector y_pred = Vector::Zero(x.rows());
+      double w0 = 0;
+      Vector w1 = Vector::Zero(x.cols());
+      Matrix w2 = w2_init;
+      auto d = fastfm::DataFactory(x, &y_pred, &y_true).get();
+      auto m = fastfm::ModelFactory(&w0, w1, w2).get();
+
+      std::map<std::string, std::string> settings_ = {
+          {"solver", "cd"},
+          {"loss", "squared"},
+          {"iter", "5"},
+          {"l2_reg_w1", "0.1"},
+          {"l2_reg_w2", "0.1"},
+          {parallel, "2"},
+          {"memory_placement", placement},
+          {"thread_affinity", placement == "default" ? "none" : "scatter"}
+      };
+      Settings* s = new Settings(settings_);
+      fit(s, m, d);
+      w2_fit.push_back(w2);
+
+      delete d;
+      delete m;
+      delete s;
+    }
+    REQUIRE(w2_fit[0] != w2_init);
+    REQUIRE(w2_fit[1] == w2_fit[0]);
+    REQUIRE(w2_fit[2] == w2_fit[0]);
+  }
+}
+
+TEST_CASE("Fit logistic", "[API]") {
+  fastfm::utils::DataGenerator generator(400, {2, 5, 10}, {1, 1, 4});
+  SpMat x = generator.x_csc();
+  // Labels in {-1, 1}, the solver accepts {0, 1} as well.
+  Vector y_true = generator.y_class(0, 0);
+  y_true = 2 * y_true.array() - 1;
+
+  auto log_loss = [&y_true](const Vector& y_pred) {
+    double loss = 0;
+    for (int i = 0; i < y_true.size(); ++i)
+      loss += std::log1p(std::exp(-y_true(i) * y_pred(i)));
+    return loss / y_true.size();
+  };
+  auto accuracy = [&y_true](const Vector& y_pred) {
+    int correct = 0;
+    for (int i = 0; i < y_true.size(); ++i)
+      correct += (y_pred(i) > 0) == (y_true(i) > 0);
+    return static_cast<double>(correct) / y_true.size();
+  };
+
+  std::vector<double> loss;
+  for (const std::string irls_tol : {"0", "0.5"}) {
+    Vector y_pred = Vector::Zero(x.rows());
+    double w0 = 0;
+    Vector w1 = Vector::Zero(x.cols());
+    Matrix w2 = Matrix::Random(4, x.cols()) * .1;
+    auto d = fastfm::DataFactory(x, &y_pred, &y_true).get();
+    auto m = fastfm::ModelFactory(&w0, w1, w2).get();
+    predict(m, d);
+    const double init_loss = log_loss(y_pred);
+
+    std::map<std::string, std::string> settings_ = {
+        {"solver", "cd"},
+        {"loss", "logistic"},
+        {"iter", "20"},
+        {"l2_reg_w1", "0.1"},
+        {"l2_reg_w2", "0.1"},
+        {"irls_tol", irls_tol}
+    };
+    Settings* s = new Settings(settings_);
+    fit(s, m, d);
+    predict(m, d);
+    REQUIRE(log_loss(y_pred) < init_loss / 2);
+    REQUIRE(accuracy(y_pred) > 0.95);
+    loss.push_back(log_loss(y_pred));
+
+    delete d;
+    delete m;
+    delete s;
+  }
+  // Reusing the weights converges about as fast.
+  REQUIRE(loss[1] < 2 * loss[0]);
+}
+
+TEST_CASE("Logistic working response", "[API]") {
+  Vector y(4);
+  y << 1, -1, 0, 1;
+  Vector err(4);
+  err << 0, 0, 2, -800;
+  Vector cost = Vector::Constant(4, 2);
+  Vector weight;
+  fastfm::cd::impl::LogisticWorkingResponse(y, cost, &err, &weight);
+
+  const double p = 1 / (1 + std::exp(-2.));
+  REQUIRE(weight(0) == Approx(2 * .25));
+  REQUIRE(err(0) == Approx(.5 / .25));
+  REQUIRE(err(1) == Approx(-.5 / .25));
+  REQUIRE(weight(2) == Approx(2 * p * (1 - p)));
+  REQUIRE(err(2) == Approx(-p / (p * (1 - p))));
+  // Saturated predictions stay finite.
+  REQUIRE(std::isfinite(err(3)));
+  REQUIRE(weight(3) > 0);
+}
+
+TEST_CASE("Third order update", "[API]") {
+  fastfm::utils::DataGenerator generator(50, {2, 5, 10}, {1, 1, 3, 2},
+                                         {1, 1, 1, 1});
+  SpMat x = generator.x_csc();
+  Matrix w3 = generator.w3();
+  Vector err = generator.y_reg(.1);
+  Vector cost = Vector::LinSpaced(x.rows(), .5, 2);
+
+  Vector q_cache;
+  Vector q2_cache;
+  fastfm::cd::impl::ThirdOrderQcache(1, x, w3, &q_cache, &q2_cache);
+  Vector q_ref = x * w3.row(1).transpose();
+  Vector q2_ref = x.cwiseProduct(x) *
+      w3.row(1).cwiseProduct(w3.row(1)).transpose();
+  REQUIRE(q_cache.isApprox(q_ref));
+  REQUIRE(q2_cache.isApprox(q2_ref));
+
+  // Predict folds the third order layers into the second order pass.
+  Matrix w2 = generator.w2();
+  Vector w1 = generator.w1();
+  Vector y_pred(x.rows());
+  fastfm::cd::impl::Predict(x, w3, w2, w1, 0, y_pred);
+  Vector y_ref(x.rows());
+  fastfm::cd::impl::Predict(x, w2, w1, 0, y_ref);
+  for (int f = 0; f < w3.rows(); ++f) {
+    Vector q;
+    Vector q2;
+    fastfm::cd::impl::ThirdOrderQcache(f, x, w3, &q, &q2);
+    Vector s3 = x.cwiseProduct(x).cwiseProduct(x) *
+        w3.row(f).array().cube().matrix().transpose();
+    y_ref += (1. / 6) * q.array().cube().matrix() -
+        .5 * q.cwiseProduct(q2) + (1. / 3) * s3;
+  }
+  REQUIRE(y_pred.isApprox(y_ref));
+
+  // The fused kernel matches the separate stats and update steps.
+  Matrix w3_ref = w3;
+  Vector err_ref = err;
+  Vector q_cache_ref = q_cache;
+  Vector q2_cache_ref = q2_cache;
+  std::vector<double> h;
+  for (int j = 0; j < x.cols(); ++j) {
+    double chsqr = 0;
+    double che = 0;
+    const double w_old = w3_ref(1, j);
+    fastfm::cd::impl::ThirdOrderStats(1, j, cost, x, w3_ref, err_ref,
+                                      q_cache_ref, q2_cache_ref,
+                                      &chsqr, &che);
+    w3_ref(1, j) = (che + w_old * chsqr) / (chsqr + .5);
+    fastfm::cd::impl::ThirdOrderErrAndQcacheUpdate(1, j, w3_ref, w_old, x,
+                                                   &err_ref, &q_cache_ref,
+                                                   &q2_cache_ref);
+
+    fastfm::cd::impl::ThirdOrderUpdate(1, j, cost, x, .5, 1, w3, &err,
+                                       &q_cache, &q2_cache, &h);
+  }
+  REQUIRE(w3.isApprox(w3_ref));
+  REQUIRE(err.isApprox(err_ref));
+  REQUIRE(q_cache.isApprox(q_cache_ref));
+  REQUIRE(q2_cache.isApprox(q2_cache_ref));
+
+  // The caches stay consistent with the updated parameter.
+  fastfm::cd::impl::ThirdOrderQcache(1, x, w3, &q_ref, &q2_ref);
+  REQUIRE(q_cache.isApprox(q_ref));
+  REQUIRE(q2_cache.isApprox(q2_ref));
+}
+
+TEST_CASE("Fit third order", "[API]") {
+  fastfm::utils::DataGenerator generator(100, {2, 5, 10}, {1, 1, 3, 2},
+                                         {1, 1, 1, 1});
+  SpMat x = generator.x_csc();
+  Matrix w3_true = generator.w3();
+  Matrix w2_true = generator.w2();
+  Vector w1_true = generator.w1();
+  Model* m_true = fastfm::ModelFactory(generator.w0(), w1_true, w2_true,
+                                       w3_true).get();
+  Vector y = Vector::Zero(x.rows());
+  Data* d_true = fastfm::DataFactory(x, &y).get();
+  predict(m_true, d_true);
+
+  double w0 = 0;
+  Vector w1 = Vector::Zero(x.cols());
+  Matrix w2 = .1 * Matrix::Random(w2_true.rows(), x.cols());
+  Matrix w3 = .1 * Matrix::Random(w3_true.rows(), x.cols());
+  Model* m = fastfm::ModelFactory(&w0, w1, w2, w3).get();
+  Vector y_pred = Vector::Zero(x.rows());
+  Data* d = fastfm::DataFactory(x, &y_pred, &y).get();
+
+  predict(m, d);
+  const double err_init = (y - y_pred).norm();
+
+  std::map<std::string, std::string> settings_map = {
+      {"solver", "cd"}, {"loss", "squared"}, {"n_epoch", "20"},
+      {"l2_reg_w1", "0.01"},
+      {"l2_reg_w2", "0.01"}, {"l2_reg_w3", "0.01"}};
+  Settings* s = new Settings(settings_map);
+  fit(s, m, d);
+  predict(m, d);
+  REQUIRE((y - y_pred).norm() < .1 * err_init);
+
+  delete s;
+  delete d;
+  delete m;
+  delete d_true;
+  delete m_true;
+}
+
+TEST_CASE("Weighted and unweighted stats", "[API]") {
+  fastfm::utils::DataGenerator generator(50, {2, 5, 10}, {1, 1, 2});
+  SpMat x = generator.x_csc();
+  Matrix w2 = generator.w2();
+  Vector err = generator.y_reg(.1);
+  Vector q_cache = fastfm::cd::impl::Qcache(1, x, w2);
+  const Vector no_cost;
+  const Vector cost = Vector::Constant(x.rows(), 2);
+
+  for (int j = 0; j < x.cols(); ++j) {
+    double chsqr = 0, che = 0, chsqr_w = 0, che_w = 0;
+    fastfm::cd::impl::FirstOrderStats(j, no_cost, x, err, &chsqr, &che);
+    fastfm::cd::impl::FirstOrderStats(j, cost, x, err, &chsqr_w, &che_w);
+    REQUIRE(chsqr_w == Approx(2 * chsqr));
+    REQUIRE(che_w == Approx(2 * che));
+
+    fastfm::cd::impl::SecondOrderStats(1, j, no_cost, x, w2, err, q_cache,
+                                       &chsqr, &che);
+    fastfm::cd::impl::SecondOrderStats(1, j, cost, x, w2, err, q_cache,
+                                       &chsqr_w, &che_w);
+    REQUIRE(chsqr_w == Approx(2 * chsqr));
+    REQUIRE(che_w == Approx(2 * che));
+  }
+}
+
+TEST_CASE("Binary design matrix", "[API]") {
+  fastfm::utils::DataGenerator generator(100, {10, 20, 50}, {1, 1, 3, 2},
+                                         {1, 1, 1, 1});
+  SpMat x = generator.x_csc();
+  REQUIRE((Eigen::Map<Vector>(x.valuePtr(), x.nonZeros()).array() == 1).all());
+  // The one-hot design matrix mapped without values.
+  Eigen::Map<SpMat> x_binary(x.rows(), x.cols(), x.nonZeros(),
+                             x.outerIndexPtr(), x.innerIndexPtr(), nullptr);
+  REQUIRE(fastfm::cd::impl::IsBinary(x_binary));
+  REQUIRE(!fastfm::cd::impl::IsBinary(x));
+  // Data maps a one-hot matrix without values.
+  Vector y_data(x.rows());
+  Data* d = fastfm::DataFactory(x, &y_data).get();
+  REQUIRE(fastfm::Internal::get_impl(d)->is_binary("x"));
+  delete d;
+
+  Vector w1 = generator.w1();
+  Matrix w2 = generator.w2();
+  Matrix w3 = generator.w3();
+  Model* m = fastfm::ModelFactory(generator.w0(), w1, w2, w3).get();
+  Vector y_pred(x.rows());
+  Vector y_pred_binary(x.rows());
+  const fastfm::ModelParam* coef_init = fastfm::Internal::get_impl(m)->coef_;
+  fastfm::cd::impl::Predict(x, coef_init, y_pred);
+  fastfm::cd::impl::Predict(x_binary, coef_init, y_pred_binary);
+  REQUIRE(y_pred_binary.isApprox(y_pred));
+
+  fastfm::SolverSettings settings;
+  settings.iter = 5;
+  settings.rank_w2 = 3;
+  settings.rank_w3 = 2;
+  Vector y = generator.y_reg(.1);
+  std::unique_ptr<fastfm::ModelParam> coef = coef_init->deep_copy();
+  std::unique_ptr<fastfm::ModelParam> coef_binary = coef_init->deep_copy();
+  fastfm::cd::impl::FitSquareLoss(x, y, Vector(), settings, coef.get());
+  fastfm::cd::impl::FitSquareLoss(x_binary, y, Vector(), settings,
+                                  coef_binary.get());
+  REQUIRE(coef_binary->getw1().isApprox(coef->getw1()));
+  REQUIRE(coef_binary->getw2().isApprox(coef->getw2()));
+  REQUIRE(coef_binary->getw3().isApprox(coef->getw3()));
+}
+
+TEST_CASE("Compressed row indices", "[API]") {
+  // Gaps of one, two and more varint bytes.
+  SpMat x(100000, 3);
+  x.insert(0, 0) = 1;
+  x.insert(1, 0) = 2;
+  x.insert(200, 0) = 3;
+  x.insert(99999, 0) = 4;
+  x.insert(5, 2) = 5;
+  x.makeCompressed();
+  fastfm::cd::CompressedColumns compressed("varint", x);
+  REQUIRE(compressed.index_bytes() == 1 + 1 + 2 + 3 + 1);
+  for (int j : {2, 1, 0}) {
+    Eigen::Map<SpMat> x_j = compressed.column(j);
+    std::vector<std::pair<int, double>> got, expected;
+    for (int l = 0; l < x.cols(); ++l) {
+      for (SpMat::InnerIterator it(x, l); it; ++it) {
+        if (l == j) expected.emplace_back(it.row(), it.value());
+      }
+      for (Eigen::Map<SpMat>::InnerIterator it(x_j, l); it; ++it) {
+        REQUIRE(l == j);
+        got.emplace_back(it.row(), it.value());
+      }
+    }
+    REQUIRE(got == expected);
+  }
+
+  // The fit is unchanged.
+  fastfm::utils::DataGenerator generator(200, {20, 50, 100}, {1, 1, 3, 2},
+                                         {1, 1, 1, 1});
+  SpMat x_fit = generator.x_csc();
+  Vector y = generator.y_reg(.1);
+  Vector w1 = generator.w1();
+  Matrix w2 = generator.w2();
+  Matrix w3 = generator.w3();
+  Model* m = fastfm::ModelFactory(generator.w0(), w1, w2, w3).get();
+  const fastfm::ModelParam* coef_init = fastfm::Internal::get_impl(m)->coef_;
+  fastfm::SolverSettings settings;
+  settings.iter = 5;
+  settings.rank_w2 = 3;
+  settings.rank_w3 = 2;
+  std::unique_ptr<fastfm::ModelParam> coef = coef_init->deep_copy();
+  fastfm::cd::impl::FitSquareLoss(x_fit, y, Vector(), settings, coef.get());
+  settings.index_compression = "varint";
+  std::unique_ptr<fastfm::ModelParam> coef_compressed = coef_init->deep_copy();
+  fastfm::cd::impl::FitSquareLoss(x_fit, y, Vector(), settings,
+                                  coef_compressed.get());
+  REQUIRE(coef_compressed->getw1() == coef->getw1());
+  REQUIRE(coef_compressed->getw2() == coef->getw2());
+  REQUIRE(coef_compressed->getw3() == coef->getw3());
+}
+
+TEST_CASE("Stochastic row window epochs", "[API]") {
+  fastfm::utils::DataGenerator generator(4000, {200, 500, 1000}, {1, 1, 3});
+  SpMat x = generator.x_csc();
+  Vector y = generator.y_reg(.1);
+
+  // Row i of the window is row 200 + i of x.
+  fastfm::cd::impl::RowWindow window(x);
+  Eigen::Map<SpMat> x_window = window.view(200, 450);
+  REQUIRE(x_window.rows() == 250);
+  REQUIRE(x_window.cols() == x.cols());
+  for (int j = 0; j < x.cols(); ++j) {
+    std::vector<std::pair<int, double>> got, expected;
+    for (SpMat::InnerIterator it(x, j); it; ++it) {
+      if (it.row() >= 200 && it.row() < 450)
+        expected.emplace_back(it.row() - 200, it.value());
+    }
+    for (Eigen::Map<SpMat>::InnerIterator it(x_window, j); it; ++it)
+      got.emplace_back(it.row(), it.value());
+    REQUIRE(got == expected);
+  }
+
+  Vector w1 = Vector::Zero(x.cols());
+  // Seeded, the result does not depend on the tests run before.
+  std::mt19937 init_rng(42);
+  std::uniform_real_distribution<double> init(-.1, .1);
+  Matrix w2 = Matrix::NullaryExpr(3, x.cols(), [&]() { return init(init_rng); });
+  double w0 = 0;
+  Model* m = fastfm::ModelFactory(&w0, w1, w2).get();
+  const fastfm::ModelParam* coef_init = fastfm::Internal::get_impl(m)->coef_;
+  Vector y_pred(x.rows());
+  fastfm::cd::impl::Predict(x, coef_init, y_pred);
+  const double init_rmse = std::sqrt((y - y_pred).squaredNorm() / x.rows());
+
+  fastfm::SolverSettings settings;
+  settings.iter = 20;
+  settings.rank_w2 = 3;
+  settings.l2_reg_w1 = 1;
+  settings.l2_reg_w2 = 1;
+  std::unique_ptr<fastfm::ModelParam> coef = coef_init->deep_copy();
+  fastfm::cd::impl::FitSquareLoss(x, y, Vector(), settings, coef.get());
+  fastfm::cd::impl::Predict(x, coef.get(), y_pred);
+  const double rmse = std::sqrt((y - y_pred).squaredNorm() / x.rows());
+
+  // Windows of a quarter of the rows of tall data come close to the full
+  // fit, the windows are drawn at random.
+  settings.row_fraction = .25;
+  std::unique_ptr<fastfm::ModelParam> coef_window = coef_init->deep_copy();
+  fastfm::cd::impl::FitSquareLoss(x, y, Vector(), settings, coef_window.get());
+  fastfm::cd::impl::Predict(x, coef_window.get(), y_pred);
+  const double window_rmse = std::sqrt((y - y_pred).squaredNorm() / x.rows());
+  REQUIRE(window_rmse < init_rmse / 2);
+  REQUIRE(window_rmse < 1.2 * rmse);
+
+  // The logistic loss is relinearized on all rows every residual_refresh
+  // epochs, in between the windows fit the stale working response.
+  // Noisy labels, the classes are not separable.
+  std::mt19937 label_rng(7);
+  std::normal_distribution<double> label_noise(0, std::sqrt(y.squaredNorm()
+                                                            / y.size()));
+  Vector y_class(y.size());
+  for (int i = 0; i < y.size(); ++i)
+    y_class(i) = y(i) + label_noise(label_rng) > 0 ? 1 : -1;
+  settings.loss = "logistic";
+  settings.row_fraction = 1;
+  std::unique_ptr<fastfm::ModelParam> coef_logistic = coef_init->deep_copy();
+  fastfm::cd::impl::FitSquareLoss(x, y_class, Vector(), settings,
+                                  coef_logistic.get());
+  fastfm::cd::impl::Predict(x, coef_logistic.get(), y_pred);
+  const double log_loss =
+      fastfm::cd::MeanLoss("logistic", y_class, y_pred, Vector());
+  settings.row_fraction = .25;
+  for (int refresh : {0, 1, 8}) {
+    settings.residual_refresh = refresh;
+    std::unique_ptr<fastfm::ModelParam> coef_refresh = coef_init->deep_copy();
+    fastfm::cd::impl::FitSquareLoss(x, y_class, Vector(), settings,
+                                    coef_refresh.get());
+    fastfm::cd::impl::Predict(x, coef_refresh.get(), y_pred);
+    REQUIRE(fastfm::cd::MeanLoss("logistic", y_class, y_pred, Vector())
+                < 1.2 * log_loss);
+  }
+
+  // Rows sorted by the target, windows of x itself would see only a
+  // narrow range of y per epoch. `fit` shuffles the samples first.
+  std::vector<int> by_target(x.rows());
+  std::iota(by_target.begin(), by_target.end(), 0);
+  std::sort(by_target.begin(), by_target.end(),
+            [&y](int a, int b) { return y(a) < y(b); });
+  SpMat x_sorted = fastfm::order::PermuteRows(x, by_target);
+  Vector y_sorted(x.rows());
+  for (int i = 0; i < x.rows(); ++i) y_sorted(i) = y(by_target[i]);
+  std::map<std::string, std::string> sorted_settings = {
+      {"solver", "cd"},
+      {"loss", "squared"},
+      {"iter", "20"},
+      {"l2_reg_w1", "1"},
+      {"l2_reg_w2", "1"},
+      {"row_fraction", "0.25"}
+  };
+  Settings* s = new Settings(sorted_settings);
+  double w0_sorted = 0;
+  Vector w1_sorted = w1;
+  Matrix w2_sorted = w2;
+  Vector y_pred_sorted = Vector::Zero(x.rows());
+  auto d = fastfm::DataFactory(x_sorted, &y_pred_sorted, &y_sorted).get();
+  auto m_sorted =
+      fastfm::ModelFactory(&w0_sorted, w1_sorted, w2_sorted).get();
+  fit(s, m_sorted, d);
+  // Predictions are returned in the sorted order of the caller.
+  predict(m_sorted, d);
+  const double sorted_rmse =
+      std::sqrt((y_sorted - y_pred_sorted).squaredNorm() / x.rows());
+  REQUIRE(sorted_rmse < 1.2 * rmse);
+
+  delete d;
+  delete m_sorted;
+  delete s;
+}
+
+TEST_CASE("Predict rows", "[API]") {
+  fastfm::utils::DataGenerator generator(50, {2, 5, 10}, {1, 3, 2});
+  Matrix w3 = generator.w3();
+  Matrix w2 = generator.w2();
+  Vector w1 = generator.w1();
+  Model* m = fastfm::ModelFactory(generator.w0(), w1, w2, w3).get();
+
+  SpMat x = generator.x_csc();
+  Vector y_ref = Vector::Zero(x.rows());
+  Data* d = fastfm::DataFactory(x, &y_ref).get();
+  predict(m, d);
+
+  RequestSpMat x_csr = generator.x_csr();
+  Vector y_rows(x.rows());
+  predict_rows(*m, x_csr.outerIndexPtr(), x_csr.innerIndexPtr(),
+               x_csr.valuePtr(), x_csr.rows(), y_rows.data());
+  REQUIRE(y_rows.isApprox(y_ref));
+
+  const int begin = x_csr.outerIndexPtr()[7];
+  const int nnz = x_csr.outerIndexPtr()[8] - begin;
+  REQUIRE(predict_row(*m, x_csr.innerIndexPtr() + begin,
+                      x_csr.valuePtr() + begin, nnz)
+              == Approx(y_ref(7)));
+  std::vector<float> val_f(x_csr.valuePtr() + begin,
+                           x_csr.valuePtr() + begin + nnz);
+  REQUIRE(predict_row(*m, x_csr.innerIndexPtr() + begin, val_f.data(), nnz)
+              == Approx(y_ref(7)).epsilon(1e-5));
+
+  std::shared_ptr<const Model> snapshot = m->snapshot();
+  predict_rows(*snapshot, x_csr.outerIndexPtr(), x_csr.innerIndexPtr(),
+               x_csr.valuePtr(), x_csr.rows(), y_rows.data());
+  REQUIRE(y_rows.isApprox(y_ref));
+
+  // Quantized models are predicted with the same kernels.
+  m->quantize("fp16");
+  Vector y_quantized = Vector::Zero(x.rows());
+  Data* d_quantized = fastfm::DataFactory(x, &y_quantized).get();
+  predict(m, d_quantized);
+  predict_rows(*m, x_csr.outerIndexPtr(), x_csr.innerIndexPtr(),
+               x_csr.valuePtr(), x_csr.rows(), y_rows.data());
+  REQUIRE(y_rows.isApprox(y_quantized));
+
+  delete d;
+  delete d_quantized;
+  delete m;
+}
+
+TEST_CASE("Predict candidates", "[API]") {
+  fastfm::utils::DataGenerator generator(50, {2, 5, 10}, {1, 3, 2});
+  Matrix w3 = generator.w3();
+  Matrix w2 = generator.w2();
+  Vector w1 = generator.w1();
+  Model* m = fastfm::ModelFactory(generator.w0(), w1, w2, w3).get();
+  RequestSpMat x = generator.x_csr();
+
+  // Context: the features [0, n_context), candidates: all other features.
+  const int n_context = 4;
+  RequestSpMat x_context = x.leftCols(n_context);
+  RequestSpMat x_items = x.rightCols(x.cols() - n_context);
+  std::vector<int> indptr(x.rows() + 1, 0);
+  std::vector<int> idx;
+  std::vector<double> val;
+  for (int i = 0; i < x.rows(); ++i) {
+    for (RequestSpMat::InnerIterator it(x_items, i); it; ++it) {
+      idx.push_back(it.col() + n_context);
+      val.push_back(it.value());
+    }
+    indptr[i + 1] = idx.size();
+  }
+
+  for (int i = 0; i < 3; ++i) {
+    const int begin = x_context.outerIndexPtr()[i];
+    const int nnz = x_context.outerIndexPtr()[i + 1] - begin;
+    Vector y_candidates(x.rows());
+    predict_candidates(*m, x_context.innerIndexPtr() + begin,
+                       x_context.valuePtr() + begin, nnz, indptr.data(),
+                       idx.data(), val.data(), x.rows(),
+                       y_candidates.data());
+
+    // Reference: every candidate concatenated with the context.
+    for (int c = 0; c < x.rows(); ++c) {
+      std::vector<int> row_idx(x_context.innerIndexPtr() + begin,
+                               x_context.innerIndexPtr() + begin + nnz);
+      std::vector<double> row_val(x_context.valuePtr() + begin,
+                                  x_context.valuePtr() + begin + nnz);
+      row_idx.insert(row_idx.end(), idx.begin() + indptr[c],
+                     idx.begin() + indptr[c + 1]);
+      row_val.insert(row_val.end(), val.begin() + indptr[c],
+                     val.begin() + indptr[c + 1]);
+      const double y_ref = predict_row(*m, row_idx.data(), row_val.data(),
+                                       row_idx.size());
+      REQUIRE(y_candidates(c) == Approx(y_ref));
+    }
+  }
+  delete m;
+}
@@ -4,10 +4,25 @@
 
 #include <Eigen/Dense>
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "../3rdparty/catch/catch.hpp"
 
 #include "fastfm.h"
 #include "fixture.h"
+#include "datasets.h"
+#include "feature_hashing.h"
+#include "model_registry.h"
+#include "sample_order.h"
+#include "solvers/numa.h"
+#include "solvers/parallel.h"
 
 using Matrix = Eigen::Matrix<double,
                              Eigen::Dynamic,
@@ -40,7 +55,25 @@ TEST_CASE("Settings deserialization", "[deserialization]") {
       {"lazy_decay", "0.003"},
       {"clip_pred", "false"},
       {"clip_reg", "false"},
-      {"lazy_reg", "false"}
+      {"lazy_reg", "false"},
+      {"w2_layout", "feature_major"},
+      {"coord_order", "random"},
+      {"coord_fraction", "0.5"},
+      {"shrink_tol", "0.001"},
+      {"shrink_patience", "3"},
+      {"shrink_check_every", "7"},
+      {"n_threads", "4"},
+      {"layer_damping", "0.5"},
+      {"n_processes", "3"},
+      {"exchange_block", "128"},
+      {"thread_affinity", "scatter"},
+      {"memory_placement", "interleaved"},
+      {"index_compression", "varint"},
+      {"row_fraction", "0.25"},
+      {"residual_refresh", "3"},
+      {"group_l2_reg_w1", "0.5,2"},
+      {"group_l2_reg_w2", "1,10,0.25"},
+      {"path_iter", "7"}
   };
 
   Settings* s = new Settings(cppjson);
@@ -61,6 +94,26 @@ TEST_CASE("Settings deserialization", "[deserialization]") {
   REQUIRE_FALSE(Internal::get_impl(s)->settings_.clip_pred);
   REQUIRE_FALSE(Internal::get_impl(s)->settings_.clip_reg);
   REQUIRE_FALSE(Internal::get_impl(s)->settings_.lazy_reg);
+  REQUIRE(Internal::get_impl(s)->settings_.w2_layout == "feature_major");
+  REQUIRE(Internal::get_impl(s)->settings_.coord_order == "random");
+  REQUIRE(Approx(Internal::get_impl(s)->settings_.coord_fraction) == 0.5);
+  REQUIRE(Approx(Internal::get_impl(s)->settings_.shrink_tol) == 0.001);
+  REQUIRE(Internal::get_impl(s)->settings_.shrink_patience == 3);
+  REQUIRE(Internal::get_impl(s)->settings_.shrink_check_every == 7);
+  REQUIRE(Internal::get_impl(s)->settings_.n_threads == 4);
+  REQUIRE(Approx(Internal::get_impl(s)->settings_.layer_damping) == 0.5);
+  REQUIRE(Internal::get_impl(s)->settings_.n_processes == 3);
+  REQUIRE(Internal::get_impl(s)->settings_.exchange_block == 128);
+  REQUIRE(Internal::get_impl(s)->settings_.thread_affinity == "scatter");
+  REQUIRE(Internal::get_impl(s)->settings_.memory_placement == "interleaved");
+  REQUIRE(Internal::get_impl(s)->settings_.index_compression == "varint");
+  REQUIRE(Approx(Internal::get_impl(s)->settings_.row_fraction) == 0.25);
+  REQUIRE(Internal::get_impl(s)->settings_.residual_refresh == 3);
+  REQUIRE(Internal::get_impl(s)->settings_.group_l2_reg_w1
+              == std::vector<double>({.5, 2}));
+  REQUIRE(Internal::get_impl(s)->settings_.group_l2_reg_w2
+              == std::vector<double>({1, 10, .25}));
+  REQUIRE(Internal::get_impl(s)->settings_.path_iter == 7);
 
   delete s;
 }
@@ -217,3 +270,439 @@ TEST_CASE("Data, add vector", "[add_vector]") {
   REQUIRE(Approx(Internal::get_impl(d)->get_vector("z").sum()) == z.sum());
   delete d;
 }
+
+TEST_CASE("Data, reorder samples", "[reorder_samples]") {
+  fastfm::utils::DataGenerator generator(60, {2, 5, 60}, {1, 1, 2});
+  SpMat x = generator.x_csc();
+  Vector w1 = generator.w1();
+  Matrix w2 = generator.w2();
+  double w0 = *generator.w0();
+
+  Vector y_ref = Vector::Zero(x.rows());
+  Data* d_ref = fastfm::DataFactory(x, &y_ref).get();
+  Model* m = fastfm::ModelFactory(&w0, w1, w2).get();
+  predict(m, d_ref);
+
+  for (const std::string method : {"rcm", "dominant", "random", "none"}) {
+    const std::vector<int> perm = fastfm::order::SampleOrder(method, x);
+    std::vector<int> sorted(perm);
+    std::sort(sorted.begin(), sorted.end());
+    for (int i = 0; i < x.rows(); ++i) REQUIRE(sorted[i] == i);
+
+    Vector y_pred = Vector::Zero(x.rows());
+    Data* d = fastfm::DataFactory(x, &y_pred).get();
+    d->reorder_samples(method);
+    predict(m, d);
+    for (int i = 0; i < x.rows(); ++i)
+      REQUIRE(Approx(y_pred.coeff(i)) == y_ref.coeff(i));
+    delete d;
+  }
+
+  delete d_ref;
+  delete m;
+}
+
+TEST_CASE("Data, reorder binary samples", "[reorder_samples]") {
+  // One-hot design matrix, Data maps it without values.
+  fastfm::utils::DataGenerator generator(100, {10, 20, 50}, {1, 1, 3},
+                                         {1, 1, 1});
+  SpMat x = generator.x_csc();
+  Vector w1 = generator.w1();
+  Matrix w2 = generator.w2();
+  Model* m = fastfm::ModelFactory(generator.w0(), w1, w2).get();
+
+  Vector y_ref = Vector::Zero(x.rows());
+  Data* d_ref = fastfm::DataFactory(x, &y_ref).get();
+  predict(m, d_ref);
+
+  for (const std::string method : {"rcm", "dominant", "random", "none"}) {
+    Vector y_pred = Vector::Zero(x.rows());
+    Data* d = fastfm::DataFactory(x, &y_pred).get();
+    REQUIRE(Internal::get_impl(d)->is_binary("x"));
+    d->reorder_samples(method);
+    predict(m, d);
+    for (int i = 0; i < x.rows(); ++i)
+      REQUIRE(Approx(y_pred.coeff(i)) == y_ref.coeff(i));
+    delete d;
+  }
+
+  delete d_ref;
+  delete m;
+}
+
+TEST_CASE("Model, save and open_mmap", "[model_io]") {
+  const std::string path = "model_io_test.ffm";
+  Matrix w3(2, 3);
+  w3 << 1, 2, 3,
+      4, 5, 6;
+  Matrix w2(2, 3);
+  w2 << 6, 0, 2,
+      5, 1, 0;
+  Vector w1(3);
+  w1 << 9, 8, 7;
+  double w0 = 2;
+  Vector values(2);
+  values << 1.1, 10.2;
+  Vector l2(5);
+  l2 << 1.1, 2.2, 3.3, 4.4, 5.5;
+
+  Model* m = fastfm::ModelFactory(&w0, w1, w2, w3).get();
+  m->add_scalar_map("one,ten", values.data(), values.size());
+  m->add_vector("l2", l2.data(), l2.size());
+  m->save(path);
+
+  Model* loaded = new Model();
+  loaded->open_mmap(path);
+  fastfm::ModelParam* coef = Internal::get_impl(loaded)->coef_;
+
+  REQUIRE(coef->getw0() == w0);
+  REQUIRE(coef->getw1() == w1);
+  REQUIRE(coef->getw2() == w2);
+  REQUIRE(coef->getw3() == w3);
+  REQUIRE(coef->getMapValue("ten").coeff(0) == 10.2);
+  REQUIRE(coef->get_vector("l2") == l2);
+  // Zero copy, the parameter point into the 64 byte aligned mapping.
+  REQUIRE(reinterpret_cast<uintptr_t>(coef->getw2().data()) % 64 == 0);
+
+  // Predictions of the mapped model match the original model.
+  SpMat x;
+  {
+    Matrix tmp(2, 3);
+    tmp << 1, 2, 0,
+        4, 0, 2;
+    x = tmp.sparseView();
+  }
+  Vector y_ref = Vector::Zero(x.rows());
+  Vector y_pred = Vector::Zero(x.rows());
+  Data* d_ref = fastfm::DataFactory(x, &y_ref).get();
+  Data* d = fastfm::DataFactory(x, &y_pred).get();
+  predict(m, d_ref);
+  predict(loaded, d);
+  REQUIRE(y_pred == y_ref);
+
+  // Opening again replaces the named vectors of the first mapping.
+  loaded->open_mmap(path);
+  REQUIRE(coef->get_vector("l2") == l2);
+  REQUIRE(coef->getw3() == w3);
+
+  delete d_ref;
+  delete d;
+  delete m;
+  delete loaded;
+  std::remove(path.c_str());
+}
+
+TEST_CASE("Model, quantize", "[quantize]") {
+  std::mt19937 mt_rand(123);
+  std::normal_distribution<double> normal(0, 0.1);
+  const int n_features = 20;
+  Matrix w3(2, n_features);
+  Matrix w2(4, n_features);
+  Vector w1(n_features);
+  for (int j = 0; j < n_features; ++j) {
+    w1(j) = normal(mt_rand);
+    for (int f = 0; f < w2.rows(); ++f) w2(f, j) = normal(mt_rand);
+    for (int f = 0; f < w3.rows(); ++f) w3(f, j) = normal(mt_rand);
+  }
+  double w0 = 0.5;
+
+  Matrix dense = Matrix::Zero(50, n_features);
+  for (int i = 0; i < dense.rows(); ++i)
+    for (int j = i % 3; j < n_features; j += 3)
+      dense(i, j) = 1 + normal(mt_rand);
+  SpMat x = dense.sparseView();
+
+  Model* m = fastfm::ModelFactory(&w0, w1, w2, w3).get();
+  Vector y_ref = Vector::Zero(x.rows());
+  Data* d_ref = fastfm::DataFactory(x, &y_ref).get();
+  predict(m, d_ref);
+
+  for (const std::string type : {"int8", "fp16"}) {
+    m->quantize(type);
+    Vector y_pred = Vector::Zero(x.rows());
+    Data* d = fastfm::DataFactory(x, &y_pred).get();
+    predict(m, d);
+    REQUIRE((y_pred - y_ref).cwiseAbs().maxCoeff() < 1e-2);
+
+    std::map<std::string, double> report = quantization_report(m, d);
+    REQUIRE(report["max_abs_error"]
+                == Approx((y_pred - y_ref).cwiseAbs().maxCoeff()));
+    REQUIRE(report["bytes_fp64"] == 8 * (1 + n_features * 7));
+    REQUIRE(report["bytes_quantized"] < report["bytes_fp64"] / 3);
+    delete d;
+  }
+
+  // Dropping the quantized copy restores the full precision predictions.
+  m->quantize("none");
+  Vector y_pred = Vector::Zero(x.rows());
+  Data* d = fastfm::DataFactory(x, &y_pred).get();
+  predict(m, d);
+  REQUIRE(y_pred == y_ref);
+
+  delete d;
+  delete d_ref;
+  delete m;
+}
+
+TEST_CASE("Feature hashing", "[feature_hashing]") {
+  // Reference values of MurmurHash3_x86_32.
+  REQUIRE(fastfm::hashing::MurmurHash3("", 0, 0) == 0);
+  REQUIRE(fastfm::hashing::MurmurHash3("", 0, 1) == 0x514E28B7);
+  REQUIRE(fastfm::hashing::MurmurHash3("hello", 5, 0) == 0x248bfa47);
+  const std::string fox = "The quick brown fox jumps over the lazy dog";
+  REQUIRE(fastfm::hashing::MurmurHash3(fox.data(), fox.size(), 0)
+              == 0x2e4ff723);
+
+  std::vector<int> rows = {0, 0, 1, 1, 2};
+  std::vector<std::string> fields = {"user", "item", "user", "item", "user"};
+  std::vector<std::string> tokens = {"alice", "book", "bob", "book", "alice"};
+  std::vector<double> values = {1, 1, 1, 0.5, 2};
+  const int n_features = 1 << 10;
+
+  Data* d = new Data();
+  d->add_hashed_features("x", rows, fields, tokens, values, 3, n_features);
+  SpMat x = Internal::get_impl(d)->get_design_matrix_col_major();
+  REQUIRE(x.rows() == 3);
+  REQUIRE(x.cols() == n_features);
+
+  fastfm::hashing::FeatureHasher hasher(n_features, true, 0);
+  double sign;
+  const int alice = hasher.index("user", "alice", &sign);
+  REQUIRE(std::abs(x.coeff(0, alice)) == 1);
+  REQUIRE(x.coeff(2, alice) == 2 * x.coeff(0, alice));
+  const int book = hasher.index("item", "book", &sign);
+  REQUIRE(x.coeff(1, book) == 0.5 * sign);
+  // The field is part of the key.
+  REQUIRE(hasher.index("item", "alice", &sign) != alice);
+
+  // Unsigned hashing uses the same columns with positive values.
+  Data* d_unsigned = new Data();
+  d_unsigned->add_hashed_features("x", rows, fields, tokens, values, 3,
+                                  n_features, false);
+  SpMat x_unsigned =
+      Internal::get_impl(d_unsigned)->get_design_matrix_col_major();
+  REQUIRE(SpMat(x.cwiseAbs()).isApprox(x_unsigned));
+
+  delete d;
+  delete d_unsigned;
+}
+
+TEST_CASE("Model, concurrent predict on snapshots", "[snapshot]") {
+  Matrix w2(2, 3);
+  w2 << 6, 0, 2,
+      5, 1, 0;
+  Vector w1(3);
+  w1 << 9, 8, 7;
+  double w0 = 2;
+  Vector l2(2);
+  l2 << 1.1, 2.2;
+  Model* m = fastfm::ModelFactory(&w0, w1, w2).get();
+  m->add_vector("l2", l2.data(), l2.size());
+
+  SpMat x;
+  {
+    Matrix tmp(3, 3);
+    tmp << 1, 2, 0,
+        4, 0, 2,
+        0, 1, 1;
+    x = tmp.sparseView();
+  }
+  Vector y_ref = Vector::Zero(x.rows());
+  Data* d_ref = fastfm::DataFactory(x, &y_ref).get();
+  predict(m, d_ref);
+
+  // The snapshot owns its memory, later changes of the model don't leak in.
+  fastfm::SharedModel shared(m->snapshot());
+  w1.setZero();
+  l2.setZero();
+  const fastfm::ModelParam* coef =
+      Internal::get_impl(shared.load().get())->coef_;
+  REQUIRE(coef->getw1().sum() == 24);
+  REQUIRE(coef->get_vectors().at("l2").sum() == Approx(3.3));
+
+  Vector y_new = Vector::Zero(x.rows());
+  Data* d_new = fastfm::DataFactory(x, &y_new).get();
+  predict(m, d_new);
+  std::shared_ptr<const Model> retrained = m->snapshot();
+
+  const int n_threads = 4;
+  std::vector<int> mismatches(n_threads, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      Vector y_pred(x.rows());
+      Data* d = fastfm::DataFactory(x, &y_pred).get();
+      for (int i = 0; i < 200; ++i) {
+        std::shared_ptr<const Model> current = shared.load();
+        predict(current.get(), d);
+        if (y_pred != y_ref && y_pred != y_new) ++mismatches[t];
+      }
+      delete d;
+    });
+  }
+  // Publish the retrained snapshot while the readers are running.
+  shared.store(retrained);
+  for (auto& thread : threads) thread.join();
+
+  for (int t = 0; t < n_threads; ++t) REQUIRE(mismatches[t] == 0);
+  Vector y_pred(x.rows());
+  Data* d = fastfm::DataFactory(x, &y_pred).get();
+  predict(shared.load().get(), d);
+  REQUIRE(y_pred == y_new);
+
+  delete d;
+  delete d_ref;
+  delete d_new;
+  delete m;
+}
+
+TEST_CASE("Model registry, reload and routing", "[model_registry]") {
+  Matrix w2(2, 3);
+  w2 << 6, 0, 2,
+      5, 1, 0;
+  Vector w1(3);
+  w1 << 9, 8, 7;
+  double w0 = 2;
+  Model* m = fastfm::ModelFactory(&w0, w1, w2).get();
+  std::shared_ptr<const Model> v1 = m->snapshot();
+  w0 = 3;
+  std::shared_ptr<const Model> v2 = m->snapshot();
+  const int idx[] = {0, 2};
+  const double val[] = {1, 1};
+
+  fastfm::ModelRegistry registry;
+  registry.publish("a", v1);
+  registry.publish("b", v2);
+  registry.set_route("ab", {{"a", 0.75}, {"b", 0.25}});
+  {
+    fastfm::ModelRegistry::Reader reader(&registry);
+    REQUIRE(reader.get("missing") == NULL);
+    REQUIRE(predict_row(*reader.get("a"), idx, val, 2) == 2 + 16 + 12);
+
+    int n_a = 0;
+    for (uint64_t key = 0; key < 10000; ++key) {
+      const Model* routed = reader.route("ab", key);
+      REQUIRE((routed == v1.get() || routed == v2.get()));
+      if (routed == v1.get()) ++n_a;
+      REQUIRE(reader.route("ab", key) == routed);  // sticky
+    }
+    REQUIRE(n_a > 7200);
+    REQUIRE(n_a < 7800);
+  }
+
+  // A replaced model stays alive while a reader that saw it is active.
+  std::weak_ptr<const Model> old = v1;
+  v1.reset();
+  {
+    fastfm::ModelRegistry::Reader reader(&registry);
+    const Model* pinned = reader.get("a");
+    registry.publish("a", v2);
+    registry.collect();
+    REQUIRE_FALSE(old.expired());
+    REQUIRE(predict_row(*pinned, idx, val, 2) == 2 + 16 + 12);
+
+    // Readers pinned after the swap see the new model.
+    fastfm::ModelRegistry::Reader later(&registry);
+    REQUIRE(later.get("a") == v2.get());
+  }
+  registry.collect();
+  REQUIRE(old.expired());
+  REQUIRE(registry.n_retired() == 0);
+
+  // Hot reload from the model file while readers are running.
+  const std::string path = "model_registry_test.ffm";
+  m->save(path);
+  std::atomic<bool> done(false);
+  std::vector<std::thread> readers;
+  std::atomic<int> mismatches(0);
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&]() {
+      while (!done.load()) {
+        fastfm::ModelRegistry::Reader reader(&registry);
+        const double y = predict_row(*reader.route("ab", 1), idx, val, 2);
+        if (y != 2 + 16 + 12 && y != 3 + 16 + 12) ++mismatches;
+      }
+    });
+  }
+  std::string error;
+  for (int i = 0; i < 20; ++i) {
+    REQUIRE(registry.load("a", path, &error));
+    REQUIRE(registry.load("b", path, &error));
+    // Saving over the file keeps the mapped models valid.
+    if (i % 5 == 0) m->save(path);
+  }
+  done = true;
+  for (auto& reader : readers) reader.join();
+  REQUIRE(mismatches == 0);
+  registry.collect();
+  REQUIRE(registry.n_retired() == 0);
+
+  // A broken file is rejected, the published version stays.
+  const Model* published = nullptr;
+  {
+    fastfm::ModelRegistry::Reader reader(&registry);
+    published = reader.get("a");
+  }
+  REQUIRE_FALSE(registry.load("a", "missing_model_registry_test.ffm",
+                              &error));
+  REQUIRE(error.find("Can't open model file") == 0);
+  {
+    fastfm::ModelRegistry::Reader reader(&registry);
+    REQUIRE(reader.get("a") == published);
+  }
+
+  delete m;
+  std::remove(path.c_str());
+}
+
+TEST_CASE("NUMA placement", "[numa]") {
+  const std::vector<std::vector<int>> nodes = fastfm::numa::NodeCpus();
+  REQUIRE_FALSE(nodes.empty());
+  std::vector<int> usable;
+  for (const auto& node : nodes) {
+    REQUIRE_FALSE(node.empty());
+    usable.insert(usable.end(), node.begin(), node.end());
+  }
+
+  REQUIRE(fastfm::numa::WorkerCpus("none", 4).empty());
+  for (const std::string affinity : {"compact", "scatter"}) {
+    const std::vector<int> cpus = fastfm::numa::WorkerCpus(affinity, 5);
+    REQUIRE(cpus.size() == 5);
+    for (int cpu : cpus)
+      REQUIRE(std::find(usable.begin(), usable.end(), cpu) != usable.end());
+  }
+  // Scatter starts on a different node for the second worker.
+  if (nodes.size() > 1) {
+    const std::vector<int> cpus = fastfm::numa::WorkerCpus("scatter", 2);
+    REQUIRE(cpus[1] == nodes[1][0]);
+  }
+
+  fastfm::utils::DataGenerator generator(3000, {2, 5, 10}, {1, 1, 1});
+  SpMat x = generator.x_csc();
+  const std::vector<int> cpus = fastfm::numa::WorkerCpus("scatter", 3);
+  for (const std::string placement : {"default", "partitioned",
+                                      "interleaved"}) {
+    SpMat placed = fastfm::numa::PlacedCopy(placement, cpus, x);
+    REQUIRE(placed.nonZeros() == x.nonZeros());
+    REQUIRE((Matrix(placed) - Matrix(x)).norm() == 0);
+
+    // Binary matrices are copied with explicit ones.
+    Eigen::Map<SpMat> x_binary(x.rows(), x.cols(), x.nonZeros(),
+                               x.outerIndexPtr(), x.innerIndexPtr(), nullptr);
+    SpMat placed_binary = fastfm::numa::PlacedCopy(placement, cpus, x_binary);
+    REQUIRE(placed_binary.nonZeros() == x.nonZeros());
+    REQUIRE((Eigen::Map<Vector>(placed_binary.valuePtr(),
+                                placed_binary.nonZeros()).array() == 1).all());
+
+    Vector zeros = Vector::Constant(10000, 1);
+    fastfm::numa::PlacedZero(placement, cpus, zeros.data(),
+                             zeros.size() * sizeof(double));
+    REQUIRE(zeros.norm() == 0);
+  }
+
+  // Pinned threads still run every task once.
+  std::vector<int> runs(7, 0);
+  fastfm::parallel::ParallelFor(cpus, 3, runs.size(),
+                                [&runs](int task) { ++runs[task]; });
+  REQUIRE(std::count(runs.begin(), runs.end(), 1) == 7);
+}
@@ -0,0 +1,208 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <Eigen/Dense>
+
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../3rdparty/catch/catch.hpp"
+
+#include "fastfm.h"
+#include "fixture.h"
+#include "datasets.h"
+#include "fastfm_serve/batch_scheduler.h"
+#include "fastfm_serve/histogram.h"
+#include "fastfm_serve/model_loader.h"
+#include "fastfm_serve/protocol.h"
+
+using Matrix = Eigen::Matrix<double,
+                             Eigen::Dynamic,
+                             Eigen::Dynamic,
+                             Eigen::RowMajor>;
+
+TEST_CASE("Serve, histogram", "[serve]") {
+  fastfm::serve::Histogram histogram;
+  REQUIRE(histogram.percentile(0.5) == 0);
+  for (int i = 1; i <= 1000; ++i) histogram.record(i);
+  REQUIRE(histogram.count() == 1000);
+  REQUIRE(histogram.max() == 1000);
+  // Upper bucket bounds are within 19% of the exact percentiles.
+  REQUIRE(histogram.percentile(0.5) >= 500);
+  REQUIRE(histogram.percentile(0.5) <= 500 * 1.19);
+  REQUIRE(histogram.percentile(0.99) >= 990);
+  REQUIRE(histogram.percentile(0.99) <= 990 * 1.19);
+}
+
+TEST_CASE("Serve, parse request line", "[serve]") {
+  std::vector<int> idx;
+  std::vector<double> val;
+  std::string error;
+  REQUIRE(fastfm::serve::ParseRow("3:1.5 0:2\r", 4, &idx, &val, &error));
+  REQUIRE(idx == std::vector<int>({3, 0}));
+  REQUIRE(val == std::vector<double>({1.5, 2}));
+  REQUIRE(fastfm::serve::ParseRow("", 4, &idx, &val, &error));
+  REQUIRE(idx.empty());
+  REQUIRE_FALSE(fastfm::serve::ParseRow("4:1", 4, &idx, &val, &error));
+  REQUIRE_FALSE(fastfm::serve::ParseRow("1 2", 4, &idx, &val, &error));
+  REQUIRE_FALSE(fastfm::serve::ParseRow("1:x", 4, &idx, &val, &error));
+  REQUIRE(fastfm::serve::FormatPrediction(0.1) == "0.10000000000000001");
+}
+
+TEST_CASE("Serve, batch scheduler", "[serve]") {
+  fastfm::utils::DataGenerator generator(100, {2, 5, 10}, {1, 3, 2});
+  Matrix w3 = generator.w3();
+  Matrix w2 = generator.w2();
+  Vector w1 = generator.w1();
+  Model* m = fastfm::ModelFactory(generator.w0(), w1, w2, w3).get();
+  fastfm::SharedModel shared(m->snapshot());
+  RequestSpMat x = generator.x_csr();
+
+  fastfm::serve::SchedulerOptions options;
+  options.max_batch = 16;
+  options.max_delay_us = 20000;
+  options.n_threads = 2;
+  fastfm::serve::BatchScheduler scheduler(&shared, options);
+
+  // Concurrent clients, each submits one row at a time.
+  const int n_clients = 8;
+  std::vector<double> y(x.rows());
+  std::vector<std::thread> clients;
+  for (int c = 0; c < n_clients; ++c) {
+    clients.emplace_back([&, c]() {
+      for (int i = c; i < x.rows(); i += n_clients) {
+        const int begin = x.outerIndexPtr()[i];
+        const int end = x.outerIndexPtr()[i + 1];
+        std::vector<int> idx(x.innerIndexPtr() + begin,
+                             x.innerIndexPtr() + end);
+        std::vector<double> val(x.valuePtr() + begin, x.valuePtr() + end);
+        y[i] = scheduler.submit(idx, val).get();
+      }
+    });
+  }
+  for (auto& client : clients) client.join();
+
+  for (int i = 0; i < x.rows(); ++i) {
+    const int begin = x.outerIndexPtr()[i];
+    const int nnz = x.outerIndexPtr()[i + 1] - begin;
+    REQUIRE(y[i] == Approx(predict_row(*m, x.innerIndexPtr() + begin,
+                                       x.valuePtr() + begin, nnz)));
+  }
+  REQUIRE(scheduler.latency().count() == x.rows());
+  // Requests of the concurrent clients have been coalesced.
+  REQUIRE(scheduler.n_batches() < x.rows());
+  REQUIRE(scheduler.batch_size().max() <= options.max_batch);
+  REQUIRE(scheduler.stats().find("requests=100 ") == 0);
+
+  delete m;
+}
+
+TEST_CASE("Serve, reload a truncated model file", "[serve]") {
+  const std::string path = "serve_reload_test.ffm";
+  Matrix w3(2, 3);
+  w3 << 1, 2, 3,
+      4, 5, 6;
+  Matrix w2(2, 3);
+  w2 << 6, 0, 2,
+      5, 1, 0;
+  Vector w1(3);
+  w1 << 9, 8, 7;
+  double w0 = 2;
+  Model* m = fastfm::ModelFactory(&w0, w1, w2, w3).get();
+  m->save(path);
+
+  std::string error;
+  std::shared_ptr<const Model> model =
+      fastfm::serve::TryLoadModel(path, &error);
+  REQUIRE(model != nullptr);
+  fastfm::SharedModel shared(model);
+
+  // Replace the file with its first half, as left by a failed copy. The
+  // served model maps the old file, which is renamed over, not truncated.
+  std::string content;
+  {
+    std::ifstream in(path, std::ios::binary);
+    content.assign(std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>());
+  }
+  {
+    std::ofstream out(path + ".part", std::ios::binary | std::ios::trunc);
+    out.write(content.data(), content.size() / 2);
+  }
+  REQUIRE(std::rename((path + ".part").c_str(), path.c_str()) == 0);
+  REQUIRE(fastfm::serve::TryLoadModel(path, &error) == nullptr);
+  REQUIRE(error.find("Truncated model file") == 0);
+  REQUIRE(shared.load() == model);
+
+  std::remove(path.c_str());
+  REQUIRE(fastfm::serve::TryLoadModel(path, &error) == nullptr);
+  REQUIRE(error.find("Can't open model file") == 0);
+
+  // The model served before the failed reloads still predicts.
+  const int idx[] = {0, 2};
+  const double val[] = {1, 4};
+  REQUIRE(predict_row(*shared.load(), idx, val, 2)
+              == Approx(predict_row(*m, idx, val, 2)));
+
+  delete m;
+}
+
+TEST_CASE("Serve, reload a model file with corrupt keys", "[serve]") {
+  const std::string path = "serve_keys_test.ffm";
+  Matrix w2(2, 3);
+  w2 << 6, 0, 2,
+      5, 1, 0;
+  Vector w1(3);
+  w1 << 9, 8, 7;
+  double w0 = 2;
+  Vector values(2);
+  values << 1.1, 10.2;
+  Model* m = fastfm::ModelFactory(&w0, w1, w2).get();
+  m->add_scalar_map("one,ten", values.data(), values.size());
+  m->save(path);
+
+  // Drop the key separator, one key for two values.
+  std::string content;
+  {
+    std::ifstream in(path, std::ios::binary);
+    content.assign(std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>());
+  }
+  const size_t separator = content.find("one,ten");
+  REQUIRE(separator != std::string::npos);
+  content[separator + 3] = '_';
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(content.data(), content.size());
+  }
+
+  std::string error;
+  REQUIRE(fastfm::serve::TryLoadModel(path, &error) == nullptr);
+  REQUIRE(error.find("Scalar map keys") == 0);
+
+  // A failed open leaves the model untouched.
+  Vector w1_other = Vector::Zero(3);
+  Model* target = fastfm::ModelFactory(&w0, w1_other, w2).get();
+  REQUIRE_FALSE(target->try_open_mmap(path, &error));
+  REQUIRE(fastfm::Internal::get_impl(target)->coef_->getw1() == w1_other);
+
+  std::remove(path.c_str());
+  delete target;
+  delete m;
+}
@@ -0,0 +1,184 @@
+// Copyright (C) 2020 Palaimon GmbH
+//
+// Licensed under the GNU Affero General Public License, Version 3.0
+// (the "License"); you may not use this file except in compliance with
+// the License. You may obtain a copy of the License at
+//
+//      https://www.gnu.org/licenses/agpl-3.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Latency of scoring one request of candidates, each a sparse row.
+//
+// usage: fastfm_bench [n_features] [rank] [n_candidates] [nnz] [n_requests]
+
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "fastfm.h"
+
+using Matrix = Eigen::Matrix<double,
+                             Eigen::Dynamic,
+                             Eigen::Dynamic,
+                             Eigen::RowMajor>;
+using Vector = Eigen::VectorXd;
+using SpMat = Eigen::SparseMatrix<double, Eigen::ColMajor,
+                                  fastfm::sparse_index_t>;
+
+namespace {
+
+void Report(const char* name, std::vector<double> micros) {
+  std::sort(micros.begin(), micros.end());
+  auto percentile = [&micros](double p) {
+    return micros[static_cast<size_t>(p * (micros.size() - 1))];
+  };
+  std::printf("%-24s p50 %9.1f us  p99 %9.1f us  max %9.1f us\n", name,
+              percentile(0.5), percentile(0.99), micros.back());
+}
+
+std::vector<double> Time(int n_requests, const std::function<void()>& fn) {
+  std::vector<double> micros(n_requests);
+  fn();  // warm up
+  for (int r = 0; r < n_requests; ++r) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto stop = std::chrono::steady_clock::now();
+    micros[r] =
+        std::chrono::duration<double, std::micro>(stop - start).count();
+  }
+  return micros;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const int n_features = argc > 1 ? std::atoi(argv[1]) : 100000;
+  const int rank = argc > 2 ? std::atoi(argv[2]) : 32;
+  const int n_candidates = argc > 3 ? std::atoi(argv[3]) : 500;
+  const int nnz = argc > 4 ? std::atoi(argv[4]) : 30;
+  const int n_requests = argc > 5 ? std::atoi(argv[5]) : 200;
+  std::printf("n_features %d, rank %d, candidates %d, nnz %d\n",
+              n_features, rank, n_candidates, nnz);
+
+  std::mt19937 mt_rand(123);
+  std::normal_distribution<double> normal(0, 0.1);
+  std::uniform_int_distribution<int> feature(0, n_features - 1);
+
+  double w0 = 0.1;
+  Vector w1(n_features);
+  Matrix w2(rank, n_features);
+  for (int j = 0; j < n_features; ++j) {
+    w1(j) = normal(mt_rand);
+    for (int f = 0; f < rank; ++f) w2(f, j) = normal(mt_rand);
+  }
+  fastfm::Model model;
+  model.add_vector("w0", &w0, 1);
+  model.add_vector("w1", w1.data(), w1.size());
+  model.add_matrix("w2", w2.data(), w2.rows(), w2.cols(), true);
+
+  // One request: n_candidates CSR rows with nnz distinct features each.
+  std::vector<int> indptr(n_candidates + 1, 0);
+  std::vector<int> idx;
+  std::vector<double> val;
+  for (int i = 0; i < n_candidates; ++i) {
+    std::vector<int> row;
+    while (static_cast<int>(row.size()) < nnz) {
+      const int j = feature(mt_rand);
+      if (std::find(row.begin(), row.end(), j) == row.end()) row.push_back(j);
+    }
+    std::sort(row.begin(), row.end());
+    for (int j : row) {
+      idx.push_back(j);
+      val.push_back(1);
+    }
+    indptr[i + 1] = idx.size();
+  }
+  const std::vector<float> val_f(val.begin(), val.end());
+  std::vector<double> out(n_candidates);
+
+  std::shared_ptr<const fastfm::Model> snapshot = model.snapshot();
+  Report("predict_rows (snapshot)", Time(n_requests, [&]() {
+    fastfm::predict_rows(*snapshot, indptr.data(), idx.data(), val.data(),
+                         n_candidates, out.data());
+  }));
+
+  Report("predict_rows", Time(n_requests, [&]() {
+    fastfm::predict_rows(model, indptr.data(), idx.data(), val.data(),
+                         n_candidates, out.data());
+  }));
+  Report("predict_rows (float)", Time(n_requests, [&]() {
+    fastfm::predict_rows(model, indptr.data(), idx.data(), val_f.data(),
+                         n_candidates, out.data());
+  }));
+  Report("predict_row loop", Time(n_requests, [&]() {
+    for (int i = 0; i < n_candidates; ++i)
+      out[i] = fastfm::predict_row(model, idx.data() + indptr[i],
+                                   val.data() + indptr[i],
+                                   indptr[i + 1] - indptr[i]);
+  }));
+
+  // Reference: the Data based path including the CSR -> CSC conversion.
+  Report("Data + predict", Time(n_requests, [&]() {
+    Eigen::Map<const Eigen::SparseMatrix<double, Eigen::RowMajor>> csr(
+        n_candidates, n_features, idx.size(), indptr.data(), idx.data(),
+        val.data());
+    SpMat x(csr);
+    x.makeCompressed();
+    fastfm::Data data;
+    data.add_sparse_matrix("x", x.valuePtr(), x.rows(), x.cols(),
+                           x.nonZeros(), x.outerIndexPtr(),
+                           x.innerIndexPtr(), true);
+    data.add_vector("y_pred", out.data(), out.size());
+    fastfm::predict(&model, &data);
+  }));
+
+  // Shared context: the first 2/3 of the non-zeros of every candidate are
+  // the same context features.
+  const int ctx_nnz = 2 * nnz / 3;
+  std::vector<int> ctx_idx(idx.begin(), idx.begin() + ctx_nnz);
+  std::vector<double> ctx_val(ctx_nnz, 1);
+  std::vector<int> item_indptr(n_candidates + 1, 0);
+  std::vector<int> item_idx;
+  std::vector<int> joint_indptr(n_candidates + 1, 0);
+  std::vector<int> joint_idx;
+  for (int i = 0; i < n_candidates; ++i) {
+    for (int k = indptr[i] + ctx_nnz; k < indptr[i + 1]; ++k)
+      item_idx.push_back(idx[k]);
+    item_indptr[i + 1] = item_idx.size();
+    joint_idx.insert(joint_idx.end(), ctx_idx.begin(), ctx_idx.end());
+    joint_idx.insert(joint_idx.end(), item_idx.begin() + item_indptr[i],
+                     item_idx.end());
+    joint_indptr[i + 1] = joint_idx.size();
+  }
+  const std::vector<double> item_val(item_idx.size(), 1);
+  const std::vector<double> joint_val(joint_idx.size(), 1);
+  Report("full rows (snapshot)", Time(n_requests, [&]() {
+    fastfm::predict_rows(*snapshot, joint_indptr.data(), joint_idx.data(),
+                         joint_val.data(), n_candidates, out.data());
+  }));
+  Report("candidates (snapshot)", Time(n_requests, [&]() {
+    fastfm::predict_candidates(*snapshot, ctx_idx.data(), ctx_val.data(),
+                               ctx_nnz, item_indptr.data(), item_idx.data(),
+                               item_val.data(), n_candidates, out.data());
+  }));
+
+  model.quantize("int8");
+  Report("predict_rows (int8)", Time(n_requests, [&]() {
+    fastfm::predict_rows(model, indptr.data(), idx.data(), val.data(),
+                         n_candidates, out.data());
+  }));
+  return 0;
+}
@@ -5,9 +5,13 @@
 from libcpp.string cimport string
 from libcpp cimport bool
 from libcpp.map cimport map as cpp_map
+from libcpp.vector cimport vector
 
 cdef extern from "../../fastfm-core2/fastfm/fastfm.h" namespace "fastfm":
 
+    # int or int64_t, see FASTFM_INDEX64
+    ctypedef long long sparse_index_t
+
     cdef cppclass Settings:
         Settings()
         Settings(cpp_map[string, string] settings)
@@ -26,8 +30,9 @@ cdef extern from "../../fastfm-core2/fastfm/fastfm.h" namespace "fastfm":
         void add_matrix(const string name, double* data,
                         size_t rows, size_t cols, bool row_major)
         void add_sparse_matrix(const string name, double* data,
-                               size_t rows, size_t cols, int nnz,
-                               int* outer, int* inter, bool col_major)
+                               size_t rows, size_t cols, sparse_index_t nnz,
+                               sparse_index_t* outer, sparse_index_t* inter,
+                               bool col_major)
 
     ctypedef void* python_function_t
     ctypedef bool (*fit_callback_t)(string json_in, python_function_t python_func)
@@ -35,3 +40,5 @@ cdef extern from "../../fastfm-core2/fastfm/fastfm.h" namespace "fastfm":
     cdef void fit(Settings* s, Model* m, Data* d,
                   fit_callback_t callback, python_function_t python_callback_func)
     cdef void predict(Model* m, Data* d)
+    cdef vector[double] cross_validate(Settings* s, const Model* m, Data* d,
+                                       int n_folds, int n_threads)
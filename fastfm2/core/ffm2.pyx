@@ -6,7 +6,7 @@
 import json
 
 cimport cpp_ffm
-from cpp_ffm cimport Settings, Data, Model
+from cpp_ffm cimport Settings, Data, Model, sparse_index_t
 from libcpp.string cimport string
 from libcpp cimport bool
 from libcpp.map cimport map as cpp_map
@@ -45,6 +45,8 @@ cdef Model* _model_factory(np.ndarray[np.float64_t, ndim = 1] w_0,
 
 
 cdef _add_sparse_matrix(name, Data* d, X):
+    """ Maps X into d. The index arrays are converted to the index type of
+    the core library if needed, the returned arrays have to outlive d. """
     # get attributes from csc scipy
     n_features = X.shape[1]
     n_samples = X.shape[0]
@@ -53,12 +55,51 @@ cdef _add_sparse_matrix(name, Data* d, X):
     if not (sp.isspmatrix_csc(X) or sp.isspmatrix_csr(X)):
         raise Exception("matrix format is not supported")
 
-    cdef np.ndarray[int, ndim=1, mode='c'] inner = X.indices
-    cdef np.ndarray[int, ndim=1, mode='c'] outer = X.indptr
+    index_dtype = np.int64 if sizeof(sparse_index_t) == 8 else np.int32
+    if sizeof(sparse_index_t) == 4 and X.indptr[-1] > np.iinfo(np.int32).max:
+        raise Exception("more than 2^31 - 1 non-zeros require a core library "
+                        "built with FASTFM_INDEX64")
+    cdef np.ndarray inner = np.ascontiguousarray(X.indices, dtype=index_dtype)
+    cdef np.ndarray outer = np.ascontiguousarray(X.indptr, dtype=index_dtype)
     cdef np.ndarray[np.float64_t, ndim=1, mode='c'] data = X.data
 
     d.add_sparse_matrix(to_c_str(name), &data[0], n_samples, n_features, nnz,
-                        &outer[0], &inner[0], sp.isspmatrix_csc(X))
+                        <sparse_index_t*> outer.data,
+                        <sparse_index_t*> inner.data, sp.isspmatrix_csc(X))
+    return inner, outer
+
+
+cdef Settings* _settings_factory(dict settings):
+    #cdef Settings* s = new Settings(json.dumps(settings).encode())
+
+    cdef cpp_map[string, string] strmap
+
+    # py-cpp inconsistencies
+    # remove unused
+    if "l2_reg" in settings:         # used on py side only
+        del settings["l2_reg"]
+    if "init_stdev" in settings:     # used on py side only
+        del settings["init_stdev"]
+    if "random_state" in settings:   # used on py side only
+        del settings["random_state"]
+    if "rank" in settings:           # derived from V shape
+        del settings["rank"]
+    if "copy_X" in settings:         # inherited/unused
+        del settings["copy_X"]
+
+    # map that differs
+    if "l2_reg_w" in settings:
+        settings["l2_reg_w1"] = settings.pop("l2_reg_w")
+    if "l2_reg_V" in settings:
+        settings["l2_reg_w2"] = settings.pop("l2_reg_V")
+    if "n_iter" in settings:
+        settings['iter'] = settings.pop('n_iter')
+    if settings['loss'] != 'bpr' and "step_size" in settings:
+        settings["decay"] = str(-float(settings.pop("step_size")))
+
+    for i in settings.iterkeys():
+        strmap[to_c_str(i)] = to_c_str(settings[i])
+    return new Settings(strmap)
 
 
 def ffm_predict(np.ndarray[np.float64_t, ndim = 1] w_0,
@@ -75,7 +116,7 @@ def ffm_predict(np.ndarray[np.float64_t, ndim = 1] w_0,
     m = _model_factory(w_0, w, V)
 
     cdef Data *d = new Data()
-    _add_sparse_matrix("x", d, X)
+    x_index = _add_sparse_matrix("x", d, X)
     d.add_vector(to_c_str("y_pred"), &y[0], n_samples)
 
     cpp_ffm.predict(m, d)
@@ -115,7 +156,8 @@ def ffm_fit(np.ndarray[np.float64_t, ndim = 1] w_0,
             np.ndarray[np.float64_t, ndim = 1] x_c_cost=None,
             np.ndarray[np.float64_t, ndim = 1] x_i_cost=None,
             dict settings=None,
-            callback=None):
+            callback=None,
+            np.ndarray[np.float64_t, ndim = 1] feature_group=None):
 
     assert isinstance(settings, dict)
     n_samples = X.shape[0]
@@ -123,36 +165,7 @@ def ffm_fit(np.ndarray[np.float64_t, ndim = 1] w_0,
     if y is not None:
         assert n_samples == len(y) # test shapes
 
-    #cdef Settings* s = new Settings(json.dumps(settings).encode())
-
-    cdef cpp_map[string, string] strmap
-
-    # py-cpp inconsistencies
-    # remove unused
-    if "l2_reg" in settings:         # used on py side only
-        del settings["l2_reg"]
-    if "init_stdev" in settings:     # used on py side only
-        del settings["init_stdev"]
-    if "random_state" in settings:   # used on py side only
-        del settings["random_state"]
-    if "rank" in settings:           # derived from V shape
-        del settings["rank"]
-    if "copy_X" in settings:         # inherited/unused
-        del settings["copy_X"]
-
-    # map that differs
-    if "l2_reg_w" in settings:
-        settings["l2_reg_w1"] = settings.pop("l2_reg_w")
-    if "l2_reg_V" in settings:
-        settings["l2_reg_w2"] = settings.pop("l2_reg_V")
-    if "n_iter" in settings:
-        settings['iter'] = settings.pop('n_iter')
-    if settings['loss'] != 'bpr' and "step_size" in settings:
-        settings["decay"] = str(-float(settings.pop("step_size")))
-
-    for i in settings.iterkeys():
-        strmap[to_c_str(i)] = to_c_str(settings[i])
-    cdef Settings* s = new Settings(strmap)
+    cdef Settings* s = _settings_factory(settings)
 
     m = _model_factory(w_0, w, V)
     if keys is not None and values is not None:
@@ -166,7 +179,7 @@ def ffm_fit(np.ndarray[np.float64_t, ndim = 1] w_0,
                      <double*> mu_w2.data, mu_w2.size)
 
     cdef Data *d = new Data()
-    _add_sparse_matrix("x", d, X)
+    x_index = _add_sparse_matrix("x", d, X)
 
     if y_train_pred_ is not None:
         d.add_vector(to_c_str("y_train_pred"),
@@ -181,13 +194,17 @@ def ffm_fit(np.ndarray[np.float64_t, ndim = 1] w_0,
     if x_i_cost is not None:
         d.add_vector(to_c_str("x_i_cost"),
                      <double*> x_i_cost.data, x_i_cost.size)
+    if feature_group is not None:
+        assert X.shape[1] == feature_group.size
+        d.add_vector(to_c_str("feature_group"),
+                     <double*> feature_group.data, feature_group.size)
 
     if y is not None:
         d.add_vector(to_c_str("y_true"), &y[0], X.shape[0])
 
     if C is not None and I is not None:
-        _add_sparse_matrix("x_c", d, C)
-        _add_sparse_matrix("x_i", d, I)
+        c_index = _add_sparse_matrix("x_c", d, C)
+        i_index = _add_sparse_matrix("x_i", d, I)
         if settings['loss'] == 'bpr':
             assert X.shape[0] == C.shape[0]
             assert X.shape[1] == I.shape[1]
@@ -202,5 +219,34 @@ def ffm_fit(np.ndarray[np.float64_t, ndim = 1] w_0,
 
     return w_0, w, V
 
+def ffm_cross_validate(np.ndarray[np.float64_t, ndim = 1] w_0,
+                       np.ndarray[np.float64_t, ndim = 1] w,
+                       np.ndarray[np.float64_t, ndim = 2] V,
+                       X, np.ndarray[np.float64_t, ndim = 1] y,
+                       int n_folds, int n_threads=1,
+                       np.ndarray[np.float64_t, ndim = 1] cost=None,
+                       dict settings=None):
+    """ Held out error of each of n_folds folds, X is shared by all folds
+    and not copied. The parameters are used as initialization only. """
+    assert isinstance(settings, dict)
+    assert X.shape[0] == len(y)
+
+    cdef Settings* s = _settings_factory(settings)
+    m = _model_factory(w_0, w, V)
+
+    cdef Data *d = new Data()
+    x_index = _add_sparse_matrix("x", d, X)
+    d.add_vector(to_c_str("y_true"), &y[0], X.shape[0])
+    if cost is not None:
+        d.add_vector(to_c_str("cost"), <double*> cost.data, cost.size)
+
+    errors = cpp_ffm.cross_validate(s, m, d, n_folds, n_threads)
+
+    del d
+    del m
+    del s
+
+    return np.asarray(errors)
+
 IF not EXTERNAL_RELEASE:
     include "pre_release.pxi"
\ No newline at end of file